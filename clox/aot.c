@@ -0,0 +1,517 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "aot.h"
+#include "memory.h"
+
+typedef struct {
+    MemoryManager* mm;
+    Globals* globals;
+    FILE* out;
+    ObjFunction** functions; // Innermost first, so each one's constants are loaded before it.
+    int count;
+    int capacity;
+} Emitter;
+
+static void collectFunctions(Emitter* emitter, ObjFunction* function) {
+    ValueArray* constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (IS_FUNCTION(constants->values[i])) collectFunctions(emitter, AS_FUNCTION(constants->values[i]));
+    }
+
+    if (emitter->capacity < emitter->count + 1) {
+        int oldCapacity = emitter->capacity;
+        emitter->capacity = GROW_CAPACITY(oldCapacity);
+        emitter->functions = GROW_ARRAY(emitter->mm, ObjFunction*, emitter->functions, oldCapacity, emitter->capacity);
+    }
+    emitter->functions[emitter->count++] = function;
+}
+
+static int functionIndex(Emitter* emitter, ObjFunction* function) {
+    for (int i = 0; i < emitter->count; i++) {
+        if (emitter->functions[i] == function) return i;
+    }
+    return -1;
+}
+
+static void emitString(FILE* out, const char* chars, int length) {
+    fputc('"', out);
+    for (int i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)chars[i];
+        if (c == '"' || c == '\\' || c == '?') {
+            // '?' is escaped so that no string can spell a trigraph.
+            fprintf(out, "\\%c", c);
+        } else if (c >= ' ' && c <= '~') {
+            fputc(c, out);
+        } else {
+            fprintf(out, "\\%03o", c);
+        }
+    }
+    fputc('"', out);
+}
+
+static void emitConstant(Emitter* emitter, ObjFunction* function, uint8_t constant) {
+    Value value = function->chunk.constants.values[constant];
+    if (IS_INT(value)) {
+        fprintf(emitter->out, "INT_VAL(%d)", AS_INT(value));
+    } else if (IS_NUMBER(value)) {
+        fprintf(emitter->out, "NUMBER_VAL(%.17g)", AS_NUMBER(value));
+    } else {
+        fprintf(emitter->out, "constants[%d]", constant);
+    }
+}
+
+// Records the instruction's position where a runtime error would look for its line.
+static void emitPosition(Emitter* emitter, int offset) {
+    fprintf(emitter->out, "    frame->ip = code + %d;\n", offset + 1);
+}
+
+static uint16_t readShort(Chunk* chunk, int offset) {
+    return (uint16_t)((chunk->code[offset] << 8) | chunk->code[offset + 1]);
+}
+
+// A call may have moved the frames to make room, see call() in vm.c. Ours is back on top.
+static void emitReloadFrame(Emitter* emitter) {
+    fprintf(emitter->out, "    frame = &vm->frames[vm->frameCount - 1];\n");
+}
+
+static void emitNumberOp(Emitter* emitter, int offset, const char* operation) {
+    emitPosition(emitter, offset);
+    fprintf(emitter->out, "    AOT_NUMBER_OP(%s);\n", operation);
+}
+
+static void emitInvoke(Emitter* emitter, int offset, const char* runtime, uint8_t name, uint8_t argCount, int cache) {
+    emitPosition(emitter, offset);
+    fprintf(emitter->out, "    if (!%s(vm, AS_STRING(constants[%d]), %d, &caches[%d])) return false;\n",
+            runtime, name, argCount, cache);
+    emitReloadFrame(emitter);
+}
+
+static void emitProperty(Emitter* emitter, int offset, const char* runtime, uint8_t name, int cache) {
+    emitPosition(emitter, offset);
+    fprintf(emitter->out, "    if (!%s(vm, AS_STRING(constants[%d]), &caches[%d])) return false;\n",
+            runtime, name, cache);
+}
+
+static bool emitInstruction(Emitter* emitter, ObjFunction* function, int offset) {
+    FILE* out = emitter->out;
+    Chunk* chunk = &function->chunk;
+    uint8_t* code = chunk->code + offset;
+
+    switch (code[0]) {
+        case OP_CONSTANT:
+            fprintf(out, "    aotPush(vm, ");
+            emitConstant(emitter, function, code[1]);
+            fprintf(out, ");\n");
+            return true;
+        case OP_NIL:
+            fprintf(out, "    aotPush(vm, NIL_VAL);\n");
+            return true;
+        case OP_TRUE:
+            fprintf(out, "    aotPush(vm, TRUE_VAL);\n");
+            return true;
+        case OP_FALSE:
+            fprintf(out, "    aotPush(vm, FALSE_VAL);\n");
+            return true;
+        case OP_POP:
+            fprintf(out, "    vm->stackTop--;\n");
+            return true;
+        case OP_POP_LOCAL:
+            fprintf(out, "    aotPopLocal(vm);\n");
+            return true;
+        case OP_GET_LOCAL:
+            fprintf(out, "    aotPush(vm, frame->slots[%d]);\n", code[1]);
+            return true;
+        case OP_SET_LOCAL:
+            fprintf(out, "    frame->slots[%d] = vm->stackTop[-1];\n", code[1]);
+            return true;
+        case OP_POP_GET_GLOBAL:
+            fprintf(out, "    vm->stackTop[-1] = vm->globals.values[%d];\n", code[1]);
+            return true;
+        case OP_GET_GLOBAL:
+            fprintf(out, "    aotPush(vm, vm->globals.values[%d]);\n", code[1]);
+            return true;
+        case OP_DEFINE_GLOBAL:
+            fprintf(out, "    vm->globals.values[%d] = aotPop(vm);\n", code[1]);
+            return true;
+        case OP_SET_GLOBAL:
+            fprintf(out, "    vm->globals.values[%d] = vm->stackTop[-1];\n", code[1]);
+            return true;
+        case OP_GET_UPVALUE:
+            fprintf(out, "    aotPush(vm, *frame->closure->upvalues[%d]->location);\n", code[1]);
+            return true;
+        case OP_SET_UPVALUE:
+            fprintf(out, "    *frame->closure->upvalues[%d]->location = vm->stackTop[-1];\n", code[1]);
+            return true;
+        case OP_EQUAL:
+            fprintf(out, "    aotEqual(vm);\n");
+            return true;
+        case OP_GREATER:
+            emitNumberOp(emitter, offset, "greaterNumbers");
+            return true;
+        case OP_LESS_CONSTANT:
+            fprintf(out, "    aotPush(vm, ");
+            emitConstant(emitter, function, code[1]);
+            fprintf(out, ");\n");
+            emitNumberOp(emitter, offset, "lessNumbers");
+            return true;
+        case OP_LESS:
+            emitNumberOp(emitter, offset, "lessNumbers");
+            return true;
+        case OP_ADD_CONSTANT:
+            fprintf(out, "    aotPush(vm, ");
+            emitConstant(emitter, function, code[1]);
+            fprintf(out, ");\n");
+            emitPosition(emitter, offset);
+            fprintf(out, "    AOT_ADD();\n");
+            return true;
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+            emitPosition(emitter, offset);
+            fprintf(out, "    AOT_ADD();\n");
+            return true;
+        case OP_SUBTRACT_CONSTANT:
+            fprintf(out, "    aotPush(vm, ");
+            emitConstant(emitter, function, code[1]);
+            fprintf(out, ");\n");
+            emitNumberOp(emitter, offset, "subtractNumbers");
+            return true;
+        case OP_SUBTRACT:
+            emitNumberOp(emitter, offset, "subtractNumbers");
+            return true;
+        case OP_MULTIPLY:
+            emitNumberOp(emitter, offset, "multiplyNumbers");
+            return true;
+        case OP_DIVIDE:
+            emitNumberOp(emitter, offset, "divideNumbers");
+            return true;
+        case OP_NOT:
+            fprintf(out, "    vm->stackTop[-1] = BOOL_VAL(aotFalsey(vm->stackTop[-1]));\n");
+            return true;
+        case OP_NEGATE:
+            emitPosition(emitter, offset);
+            fprintf(out, "    if (!IS_NUMBER(vm->stackTop[-1])) return aotError(vm, \"Operand must be a number.\");\n");
+            fprintf(out, "    vm->stackTop[-1] = negateNumber(vm->stackTop[-1]);\n");
+            return true;
+        case OP_PRINT:
+            fprintf(out, "    aotPrint(vm);\n");
+            return true;
+        case OP_JUMP:
+        case OP_LOOP:
+            fprintf(out, "    goto L%d;\n", jumpTarget(chunk, offset));
+            return true;
+        case OP_JUMP_IF_FALSE:
+            fprintf(out, "    if (aotFalsey(vm->stackTop[-1])) goto L%d;\n", jumpTarget(chunk, offset));
+            return true;
+        case OP_JUMP_IF_FALSE_POP:
+            fprintf(out, "    if (aotFalsey(vm->stackTop[-1])) goto L%d;\n", jumpTarget(chunk, offset));
+            fprintf(out, "    vm->stackTop--;\n");
+            return true;
+        case OP_CALL:
+            emitPosition(emitter, offset);
+            fprintf(out, "    if (!aotCall(vm, %d)) return false;\n", code[1]);
+            emitReloadFrame(emitter);
+            return true;
+        case OP_CALL_LOCAL:
+            emitPosition(emitter, offset);
+            fprintf(out, "    if (!aotCallLocal(vm, %d)) return false;\n", code[1]);
+            emitReloadFrame(emitter);
+            return true;
+        case OP_TAIL_CALL:
+            emitPosition(emitter, offset);
+            fprintf(out, "    return aotTailCall(vm, frame, %d);\n", code[1]);
+            return true;
+        case OP_GET_GLOBAL_INVOKE:
+            fprintf(out, "    aotPush(vm, vm->globals.values[%d]);\n", code[1]);
+            emitInvoke(emitter, offset, "aotInvoke", code[2], code[3], readShort(chunk, offset + 4));
+            return true;
+        case OP_INVOKE:
+            emitInvoke(emitter, offset, "aotInvoke", code[1], code[2], readShort(chunk, offset + 3));
+            return true;
+        case OP_SUPER_INVOKE:
+            emitInvoke(emitter, offset, "aotSuperInvoke", code[1], code[2], readShort(chunk, offset + 3));
+            return true;
+        case OP_CLOSURE: {
+            ObjFunction* closed = AS_FUNCTION(chunk->constants.values[code[1]]);
+            if (closed->upvalueCount == 0) {
+                fprintf(out, "    aotClosure(vm, frame, AS_FUNCTION(constants[%d]), NULL);\n", code[1]);
+                return true;
+            }
+            fprintf(out, "    aotClosure(vm, frame, AS_FUNCTION(constants[%d]), (const uint8_t[]){", code[1]);
+            for (int i = 0; i < closed->upvalueCount; i++) {
+                fprintf(out, "%s%d, %d", i == 0 ? " " : ", ", code[2 + 2 * i], code[3 + 2 * i]);
+            }
+            fprintf(out, " });\n");
+            return true;
+        }
+        case OP_CLOSE_UPVALUE:
+            fprintf(out, "    aotCloseUpvalue(vm);\n");
+            return true;
+        case OP_NIL_RETURN:
+            fprintf(out, "    aotPush(vm, NIL_VAL);\n");
+            fprintf(out, "    return aotReturn(vm, frame);\n");
+            return true;
+        case OP_RETURN_LOCAL:
+            fprintf(out, "    aotPush(vm, frame->slots[%d]);\n", code[1]);
+            fprintf(out, "    return aotReturn(vm, frame);\n");
+            return true;
+        case OP_RETURN:
+            fprintf(out, "    return aotReturn(vm, frame);\n");
+            return true;
+        case OP_CLASS:
+            fprintf(out, "    aotPush(vm, OBJ_VAL(newClass(vm->mm, AS_STRING(constants[%d]))));\n", code[1]);
+            return true;
+        case OP_INHERIT:
+            emitPosition(emitter, offset);
+            fprintf(out, "    if (!aotInherit(vm)) return false;\n");
+            return true;
+        case OP_METHOD:
+            fprintf(out, "    aotMethod(vm, AS_STRING(constants[%d]));\n", code[1]);
+            return true;
+        case OP_GET_SUPER:
+            emitPosition(emitter, offset);
+            fprintf(out, "    if (!aotGetSuper(vm, AS_STRING(constants[%d]))) return false;\n", code[1]);
+            return true;
+        case OP_GET_LOCAL_PROPERTY:
+            fprintf(out, "    aotPush(vm, frame->slots[%d]);\n", code[1]);
+            emitProperty(emitter, offset, "loadProperty", code[2], readShort(chunk, offset + 3));
+            return true;
+        case OP_GET_PROPERTY:
+            emitProperty(emitter, offset, "loadProperty", code[1], readShort(chunk, offset + 2));
+            return true;
+        case OP_SET_PROPERTY:
+            emitProperty(emitter, offset, "storeProperty", code[1], readShort(chunk, offset + 2));
+            return true;
+        case OP_BUILD_LIST:
+            fprintf(out, "    aotBuildList(vm, %d);\n", code[1]);
+            return true;
+        case OP_BUILD_MAP:
+            emitPosition(emitter, offset);
+            fprintf(out, "    if (!aotBuildMap(vm, %d)) return false;\n", code[1]);
+            return true;
+        case OP_GET_INDEX:
+            emitPosition(emitter, offset);
+            fprintf(out, "    if (!loadIndex(vm)) return false;\n");
+            return true;
+        case OP_SET_INDEX:
+            emitPosition(emitter, offset);
+            fprintf(out, "    if (!storeIndex(vm)) return false;\n");
+            return true;
+        default:
+            // Register instructions only appear once a chunk has been translated for run().
+            fprintf(stderr, "Cannot emit C for opcode %d.\n", code[0]);
+            return false;
+    }
+}
+
+static bool emitFunction(Emitter* emitter, int index) {
+    FILE* out = emitter->out;
+    ObjFunction* function = emitter->functions[index];
+    Chunk* chunk = &function->chunk;
+
+    fprintf(out, "static const int lines%d[] = {", index);
+    for (int i = 0; i < chunk->count; i++) {
+        fprintf(out, "%s%d", i % 16 == 0 ? "\n    " : " ", chunk->lines[i]);
+        if (i < chunk->count - 1) fputc(',', out);
+    }
+    fprintf(out, "\n};\n\n");
+    if (function->ownedSlotCount > 0) {
+        fprintf(out, "static const uint8_t ownedSlots%d[] = {", index);
+        for (int i = 0; i < function->ownedSlotCount; i++) {
+            fprintf(out, "%s%d", i == 0 ? "" : ", ", function->ownedSlots[i]);
+        }
+        fprintf(out, "};\n\n");
+    }
+
+    fprintf(out, "// %s\n", function->name == NULL ? "<script>" : function->name->chars);
+    fprintf(out, "static bool function%d(VM* vm, CallFrame* frame) {\n", index);
+    fprintf(out, "    Value* constants = frame->function->chunk.constants.values;\n");
+    fprintf(out, "    InlineCache* caches = frame->function->chunk.caches;\n");
+    fprintf(out, "    uint8_t* code = frame->function->chunk.code;\n");
+    fprintf(out, "    (void)constants;\n    (void)caches;\n    (void)code;\n\n");
+
+    bool* isTarget = ALLOCATE(emitter->mm, bool, chunk->count + 1);
+    for (int i = 0; i <= chunk->count; i++) isTarget[i] = false;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        if (isJumpInstruction(chunk->code[offset])) isTarget[jumpTarget(chunk, offset)] = true;
+    }
+
+    bool ok = true;
+    for (int offset = 0; ok && offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        if (isTarget[offset]) fprintf(out, "L%d:\n", offset);
+        ok = emitInstruction(emitter, function, offset);
+    }
+    FREE_ARRAY(emitter->mm, bool, isTarget, chunk->count + 1);
+
+    fprintf(out, "}\n\n");
+    return ok;
+}
+
+static void emitLoader(Emitter* emitter) {
+    FILE* out = emitter->out;
+    fprintf(out, "static ObjFunction* load(VM* vm) {\n");
+    fprintf(out, "    ObjFunction* functions[%d];\n\n", emitter->count);
+    for (int i = 0; i < emitter->globals->count; i++) {
+        ObjString* identifier = emitter->globals->identifiers[i];
+        fprintf(out, "    aotGlobal(vm, %d, ", i);
+        emitString(out, identifier->chars, identifier->length);
+        fprintf(out, ", %d);\n", identifier->length);
+    }
+    for (int i = 0; i < emitter->count; i++) {
+        ObjFunction* function = emitter->functions[i];
+        Chunk* chunk = &function->chunk;
+
+        fprintf(out, "\n    functions[%d] = aotFunction(vm, function%d, ", i, i);
+        if (function->name == NULL) {
+            fprintf(out, "NULL");
+        } else {
+            emitString(out, function->name->chars, function->name->length);
+        }
+        fprintf(out, ", %d, %d, %d, %s, ", function->arity, function->upvalueCount,
+                function->stackSize, function->thisEscapes ? "true" : "false");
+        if (function->ownedSlotCount > 0) {
+            fprintf(out, "ownedSlots%d, %d, ", i, function->ownedSlotCount);
+        } else {
+            fprintf(out, "NULL, 0, ");
+        }
+        fprintf(out, "lines%d, %d, %d);\n", i, chunk->count, chunk->cacheCount);
+
+        for (int c = 0; c < chunk->constants.count; c++) {
+            Value value = chunk->constants.values[c];
+            if (IS_NUMBER(value)) {
+                fprintf(out, "    aotNumberConstant(vm, %.17g);\n", AS_NUMBER(value));
+            } else if (IS_STRING(value)) {
+                fprintf(out, "    aotStringConstant(vm, ");
+                emitString(out, AS_STRING(value)->chars, AS_STRING(value)->length);
+                fprintf(out, ", %d);\n", AS_STRING(value)->length);
+            } else {
+                fprintf(out, "    aotFunctionConstant(vm, functions[%d]);\n",
+                        functionIndex(emitter, AS_FUNCTION(value)));
+            }
+        }
+    }
+    fprintf(out, "    return functions[%d];\n", emitter->count - 1);
+    fprintf(out, "}\n\n");
+    fprintf(out, "int main(void) {\n");
+    fprintf(out, "    return aotMain(load);\n");
+    fprintf(out, "}\n");
+}
+
+bool emitC(VM* vm, FILE* out, ObjFunction* script) {
+    MemoryManager* mm = vm->mm;
+    Value root = OBJ_VAL(script);
+    pushStack(mm, &root);
+
+    Emitter emitter;
+    emitter.mm = mm;
+    emitter.globals = &vm->globals;
+    emitter.out = out;
+    emitter.functions = NULL;
+    emitter.count = 0;
+    emitter.capacity = 0;
+    collectFunctions(&emitter, script);
+
+    fprintf(out, "// Generated by clox --emit-c. Link against CloxLib.\n\n");
+    fprintf(out, "#include \"aot.h\"\n\n");
+    for (int i = 0; i < emitter.count; i++) {
+        fprintf(out, "static bool function%d(VM* vm, CallFrame* frame);\n", i);
+    }
+    fprintf(out, "\n");
+
+    bool ok = true;
+    for (int i = 0; ok && i < emitter.count; i++) ok = emitFunction(&emitter, i);
+    if (ok) emitLoader(&emitter);
+
+    FREE_ARRAY(mm, ObjFunction*, emitter.functions, emitter.capacity);
+    popStack(mm);
+    return ok;
+}
+
+ObjFunction* aotFunction(VM* vm, AotFn body, const char* name, int arity, int upvalueCount,
+                         int stackSize, bool thisEscapes, const uint8_t* ownedSlots,
+                         int ownedSlotCount, const int* lines, int count, int cacheCount) {
+    MemoryManager* mm = vm->mm;
+    ObjFunction* function = newFunction(mm);
+    aotPush(vm, OBJ_VAL(function));
+
+    function->compiled = body;
+    function->arity = arity;
+    function->upvalueCount = upvalueCount;
+    function->stackSize = stackSize;
+    function->thisEscapes = thisEscapes;
+    if (ownedSlotCount > 0) {
+        function->ownedSlots = ALLOCATE(mm, uint8_t, ownedSlotCount);
+        memcpy(function->ownedSlots, ownedSlots, ownedSlotCount);
+        function->ownedSlotCount = ownedSlotCount;
+    }
+    if (name != NULL) function->name = copyString(mm, &vm->strings, name, (int)strlen(name));
+
+    // The code is never run. It is there so that frame->ip can point at an instruction's line.
+    for (int i = 0; i < count; i++) writeChunk(mm, &function->chunk, OP_RETURN, lines[i]);
+    for (int i = 0; i < cacheCount; i++) addInlineCache(mm, &function->chunk);
+    return function;
+}
+
+void aotGlobal(VM* vm, int index, const char* name, int length) {
+    // Natives are already there, defined the same way as when the script was compiled.
+    if (index < vm->globals.count) return;
+
+    ObjString* identifier = copyString(vm->mm, &vm->strings, name, length);
+    vm->globals.values[index] = NIL_VAL;
+    vm->globals.identifiers[index] = identifier;
+    vm->globals.count = index + 1;
+}
+
+static ObjFunction* loadingFunction(VM* vm) {
+    return AS_FUNCTION(vm->stackTop[-1]);
+}
+
+void aotNumberConstant(VM* vm, double number) {
+    addConstant(vm->mm, &loadingFunction(vm)->chunk, numberValue(number));
+}
+
+void aotStringConstant(VM* vm, const char* chars, int length) {
+    ObjString* string = copyString(vm->mm, &vm->strings, chars, length);
+    addConstant(vm->mm, &loadingFunction(vm)->chunk, OBJ_VAL(string));
+}
+
+void aotFunctionConstant(VM* vm, ObjFunction* function) {
+    addConstant(vm->mm, &loadingFunction(vm)->chunk, OBJ_VAL(function));
+}
+
+int aotMain(AotLoadFn load) {
+    MemoryManager mm;
+    initMemoryManager(&mm);
+
+    VM vm;
+    initVM(&vm, &mm);
+    vm.jitEnabled = false;
+
+    // Every Lox call nests a few C calls here, so the frame limit is what keeps the C stack from
+    // overflowing first. This many stays well inside the usual 8MB.
+    StackLimits limits = vm.stackLimits;
+    limits.maxFrames = AOT_FRAMES_MAX;
+    setStackLimits(&vm, limits);
+
+    MemoryComponent vmComponent;
+    vmComponent.data = &vm;
+    vmComponent.markRoots = markVMRoots;
+    vmComponent.handleWeakReferences = handleWeakVMReferences;
+    vmComponent.next = mm.memoryComponents;
+    mm.memoryComponents = &vmComponent;
+
+    mm.dataStack = &vm;
+    mm.pushStack = pushStackVM;
+    mm.popStack = popStackVM;
+
+    initNativeFunctionEnvironment(&vm);
+    internBuiltinStrings(&vm);
+
+    InterpretResult result = aotRun(&vm, load(&vm));
+
+    mm.memoryComponents = vmComponent.next;
+    freeVM(&vm);
+    freeMemoryManager(&mm);
+    return result == INTERPRET_RUNTIME_ERROR ? 70 : 0;
+}
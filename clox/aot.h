@@ -0,0 +1,91 @@
+#ifndef CLOX_AOT_H
+#define CLOX_AOT_H
+
+#include <stdio.h>
+
+#include "vm.h"
+
+// Lowers a compiled script and every function nested in it to a C program, one C function per
+// Lox function with a label per jump target in place of the dispatch loop. The program links
+// against CloxLib, which provides the object model, the collector and the runtime below.
+bool emitC(VM* vm, FILE* out, ObjFunction* script);
+
+// Everything from here on is called by emitted code.
+
+#define AOT_FRAMES_MAX (1 << 14)
+
+typedef ObjFunction* (*AotLoadFn)(VM* vm);
+
+// Sets up a VM the way main.c does, loads the program and runs it. Returns the exit code.
+int aotMain(AotLoadFn load);
+
+// Globals are loaded first, at the indices the compiler gave them, then functions innermost
+// first. aotFunction leaves the new function on the stack, where it stays reachable while the
+// constants that follow are added to it; aotRun clears the stack.
+void aotGlobal(VM* vm, int index, const char* name, int length);
+ObjFunction* aotFunction(VM* vm, AotFn body, const char* name, int arity, int upvalueCount,
+                         int stackSize, bool thisEscapes, const uint8_t* ownedSlots,
+                         int ownedSlotCount, const int* lines, int count, int cacheCount);
+void aotNumberConstant(VM* vm, double number);
+void aotStringConstant(VM* vm, const char* chars, int length);
+void aotFunctionConstant(VM* vm, ObjFunction* function);
+InterpretResult aotRun(VM* vm, ObjFunction* script);
+
+// Instructions too big to spell out in every function, implemented in vm.c. Those returning
+// bool return false after reporting a runtime error, and the emitted function returns false
+// straight away.
+bool aotError(VM* vm, const char* message);
+bool aotAdd(VM* vm);
+void aotBuildList(VM* vm, int count);
+bool aotBuildMap(VM* vm, int count);
+void aotEqual(VM* vm);
+void aotPrint(VM* vm);
+bool aotCall(VM* vm, int argCount);
+bool aotCallLocal(VM* vm, int argCount);
+void aotPopLocal(VM* vm);
+bool aotInvoke(VM* vm, ObjString* name, int argCount, InlineCache* cache);
+bool aotSuperInvoke(VM* vm, ObjString* name, int argCount, InlineCache* cache);
+bool aotReturn(VM* vm, CallFrame* frame);
+// Returns with the callee's frame in place of the caller's, or makes an ordinary call and returns
+// its result.
+bool aotTailCall(VM* vm, CallFrame* frame, int argCount);
+void aotClosure(VM* vm, CallFrame* frame, ObjFunction* function, const uint8_t* upvalues);
+void aotCloseUpvalue(VM* vm);
+bool aotInherit(VM* vm);
+void aotMethod(VM* vm, ObjString* name);
+bool aotGetSuper(VM* vm, ObjString* name);
+
+static inline void aotPush(VM* vm, Value value) {
+    *vm->stackTop++ = value;
+}
+
+static inline Value aotPop(VM* vm) {
+    return *--vm->stackTop;
+}
+
+static inline bool aotFalsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+#define AOT_NUMBER_OP(operation) \
+    do { \
+        Value b = vm->stackTop[-1]; \
+        Value a = vm->stackTop[-2]; \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) return aotError(vm, "Operands must be numbers."); \
+        vm->stackTop[-2] = operation(a, b); \
+        vm->stackTop--; \
+    } while (false)
+
+#define AOT_ADD() \
+    do { \
+        Value b = vm->stackTop[-1]; \
+        Value a = vm->stackTop[-2]; \
+        if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+            vm->stackTop[-2] = addNumbers(a, b); \
+            vm->stackTop--; \
+        } else if (!aotAdd(vm)) { \
+            return false; \
+        } \
+    } while (false)
+
+#endif //CLOX_AOT_H
@@ -0,0 +1,488 @@
+// Reports how well the string hash spreads realistic identifiers over the tables in table.c: the
+// groups probed for every key in the intern table, and how fast interning runs. Then it times
+// Table against the linear probing it replaced, on tables shaped like the intern table, the
+// globals and classes' method and field tables. Identifiers come from generated sets resembling
+// the names programs use, and from any Lox scripts given on the command line. With the first set,
+// it also checks that interning stays as fast while strings come and go for a long time.
+//
+//     clox-tablebench [script.lox ...]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "file.h"
+#include "memory.h"
+#include "object.h"
+#include "scanner.h"
+#include "table.h"
+#include "vm.h"
+
+#define LOOKUPS 4000000
+#define INTERN_ROUNDS 20
+#define CHURN_ROUNDS 5000
+#define CHURN_BATCH 200
+
+typedef struct {
+    ObjString** names;
+    int count;
+    int capacity;
+} NameSet;
+
+static NameSet* liveSet = NULL;
+
+static void markNames(void* data) {
+    VM* vm = (VM*)data;
+    markVMRoots(vm);
+    if (liveSet == NULL) return;
+    for (int i = 0; i < liveSet->count; i++) {
+        markObject(vm->mm, (Obj*)liveSet->names[i]);
+    }
+}
+
+static void addName(VM* vm, NameSet* set, const char* chars, int length) {
+    // Grown first, as the new name is not reachable until it is in the set.
+    if (set->count == set->capacity) {
+        int capacity = GROW_CAPACITY(set->capacity);
+        set->names = GROW_ARRAY(vm->mm, ObjString*, set->names, set->capacity, capacity);
+        set->capacity = capacity;
+    }
+    ObjString* name = copyString(vm->mm, &vm->strings, chars, length);
+    for (int i = 0; i < set->count; i++) {
+        if (set->names[i] == name) return;
+    }
+    set->names[set->count++] = name;
+}
+
+static void freeNames(VM* vm, NameSet* set) {
+    FREE_ARRAY(vm->mm, ObjString*, set->names, set->capacity);
+}
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec * 1e-9;
+}
+
+// The layout Table had before it probed groups of control bytes: linear probing over the entries
+// themselves, with a NULL key and a nil value marking an empty slot and a NULL key and true a
+// tombstone. Kept to time the two against each other. Its lookups are not inlined, as Table's
+// cannot be from here either.
+#define NOINLINE __attribute__((noinline))
+
+typedef struct {
+    MemoryManager* memoryManager;
+    int count;
+    int capacity;
+    Entry* entries;
+} LinearTable;
+
+static void initLinear(LinearTable* table, MemoryManager* mm) {
+    table->memoryManager = mm;
+    table->count = 0;
+    table->capacity = 0;
+    table->entries = NULL;
+}
+
+static void freeLinear(LinearTable* table) {
+    FREE_ARRAY(table->memoryManager, Entry, table->entries, table->capacity);
+    initLinear(table, table->memoryManager);
+}
+
+static Entry* linearFind(Entry* entries, int capacity, ObjString* key) {
+    uint32_t index = key->hash & (capacity - 1);
+    Entry* tombstone = NULL;
+    for (;;) {
+        Entry* entry = &entries[index];
+        if (entry->key == NULL) {
+            if (IS_NIL(entry->value)) return tombstone != NULL ? tombstone : entry;
+            if (tombstone == NULL) tombstone = entry;
+        } else if (entry->key == key) {
+            return entry;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+static void linearSet(LinearTable* table, ObjString* key, Value value) {
+    if (table->count + 1 > table->capacity * 0.75) {
+        int capacity = GROW_CAPACITY(table->capacity);
+        Entry* entries = ALLOCATE(table->memoryManager, Entry, capacity);
+        for (int i = 0; i < capacity; i++) {
+            entries[i].key = NULL;
+            entries[i].value = NIL_VAL;
+        }
+        table->count = 0;
+        for (int i = 0; i < table->capacity; i++) {
+            Entry* entry = &table->entries[i];
+            if (entry->key == NULL) continue;
+            *linearFind(entries, capacity, entry->key) = *entry;
+            table->count++;
+        }
+        FREE_ARRAY(table->memoryManager, Entry, table->entries, table->capacity);
+        table->entries = entries;
+        table->capacity = capacity;
+    }
+    Entry* entry = linearFind(table->entries, table->capacity, key);
+    if (entry->key == NULL && IS_NIL(entry->value)) table->count++;
+    entry->key = key;
+    entry->value = value;
+}
+
+NOINLINE static bool linearGet(LinearTable* table, ObjString* key, Value* value) {
+    if (table->count == 0) return false;
+    Entry* entry = linearFind(table->entries, table->capacity, key);
+    if (entry->key == NULL) return false;
+    *value = entry->value;
+    return true;
+}
+
+NOINLINE static ObjString* linearFindString(LinearTable* table, const char* chars, int length, uint32_t hash) {
+    if (table->count == 0) return NULL;
+    uint32_t index = hash & (table->capacity - 1);
+    for (;;) {
+        Entry* entry = &table->entries[index];
+        if (entry->key == NULL) {
+            if (IS_NIL(entry->value)) return NULL;
+        } else if (entry->key->length == length && entry->key->hash == hash &&
+                   memcmp(entry->key->chars, chars, length) == 0) {
+            return entry->key;
+        }
+        index = (index + 1) & (table->capacity - 1);
+    }
+}
+
+// A Table or a LinearTable, so that each workload below is written once and run on both.
+typedef struct {
+    bool linear;
+    Table table;
+    LinearTable linearTable;
+} AnyTable;
+
+static void initAny(AnyTable* table, bool linear, MemoryManager* mm) {
+    table->linear = linear;
+    initTable(&table->table, mm);
+    initLinear(&table->linearTable, mm);
+}
+
+static void freeAny(AnyTable* table) {
+    freeTable(&table->table);
+    freeLinear(&table->linearTable);
+}
+
+static void anySet(AnyTable* table, ObjString* key, Value value) {
+    if (table->linear) {
+        linearSet(&table->linearTable, key, value);
+    } else {
+        tableSet(&table->table, key, value);
+    }
+}
+
+static inline bool anyGet(AnyTable* table, ObjString* key, Value* value) {
+    return table->linear ? linearGet(&table->linearTable, key, value) : tableGet(&table->table, key, value);
+}
+
+static inline ObjString* anyFindString(AnyTable* table, ObjString* string) {
+    return table->linear
+           ? linearFindString(&table->linearTable, string->chars, string->length, string->hash)
+           : tableFindString(&table->table, string->chars, string->length, string->hash);
+}
+
+static void reportProbes(const char* label, Table* table) {
+    static const int limits[] = {1, 2, 3, 4, 8, 16};
+    int buckets[7] = {0};
+    long total = 0;
+    int longest = 0;
+    int keys = 0;
+
+    for (int i = 0; i < table->capacity; i++) {
+        if (table->entries[i].key == NULL) continue;
+        int probes = tableProbeLength(table, table->entries[i].key);
+        int bucket = 0;
+        while (bucket < 6 && probes > limits[bucket]) bucket++;
+        buckets[bucket]++;
+        total += probes;
+        if (probes > longest) longest = probes;
+        keys++;
+    }
+    if (keys == 0) return;
+
+    printf("  %-26s %6d keys %7d slots  mean %5.2f  max %3d |", label, keys, table->capacity,
+           (double)total / keys, longest);
+    for (int i = 0; i < 7; i++) printf(" %5.1f%%", 100.0 * buckets[i] / keys);
+    printf("\n");
+}
+
+static void internThroughput(VM* vm, NameSet* set) {
+    long bytes = 0;
+    for (int i = 0; i < set->count; i++) bytes += set->names[i]->length;
+
+    double start = now();
+    for (int round = 0; round < INTERN_ROUNDS; round++) {
+        for (int i = 0; i < set->count; i++) {
+            ObjString* name = set->names[i];
+            if (copyString(vm->mm, &vm->strings, name->chars, name->length) != name) {
+                fprintf(stderr, "Interning %s found another string.\n", name->chars);
+                exit(1);
+            }
+        }
+    }
+    double elapsed = now() - start;
+    long lookups = (long)INTERN_ROUNDS * set->count;
+    printf("  interning (hash + lookup)  %6.1f ns/name  %7.1f MB/s\n",
+           elapsed * 1e9 / lookups, (double)bytes * INTERN_ROUNDS / elapsed / 1e6);
+}
+
+// The workloads below put the first half of the set in their tables, and look for names in the
+// second half where they want misses.
+
+// An intern table: finding strings by their characters.
+static double interning(VM* vm, NameSet* set, bool linear, bool hits) {
+    int half = set->count / 2;
+    AnyTable table;
+    initAny(&table, linear, vm->mm);
+    for (int i = 0; i < half; i++) anySet(&table, set->names[i], NIL_VAL);
+
+    int first = hits ? 0 : half;
+    long found = 0;
+    double start = now();
+    for (long lookup = 0; lookup < LOOKUPS; lookup++) {
+        found += anyFindString(&table, set->names[first + lookup % half]) != NULL;
+    }
+    double elapsed = now() - start;
+    freeAny(&table);
+    if (found != (hits ? LOOKUPS : 0)) {
+        fprintf(stderr, "Interning found the wrong strings.\n");
+        exit(1);
+    }
+    return elapsed * 1e9 / LOOKUPS;
+}
+
+// The globals table: every name, looked up in no particular order.
+static double globals(VM* vm, NameSet* set, bool linear) {
+    int half = set->count / 2;
+    AnyTable table;
+    initAny(&table, linear, vm->mm);
+    for (int i = 0; i < half; i++) anySet(&table, set->names[i], INT_VAL(i));
+
+    long found = 0;
+    double start = now();
+    for (long lookup = 0; lookup < LOOKUPS; lookup++) {
+        Value value;
+        found += anyGet(&table, set->names[lookup * 7919 % half], &value);
+    }
+    double elapsed = now() - start;
+    freeAny(&table);
+    if (found != LOOKUPS) {
+        fprintf(stderr, "Lost a global.\n");
+        exit(1);
+    }
+    return elapsed * 1e9 / LOOKUPS;
+}
+
+// Method tables of `size` methods, where one lookup in four misses as it does in a subclass
+// before the search moves on to the superclass. Field tables are the same with every lookup
+// a hit.
+static double members(VM* vm, NameSet* set, bool linear, int size, int missEvery) {
+    int half = set->count / 2;
+    int classes = half / size;
+    AnyTable* tables = ALLOCATE(vm->mm, AnyTable, classes);
+    for (int c = 0; c < classes; c++) {
+        initAny(&tables[c], linear, vm->mm);
+        for (int i = 0; i < size; i++) anySet(&tables[c], set->names[c * size + i], NUMBER_VAL(i));
+    }
+
+    long found = 0;
+    long expected = 0;
+    double start = now();
+    for (long lookup = 0; lookup < LOOKUPS; lookup++) {
+        int c = (int)(lookup % classes);
+        bool miss = missEvery > 0 && lookup % missEvery == 0;
+        ObjString* name = miss ? set->names[half + lookup % half] : set->names[c * size + lookup % size];
+        Value value;
+        found += anyGet(&tables[c], name, &value);
+        expected += !miss;
+    }
+    double elapsed = now() - start;
+    for (int c = 0; c < classes; c++) freeAny(&tables[c]);
+    FREE_ARRAY(vm->mm, AnyTable, tables, classes);
+    if (found != expected) {
+        fprintf(stderr, "Lost a member.\n");
+        exit(1);
+    }
+    return elapsed * 1e9 / LOOKUPS;
+}
+
+static void compareLayouts(VM* vm, NameSet* set) {
+    printf("  ns/lookup                    groups  linear\n");
+    printf("  interning, found            %7.2f %7.2f\n",
+           interning(vm, set, false, true), interning(vm, set, true, true));
+    printf("  interning, not found        %7.2f %7.2f\n",
+           interning(vm, set, false, false), interning(vm, set, true, false));
+    printf("  globals                     %7.2f %7.2f\n",
+           globals(vm, set, false), globals(vm, set, true));
+    static const int sizes[] = {4, 8, 16, 32, 64};
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        if (sizes[s] > set->count / 2) break;
+        printf("  %2d methods, 1 in 4 missing  %7.2f %7.2f\n", sizes[s],
+               members(vm, set, false, sizes[s], 4), members(vm, set, true, sizes[s], 4));
+    }
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        if (sizes[s] > set->count / 2) break;
+        printf("  %2d fields                  %7.2f %7.2f\n", sizes[s],
+               members(vm, set, false, sizes[s], 0), members(vm, set, true, sizes[s], 0));
+    }
+}
+
+static void runSet(VM* vm, const char* title, NameSet* set) {
+    printf("%s: %d names\n", title, set->count);
+    // A table of its own, so that the builtins in vm->strings do not blur the picture.
+    Table strings;
+    initTable(&strings, vm->mm);
+    for (int i = 0; i < set->count; i++) {
+        tableSet(&strings, set->names[i], NIL_VAL);
+    }
+    reportProbes("string set", &strings);
+    freeTable(&strings);
+    reportProbes("vm->strings", &vm->strings);
+    internThroughput(vm, set);
+    compareLayouts(vm, set);
+    printf("\n");
+}
+
+// A long-running process compiling new code: each round interns a batch of names that nothing
+// keeps, and collects them. Interning the live names should take as long in the last round as in
+// the first, and the intern table should stay the size they need.
+static void churn(VM* vm, NameSet* set) {
+    printf("churn: %d live names, %d dead ones a round\n", set->count, CHURN_BATCH);
+    char name[32];
+    for (int round = 1; round <= CHURN_ROUNDS; round++) {
+        for (int i = 0; i < CHURN_BATCH; i++) {
+            int length = snprintf(name, sizeof(name), "dead%d_%d", round, i);
+            copyString(vm->mm, &vm->strings, name, length);
+        }
+        collectGarbage(vm->mm);
+        if (round != 1 && round % 1000 != 0) continue;
+
+        double start = now();
+        for (int i = 0; i < set->count; i++) {
+            copyString(vm->mm, &vm->strings, set->names[i]->chars, set->names[i]->length);
+        }
+        double elapsed = now() - start;
+        TableStats stats = tableStats(&vm->strings);
+        printf("  round %5d  %6d keys %6d tombstones %7d slots  mean %5.2f  max %3d  %5.1f ns/name\n",
+               round, stats.count, stats.tombstones, stats.capacity, stats.meanProbe, stats.maxProbe,
+               elapsed * 1e9 / set->count);
+    }
+    printf("\n");
+}
+
+static const char* verbs[] = {
+        "get", "set", "is", "has", "make", "to", "find", "add", "remove", "update", "on", "init",
+};
+static const char* nouns[] = {
+        "Name", "Value", "Count", "Index", "Size", "Next", "Parent", "Child", "Left", "Right",
+        "Key", "Item", "Node", "List", "Width", "Height", "Position", "Color", "Buffer", "State",
+};
+static const char* suffixes[] = {"", "s", "At", "Of", "2", "Id"};
+
+static void camelCase(VM* vm, NameSet* set) {
+    char name[64];
+    for (size_t v = 0; v < sizeof(verbs) / sizeof(verbs[0]); v++) {
+        for (size_t n = 0; n < sizeof(nouns) / sizeof(nouns[0]); n++) {
+            for (size_t s = 0; s < sizeof(suffixes) / sizeof(suffixes[0]); s++) {
+                int length = snprintf(name, sizeof(name), "%s%s%s", verbs[v], nouns[n], suffixes[s]);
+                addName(vm, set, name, length);
+            }
+        }
+    }
+}
+
+// Short names differing only in their last characters, which weak hashes tend to cluster.
+static void numbered(VM* vm, NameSet* set) {
+    static const char* stems[] = {"x", "tmp", "field", "arg", "v"};
+    char name[32];
+    for (size_t s = 0; s < sizeof(stems) / sizeof(stems[0]); s++) {
+        for (int i = 0; i < 400; i++) {
+            int length = snprintf(name, sizeof(name), "%s%d", stems[s], i);
+            addName(vm, set, name, length);
+        }
+    }
+}
+
+static void longNames(VM* vm, NameSet* set) {
+    char name[96];
+    for (size_t a = 0; a < sizeof(nouns) / sizeof(nouns[0]); a++) {
+        for (size_t b = 0; b < sizeof(nouns) / sizeof(nouns[0]); b++) {
+            int length = snprintf(name, sizeof(name), "component_%s_%s_offset", nouns[a], nouns[b]);
+            addName(vm, set, name, length);
+        }
+    }
+}
+
+static void scriptIdentifiers(VM* vm, NameSet* set, const char* path) {
+    char* source = readFile(path);
+    Scanner scanner;
+    initScanner(&scanner, source);
+    for (Token token = scanToken(&scanner); token.type != TOKEN_EOF; token = scanToken(&scanner)) {
+        if (token.type == TOKEN_IDENTIFIER) addName(vm, set, token.start, token.length);
+    }
+    free(source);
+}
+
+int main(int argc, const char* argv[]) {
+    MemoryManager mm;
+    initMemoryManager(&mm);
+
+    VM vm;
+    initVM(&vm, &mm);
+
+    MemoryComponent vmComponent;
+    vmComponent.data = &vm;
+    vmComponent.markRoots = markNames;
+    vmComponent.handleWeakReferences = handleWeakVMReferences;
+    vmComponent.next = mm.memoryComponents;
+    mm.memoryComponents = &vmComponent;
+
+    mm.dataStack = &vm;
+    mm.pushStack = pushStackVM;
+    mm.popStack = popStackVM;
+
+    initNativeFunctionEnvironment(&vm);
+    internBuiltinStrings(&vm);
+
+    printf("Groups probed: 1 | 2 | 3 | 4 | 5-8 | 9-16 | 17+\n\n");
+
+    struct {
+        const char* title;
+        void (*generate)(VM* vm, NameSet* set);
+    } generated[] = {
+            {"camelCase", camelCase},
+            {"numbered", numbered},
+            {"long", longNames},
+    };
+    for (size_t i = 0; i < sizeof(generated) / sizeof(generated[0]); i++) {
+        NameSet set = {NULL, 0, 0};
+        liveSet = &set;
+        generated[i].generate(&vm, &set);
+        runSet(&vm, generated[i].title, &set);
+        if (i == 0) churn(&vm, &set);
+        liveSet = NULL;
+        freeNames(&vm, &set);
+    }
+
+    if (argc > 1) {
+        NameSet set = {NULL, 0, 0};
+        liveSet = &set;
+        for (int i = 1; i < argc; i++) scriptIdentifiers(&vm, &set, argv[i]);
+        runSet(&vm, "scripts", &set);
+        liveSet = NULL;
+        freeNames(&vm, &set);
+    }
+
+    mm.memoryComponents = vmComponent.next;
+    freeVM(&vm);
+    freeMemoryManager(&mm);
+    return 0;
+}
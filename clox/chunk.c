@@ -1,6 +1,7 @@
 #include "chunk.h"
 #include "value.h"
 #include "memory.h"
+#include "object.h"
 
 void initChunk(Chunk* chunk) {
     chunk->count = 0;
@@ -8,6 +9,9 @@ void initChunk(Chunk* chunk) {
     chunk->code = NULL;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->caches = NULL;
 }
 
 void writeChunk(MemoryManager* mm, Chunk* chunk, uint8_t byte, int line) {
@@ -27,6 +31,7 @@ void freeChunk(MemoryManager* mm, Chunk* chunk) {
     FREE_ARRAY(mm, uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(mm, int, chunk->lines, chunk->capacity);
     freeValueArray(mm, &chunk->constants);
+    FREE_ARRAY(mm, InlineCache, chunk->caches, chunk->cacheCapacity);
     initChunk(chunk);
 }
 
@@ -36,3 +41,206 @@ int addConstant(MemoryManager* mm, Chunk* chunk, Value value) {
     popStack(mm);
     return chunk->constants.count - 1;
 }
+
+int addInlineCache(MemoryManager* mm, Chunk* chunk) {
+    if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(mm, InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+    }
+
+    InlineCache* cache = &chunk->caches[chunk->cacheCount];
+    cache->count = 0;
+    for (int i = 0; i < INLINE_CACHE_SIZE; i++) {
+        cache->entries[i].key = NULL;
+        cache->entries[i].target = NULL;
+        cache->entries[i].slot = -1;
+        cache->entries[i].version = 0;
+    }
+    return chunk->cacheCount++;
+}
+
+int instructionLength(Chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_POP:
+        case OP_POP_LOCAL:
+        case OP_CLOSE_UPVALUE:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_PRINT:
+        case OP_RETURN:
+        case OP_INHERIT:
+        case OP_NIL_RETURN:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_GET_INDEX:
+        case OP_SET_INDEX:
+            return 1;
+        case OP_CONSTANT:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CALL_LOCAL:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_GET_SUPER:
+        case OP_BUILD_LIST:
+        case OP_BUILD_MAP:
+        case OP_POP_GET_GLOBAL:
+        case OP_RETURN_LOCAL:
+        case OP_ADD_CONSTANT:
+        case OP_SUBTRACT_CONSTANT:
+        case OP_LESS_CONSTANT:
+            return 2;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_JUMP_IF_FALSE_POP:
+            return 3;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_REG_MOVE:
+            return 4;
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_GET_LOCAL_PROPERTY:
+        case OP_REG_EQUAL:
+        case OP_REG_GREATER:
+        case OP_REG_LESS:
+        case OP_REG_ADD:
+        case OP_REG_SUBTRACT:
+        case OP_REG_MULTIPLY:
+        case OP_REG_DIVIDE:
+            return 5;
+        case OP_GET_GLOBAL_INVOKE:
+            return 6;
+        case OP_CLOSURE: {
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + 2 * function->upvalueCount;
+        }
+        default:
+            return 1;
+    }
+}
+
+bool isJumpInstruction(uint8_t instruction) {
+    return instruction == OP_JUMP ||
+           instruction == OP_JUMP_IF_FALSE ||
+           instruction == OP_JUMP_IF_FALSE_POP ||
+           instruction == OP_LOOP;
+}
+
+int jumpTarget(Chunk* chunk, int offset) {
+    uint16_t jump = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    int sign = chunk->code[offset] == OP_LOOP ? -1 : 1;
+    return offset + 3 + sign * jump;
+}
+
+// The change in stack height after the instruction at `offset`. Jumps that pop only do so when
+// falling through, which is what is counted here.
+int stackEffect(Chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_CLOSURE:
+        case OP_CLASS:
+        case OP_GET_LOCAL_PROPERTY:
+            return 1;
+        case OP_POP:
+        case OP_POP_LOCAL:
+        case OP_CLOSE_UPVALUE:
+        case OP_DEFINE_GLOBAL:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_PRINT:
+        case OP_METHOD:
+        case OP_INHERIT:
+        case OP_GET_SUPER:
+        case OP_SET_PROPERTY:
+        case OP_GET_INDEX:
+        case OP_JUMP_IF_FALSE_POP:
+            return -1;
+        case OP_SET_INDEX:
+            return -2;
+        case OP_BUILD_LIST:
+            return 1 - chunk->code[offset + 1];
+        case OP_BUILD_MAP:
+            return 1 - 2 * chunk->code[offset + 1];
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CALL_LOCAL:
+            return -chunk->code[offset + 1];
+        case OP_INVOKE:
+            return -chunk->code[offset + 2];
+        case OP_SUPER_INVOKE:
+            return -chunk->code[offset + 2] - 1;
+        case OP_GET_GLOBAL_INVOKE:
+            return 1 - chunk->code[offset + 3];
+        default:
+            return 0;
+    }
+}
+
+// The deepest the stack gets above frame->slots while the chunk runs, for a frame entered with
+// `entryDepth` values on it. Bytecode is laid out the way the compiler emits it, so a single pass
+// in order sees every forward jump before its target and every loop header before its back-edge.
+// Meant for stack code, before translateToRegisters() has had a go at it.
+int maxStackDepth(MemoryManager* mm, Chunk* chunk, int entryDepth) {
+    int* targetDepth = ALLOCATE(mm, int, chunk->count + 1);
+    for (int i = 0; i <= chunk->count; i++) targetDepth[i] = -1;
+
+    int depth = entryDepth;
+    int maxDepth = entryDepth;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        // Code after a return or an unconditional jump is reached, if at all, through a jump
+        // recorded earlier. Carrying on from the last height over-estimates, which is harmless.
+        if (targetDepth[offset] > depth) depth = targetDepth[offset];
+
+        uint8_t instruction = chunk->code[offset];
+        if (isJumpInstruction(instruction)) {
+            int target = jumpTarget(chunk, offset);
+            if (targetDepth[target] < depth) targetDepth[target] = depth;
+        }
+
+        // These push one value more than their operands on the way: the global they invoke, or
+        // the constant their slow path hands to the generic instruction.
+        if (instruction == OP_GET_GLOBAL_INVOKE || instruction == OP_ADD_CONSTANT ||
+            instruction == OP_SUBTRACT_CONSTANT || instruction == OP_LESS_CONSTANT) {
+            if (depth + 1 > maxDepth) maxDepth = depth + 1;
+        }
+
+        depth += stackEffect(chunk, offset);
+        if (depth > maxDepth) maxDepth = depth;
+    }
+
+    FREE_ARRAY(mm, int, targetDepth, chunk->count + 1);
+    return maxDepth;
+}
@@ -9,6 +9,7 @@ typedef enum {
     OP_TRUE,
     OP_FALSE,
     OP_POP,
+    OP_POP_LOCAL,    // Pops a local that never escaped, handing its instance back to the class.
     OP_CLOSE_UPVALUE,
     OP_GET_GLOBAL,
     OP_DEFINE_GLOBAL,
@@ -32,6 +33,8 @@ typedef enum {
     OP_LOOP,
     OP_RETURN,
     OP_CALL,
+    OP_TAIL_CALL,    // A call the return after it only passes on; reuses the caller's frame.
+    OP_CALL_LOCAL,   // A call whose result only a local that never escapes holds; see ownsInstance().
     OP_INVOKE,
     OP_CLOSURE,
     OP_CLASS,
@@ -40,15 +43,75 @@ typedef enum {
     OP_GET_SUPER,
     OP_SUPER_INVOKE,
     OP_GET_PROPERTY,
-    OP_SET_PROPERTY
+    OP_SET_PROPERTY,
+    OP_BUILD_LIST,   // count; makes a list of the top `count` values.
+    OP_BUILD_MAP,    // count; makes a map of the top `count` key and value pairs.
+    OP_GET_INDEX,
+    OP_SET_INDEX,
+
+    // Superinstructions. The compiler never emits these directly; fuseSuperinstructions() rewrites
+    // the most frequent adjacent pairs into them once a function has been compiled.
+    OP_POP_GET_GLOBAL,
+    OP_GET_LOCAL_PROPERTY,
+    OP_GET_GLOBAL_INVOKE,
+    OP_JUMP_IF_FALSE_POP,
+    OP_RETURN_LOCAL,
+    OP_NIL_RETURN,
+    OP_ADD_CONSTANT,
+    OP_SUBTRACT_CONSTANT,
+    OP_LESS_CONSTANT,
+
+    // Quickened instructions. The VM rewrites a generic instruction into one of these in place
+    // once it has seen its operand types, and back again when the guess turns out wrong.
+    OP_ADD_NUM,
+    OP_ADD_STR,
+
+    // Register instructions, emitted only by translateToRegisters(). Operands are frame slots;
+    // a source operand with RK_CONSTANT set names a constant instead. The trailing operand is
+    // the stack height the instruction leaves behind.
+    OP_REG_MOVE,     // dst, src, top
+    OP_REG_EQUAL,    // dst, a, b, top
+    OP_REG_GREATER,
+    OP_REG_LESS,
+    OP_REG_ADD,
+    OP_REG_SUBTRACT,
+    OP_REG_MULTIPLY,
+    OP_REG_DIVIDE
 } OpCode;
 
+#define RK_CONSTANT 0x80
+
+#define INLINE_CACHE_SIZE 4
+
+// One cached lookup result. `key` is the receiver's shape for property access and invocation, or
+// the superclass for super calls. A non-negative `slot` is a field slot; otherwise `target` is the
+// method closure, valid while the class's methods are at `version`. Property stores that add a
+// field cache the shape they transition to in `target`.
+typedef struct {
+    struct Obj* key;
+    struct Obj* target;
+    int slot;
+    int version;
+} CacheEntry;
+
+// A call site goes polymorphic up to INLINE_CACHE_SIZE receivers and megamorphic, no longer
+// caching anything, once it sees more.
+typedef struct {
+    int count;
+    CacheEntry entries[INLINE_CACHE_SIZE];
+} InlineCache;
+
+#define IS_MEGAMORPHIC(cache) ((cache)->count > INLINE_CACHE_SIZE)
+
 typedef struct {
     int count;
     int capacity;
     uint8_t* code;
     int* lines;
     ValueArray constants;
+    int cacheCount;
+    int cacheCapacity;
+    InlineCache* caches;
 } Chunk;
 
 void initChunk(Chunk* chunk);
@@ -56,5 +119,11 @@ void freeChunk(MemoryManager* mm, Chunk* chunk);
 
 void writeChunk(MemoryManager* mm, Chunk* chunk, uint8_t byte, int line);
 int addConstant(MemoryManager* mm, Chunk* chunk, Value value);
+int addInlineCache(MemoryManager* mm, Chunk* chunk);
+int instructionLength(Chunk* chunk, int offset);
+bool isJumpInstruction(uint8_t instruction);
+int jumpTarget(Chunk* chunk, int offset);
+int stackEffect(Chunk* chunk, int offset);
+int maxStackDepth(MemoryManager* mm, Chunk* chunk, int entryDepth);
 
 #endif //CLOX_CHUNK_H
@@ -6,6 +6,14 @@
 #include <stdint.h>
 
 #define NAN_BOXING
+#define SUPERINSTRUCTIONS
+#define BASELINE_JIT
+#define GENERATIONAL_GC
+
+// The JIT emits x86-64 for the System V ABI and relies on the NaN-boxed value layout.
+#if defined(BASELINE_JIT) && !(defined(NAN_BOXING) && defined(__x86_64__) && defined(__linux__))
+#undef BASELINE_JIT
+#endif
 
 //#define DEBUG_PRINT_CODE
 //#define DEBUG_TRACE_EXECUTION
@@ -13,6 +21,10 @@
 //#define DEBUG_STRESS_GC
 //#define DEBUG_LOG_GC
 
+//#define DEBUG_LOG_QUICKENING
+//#define DEBUG_LOG_ESCAPES
+//#define DEBUG_LOG_TABLES
+
 #define UINT8_COUNT (UINT8_MAX + 1)
 
 #endif
@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include "compiler.h"
+#include "optimizer.h"
 #include "scanner.h"
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wunused-parameter"
@@ -30,6 +31,8 @@ typedef struct {
     int depth;
     bool isCaptured;
     VarState state;
+    bool escapes;   // Read other than as a receiver, or assigned; see ownsInstance().
+    int allocation; // Offset of the OP_CALL that initialized it, or -1.
 } Local;
 
 typedef struct {
@@ -47,6 +50,8 @@ typedef struct CompilationContext {
     int localCount;
     Upvalue upvalues[UINT8_COUNT];
     int scopeDepth;
+    int lastCall; // Offset of the latest OP_CALL, which a return right after makes a tail call.
+    bool ownedSlots[UINT8_COUNT]; // Slots some local owned its instance in, see ownsInstance().
 } CompilationContext;
 
 typedef struct ClassContext {
@@ -104,11 +109,15 @@ static void initCompilationContext(MemoryManager* mm, CompilationContext* contex
     context->function = NULL;
     context->localCount = 0;
     context->scopeDepth = 0;
+    context->lastCall = -1;
+    memset(context->ownedSlots, 0, sizeof(context->ownedSlots));
     context->function = newFunction(mm);
 
     Local* local = &context->locals[context->localCount++];
     local->depth = 0;
     local->isCaptured = false;
+    local->escapes = false;
+    local->allocation = -1;
     if (type != TYPE_FUNCTION) {
         local->name.start = "this";
         local->name.length = 4;
@@ -221,6 +230,15 @@ static void patchJump(Compiler* compiler, int offset) {
     currentChunk(compiler)->code[offset + 1] = jump & 0xff;
 }
 
+// Every property access and invocation gets its own inline cache, addressed by a 16-bit operand.
+static void emitInlineCache(Compiler* compiler) {
+    int cache = addInlineCache(compiler->mm, currentChunk(compiler));
+    if (cache > UINT16_MAX) error(compiler, "Too many property accesses in one chunk.");
+
+    emitByte(compiler, (cache >> 8) & 0xff);
+    emitByte(compiler, cache & 0xff);
+}
+
 static uint8_t makeConstant(Compiler* compiler, Value value) {
     int constant = addConstant(compiler->mm, currentChunk(compiler), value);
     if (constant > UINT8_MAX) {
@@ -235,6 +253,12 @@ static void emitConstant(Compiler* compiler, Value value) {
     emitBytes(compiler, OP_CONSTANT, makeConstant(compiler, value));
 }
 
+// Whether the value on top of the stack is the result of the latest call, with nothing after it.
+static bool endsWithCall(Compiler* compiler) {
+    int lastCall = compiler->compilationContext->lastCall;
+    return lastCall != -1 && lastCall == currentChunk(compiler)->count - 2;
+}
+
 static void emitReturn(Compiler* compiler) {
     if (compiler->compilationContext->type == TYPE_INITIALIZER) {
         emitBytes(compiler, OP_GET_LOCAL, 0);
@@ -287,12 +311,27 @@ static void beginScope(Compiler* compiler) {
     compiler->compilationContext->scopeDepth++;
 }
 
+// Escape analysis, done as the compiler goes. A local initialized by a call owns the instance the
+// call makes if it is only ever the receiver of a property access, store or invocation: never read
+// as a plain value, never assigned and never captured. Such an instance dies with its local, and
+// its class can reuse it. What the compiler cannot see is left to the VM: binding a method to the
+// instance, calling a method that lets `this` escape, the initializer included, or calling `init`
+// on it directly, which returns it, marks it as having escaped after all.
+static bool ownsInstance(Local* local) {
+    return local->allocation != -1 && !local->escapes && !local->isCaptured;
+}
+
 static void endScope(Compiler* compiler) {
     compiler->compilationContext->scopeDepth--;
 
     while (compiler->compilationContext->localCount > 0 && compiler->compilationContext->locals[compiler->compilationContext->localCount - 1].depth > compiler->compilationContext->scopeDepth) {
-        if (compiler->compilationContext->locals[compiler->compilationContext->localCount - 1].isCaptured) {
+        Local* local = &compiler->compilationContext->locals[compiler->compilationContext->localCount - 1];
+        if (local->isCaptured) {
             emitByte(compiler, OP_CLOSE_UPVALUE);
+        } else if (ownsInstance(local)) {
+            currentChunk(compiler)->code[local->allocation] = OP_CALL_LOCAL;
+            compiler->compilationContext->ownedSlots[compiler->compilationContext->localCount - 1] = true;
+            emitByte(compiler, OP_POP_LOCAL);
         } else {
             //TODO(kjaa): add an OP_POPN, instead of many at a time.
             emitByte(compiler, OP_POP);
@@ -340,6 +379,11 @@ static void returnStatement(Compiler* compiler) {
         }
         expression(compiler);
         consume(compiler, TOKEN_SEMICOLON, "Expect ';' after return value.");
+        // The return stays behind a tail call, for `and` and `or` jumping past the call and for
+        // callees that cannot take over the frame.
+        if (endsWithCall(compiler)) {
+            currentChunk(compiler)->code[compiler->compilationContext->lastCall] = OP_TAIL_CALL;
+        }
         emitByte(compiler, OP_RETURN);
     }
 }
@@ -347,7 +391,13 @@ static void returnStatement(Compiler* compiler) {
 static void expressionStatement(Compiler* compiler) {
     expression(compiler);
     consume(compiler, TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emitByte(compiler, OP_POP);
+    // A result popped straight away is as good as a local nothing uses.
+    if (endsWithCall(compiler)) {
+        currentChunk(compiler)->code[compiler->compilationContext->lastCall] = OP_CALL_LOCAL;
+        emitByte(compiler, OP_POP_LOCAL);
+    } else {
+        emitByte(compiler, OP_POP);
+    }
 }
 
 static bool identifiersEqual(Token* a, Token* b) {
@@ -366,6 +416,8 @@ static void addLocal(Compiler* compiler, Token name) {
     local->depth = compiler->compilationContext->scopeDepth;
     local->state = VAR_UNINITIALIZED;
     local->isCaptured = false;
+    local->escapes = false;
+    local->allocation = -1;
 }
 
 static bool isGlobalScope(CompilationContext* context) {
@@ -445,6 +497,10 @@ static void varDeclaration(Compiler* compiler, VarState varState) {
 
     if (match(compiler, TOKEN_EQUAL)) {
         expression(compiler);
+        CompilationContext* context = compiler->compilationContext;
+        if (!isGlobalScope(context) && endsWithCall(compiler)) {
+            context->locals[context->localCount - 1].allocation = context->lastCall;
+        }
     } else {
         emitByte(compiler, OP_NIL);
     }
@@ -506,6 +562,7 @@ static void forStatement(Compiler* compiler) {
     if (loopVariable != -1) {
         beginScope(compiler);
         emitBytes(compiler, OP_GET_LOCAL, (uint8_t)loopVariable);
+        compiler->compilationContext->locals[loopVariable].escapes = true;
         addLocal(compiler, loopVariableName);
         markInitialized(compiler->compilationContext, VAR_WRITEABLE);
         innerVariable = compiler->compilationContext->localCount - 1;
@@ -570,7 +627,36 @@ static void statement(Compiler* compiler) {
 
 static ObjFunction* endCompilation(Compiler* compiler) {
     emitReturn(compiler);
-    ObjFunction* function = compiler->compilationContext->function;
+    CompilationContext* context = compiler->compilationContext;
+    ObjFunction* function = context->function;
+
+    // Slot 0 is `this` only in methods. Locals still in scope own their instances until a return.
+    function->thisEscapes = (context->type == TYPE_METHOD || context->type == TYPE_INITIALIZER) &&
+                            (context->locals[0].escapes || context->locals[0].isCaptured);
+    for (int i = 1; i < context->localCount; i++) {
+        if (ownsInstance(&context->locals[i])) {
+            currentChunk(compiler)->code[context->locals[i].allocation] = OP_CALL_LOCAL;
+            context->ownedSlots[i] = true;
+        }
+    }
+    // A return releases the instances in these slots, whichever of the locals that owned one there
+    // are still in scope.
+    int ownedSlotCount = 0;
+    for (int i = 1; i < UINT8_COUNT; i++) ownedSlotCount += context->ownedSlots[i];
+    if (ownedSlotCount > 0) {
+        function->ownedSlots = ALLOCATE(compiler->mm, uint8_t, ownedSlotCount);
+        for (int i = 1; i < UINT8_COUNT; i++) {
+            if (context->ownedSlots[i]) function->ownedSlots[function->ownedSlotCount++] = (uint8_t)i;
+        }
+    }
+#ifdef SUPERINSTRUCTIONS
+    if (!compiler->hadError) {
+        fuseSuperinstructions(compiler->mm, currentChunk(compiler));
+    }
+#endif
+    if (!compiler->hadError) {
+        function->stackSize = maxStackDepth(compiler->mm, currentChunk(compiler), function->arity + 1);
+    }
 #ifdef DEBUG_PRINT_CODE
     if (!compiler->hadError) {
         disassembleChunk(stdout, currentChunk(compiler), function->name != NULL ? function->name->chars : "<script>");
@@ -606,9 +692,17 @@ static void function(Compiler* compiler, FunctionType type) {
     consume(compiler, TOKEN_LEFT_BRACE, "Expect '{' before function body");
     block(compiler);
 
-    //TODO(kjaa): If function.upvalueCount == 0, do not make a closure
-    //   just keep a simple plain function
+    // A function that captures nothing is its own value, with no closure to allocate, as long as
+    // its declaration only runs once: one at the top level of the script. Anywhere else, each time
+    // it runs has to make a function of its own. Methods always get a closure, since classes and
+    // bound methods hold on to closures.
     ObjFunction* function = endCompilation(compiler);
+    CompilationContext* enclosing = compiler->compilationContext;
+    if (function->upvalueCount == 0 && type == TYPE_FUNCTION &&
+        enclosing->type == TYPE_SCRIPT && isGlobalScope(enclosing)) {
+        emitBytes(compiler, OP_CONSTANT, makeConstant(compiler, OBJ_VAL(function)));
+        return;
+    }
     emitBytes(compiler, OP_CLOSURE, makeConstant(compiler, OBJ_VAL(function)));
     for (int i = 0; i < function->upvalueCount; i++) {
         emitByte(compiler, context.upvalues[i].isLocal ? 1 : 0);
@@ -722,8 +816,13 @@ static void namedVariable(Compiler* compiler, Token name, bool canAssign) {
         }
         expression(compiler);
         emitBytes(compiler, setOp, (uint8_t) arg);
+        if (setOp == OP_SET_LOCAL) compiler->compilationContext->locals[arg].escapes = true;
     } else {
         emitBytes(compiler, getOp, (uint8_t) arg);
+        // A '.' next makes this the receiver, whatever precedence the variable was parsed at.
+        if (getOp == OP_GET_LOCAL && !check(compiler, TOKEN_DOT)) {
+            compiler->compilationContext->locals[arg].escapes = true;
+        }
     }
 }
 
@@ -827,6 +926,7 @@ static uint8_t argumentList(Compiler* compiler) {
 
 static void call(Compiler* compiler, bool canAssign) {
     uint8_t argCount = argumentList(compiler);
+    compiler->compilationContext->lastCall = currentChunk(compiler)->count;
     emitBytes(compiler, OP_CALL, argCount);
 }
 
@@ -837,15 +937,64 @@ static void dot(Compiler* compiler, bool canAssign) {
     if (canAssign && match(compiler, TOKEN_EQUAL)) {
         expression(compiler);
         emitBytes(compiler, OP_SET_PROPERTY, name);
+        emitInlineCache(compiler);
     } else if (match(compiler, TOKEN_LEFT_PAREN)) {
         uint8_t argCount = argumentList(compiler);
         emitBytes(compiler, OP_INVOKE, name);
         emitByte(compiler, argCount);
+        emitInlineCache(compiler);
     } else {
         emitBytes(compiler, OP_GET_PROPERTY, name);
+        emitInlineCache(compiler);
+    }
+}
+
+static void subscript(Compiler* compiler, bool canAssign) {
+    expression(compiler);
+    consume(compiler, TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+    if (canAssign && match(compiler, TOKEN_EQUAL)) {
+        expression(compiler);
+        emitByte(compiler, OP_SET_INDEX);
+    } else {
+        emitByte(compiler, OP_GET_INDEX);
     }
 }
 
+// `[a, b]` is a list and `[k: v, l: w]` a map, with `[:]` the empty map. The first item decides
+// which.
+static void list(Compiler* compiler, bool canAssign) {
+    if (match(compiler, TOKEN_COLON)) {
+        consume(compiler, TOKEN_RIGHT_BRACKET, "Expect ']' after ':' of an empty map.");
+        emitBytes(compiler, OP_BUILD_MAP, 0);
+        return;
+    }
+
+    int count = 0;
+    bool isMap = false;
+    if (!check(compiler, TOKEN_RIGHT_BRACKET)) {
+        do {
+            expression(compiler);
+            if (count == 0) {
+                isMap = match(compiler, TOKEN_COLON);
+            } else if (isMap) {
+                consume(compiler, TOKEN_COLON, "Expect ':' after map key.");
+            }
+            if (isMap) expression(compiler);
+
+            if (count == 255) {
+                error(compiler, isMap ? "Can't have more than 255 entries in a map literal."
+                                      : "Can't have more than 255 items in a list literal.");
+            }
+            count++;
+        } while (match(compiler, TOKEN_COMMA));
+    }
+
+    consume(compiler, TOKEN_RIGHT_BRACKET,
+            isMap ? "Expect ']' after map entries." : "Expect ']' after list items.");
+    emitBytes(compiler, isMap ? OP_BUILD_MAP : OP_BUILD_LIST, (uint8_t)count);
+}
+
 static void literal(Compiler* compiler, bool canAssign) {
     switch (compiler->previous.type) {
         case TOKEN_NIL: emitByte(compiler, OP_NIL); break;
@@ -936,6 +1085,7 @@ static void super_(Compiler* compiler, bool canAssign) {
         namedVariable(compiler, syntheticToken("super"), false);
         emitBytes(compiler, OP_SUPER_INVOKE, name);
         emitByte(compiler, argCount);
+        emitInlineCache(compiler);
     } else {
         namedVariable(compiler, syntheticToken("super"), false);
         emitBytes(compiler, OP_GET_SUPER, name);
@@ -974,7 +1124,7 @@ static void or_(Compiler* compiler, bool canAssign) {
 
 static void number(Compiler* compiler, __unused bool canAssign) {
     double value = strtod(compiler->previous.start, NULL);
-    emitConstant(compiler, NUMBER_VAL(value));
+    emitConstant(compiler, numberValue(value));
 }
 
 static void string(Compiler* compiler, __unused bool canAssign) {
@@ -987,6 +1137,9 @@ ParseRule rules[] = {
         [TOKEN_RIGHT_PAREN]   = { NULL,     NULL,   PREC_NONE },
         [TOKEN_LEFT_BRACE]    = { NULL,     NULL,   PREC_NONE },
         [TOKEN_RIGHT_BRACE]   = { NULL,     NULL,   PREC_NONE },
+        [TOKEN_LEFT_BRACKET]  = { list,     subscript, PREC_CALL },
+        [TOKEN_RIGHT_BRACKET] = { NULL,     NULL,   PREC_NONE },
+        [TOKEN_COLON]         = { NULL,     NULL,   PREC_NONE },
         [TOKEN_COMMA]         = { NULL,     NULL,   PREC_NONE },
         [TOKEN_DOT]           = { NULL,     dot,   PREC_CALL },
         [TOKEN_MINUS]         = { unary,    binary, PREC_TERM },
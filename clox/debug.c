@@ -17,13 +17,25 @@ static int constantInstruction(FILE* out, const char* name, Chunk* chunk, int of
     return offset + 2;
 }
 
+static uint16_t readCache(Chunk* chunk, int offset) {
+    return (uint16_t)((chunk->code[offset] << 8) | chunk->code[offset + 1]);
+}
+
+static int propertyInstruction(FILE* out, const char* name, Chunk* chunk, int offset) {
+    uint8_t constant = chunk->code[offset + 1];
+    fprintf(out, "%-16s %4d '", name, constant);
+    printValue(out, chunk->constants.values[constant]);
+    fprintf(out, "' [ic %d]\n", readCache(chunk, offset + 2));
+    return offset + 4;
+}
+
 static int invokeInstruction(FILE* out, const char* name, Chunk* chunk, int offset) {
     uint8_t constant = chunk->code[offset + 1];
     uint8_t argCount = chunk->code[offset + 2];
     fprintf(out, "%-16s (%d args) %4d '", name, argCount, constant);
     printValue(out, chunk->constants.values[constant]);
-    fprintf(out, "'\n");
-    return offset + 3;
+    fprintf(out, "' [ic %d]\n", readCache(chunk, offset + 3));
+    return offset + 5;
 
 }
 
@@ -33,6 +45,44 @@ static int byteInstruction(FILE* out, const char* name, Chunk* chunk, int offset
     return offset + 2;
 }
 
+static int localPropertyInstruction(FILE* out, const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    fprintf(out, "%-16s %4d %4d '", name, slot, constant);
+    printValue(out, chunk->constants.values[constant]);
+    fprintf(out, "' [ic %d]\n", readCache(chunk, offset + 3));
+    return offset + 5;
+}
+
+static int globalInvokeInstruction(FILE* out, const char* name, Chunk* chunk, int offset) {
+    uint8_t global = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    uint8_t argCount = chunk->code[offset + 3];
+    fprintf(out, "%-16s %4d (%d args) %4d '", name, global, argCount, constant);
+    printValue(out, chunk->constants.values[constant]);
+    fprintf(out, "' [ic %d]\n", readCache(chunk, offset + 4));
+    return offset + 6;
+}
+
+static void registerOperand(FILE* out, Chunk* chunk, uint8_t operand) {
+    if (operand & RK_CONSTANT) {
+        fprintf(out, " '");
+        printValue(out, chunk->constants.values[operand & ~RK_CONSTANT]);
+        fprintf(out, "'");
+    } else {
+        fprintf(out, " r%d", operand);
+    }
+}
+
+static int registerInstruction(FILE* out, const char* name, int sources, Chunk* chunk, int offset) {
+    fprintf(out, "%-16s r%d <-", name, chunk->code[offset + 1]);
+    for (int i = 0; i < sources; i++) {
+        registerOperand(out, chunk, chunk->code[offset + 2 + i]);
+    }
+    fprintf(out, " (top %d)\n", chunk->code[offset + 2 + sources]);
+    return offset + 3 + sources;
+}
+
 static int jumpInstruction(FILE* out, const char* name, int sign, Chunk* chunk, int offset) {
     uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
     jump |= chunk->code[offset + 2];
@@ -69,6 +119,8 @@ int disassembleInstruction(FILE* out, Chunk* chunk, int offset ){
             return simpleInstruction(out, "OP_FALSE", offset);
         case OP_POP:
             return simpleInstruction(out, "OP_POP", offset);
+        case OP_POP_LOCAL:
+            return simpleInstruction(out, "OP_POP_LOCAL", offset);
         case OP_GET_LOCAL:
             return byteInstruction(out, "OP_GET_LOCAL", chunk, offset);
         case OP_SET_LOCAL:
@@ -111,6 +163,10 @@ int disassembleInstruction(FILE* out, Chunk* chunk, int offset ){
             return jumpInstruction(out, "OP_LOOP", -1, chunk, offset);
         case OP_CALL:
             return byteInstruction(out, "OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction(out, "OP_TAIL_CALL", chunk, offset);
+        case OP_CALL_LOCAL:
+            return byteInstruction(out, "OP_CALL_LOCAL", chunk, offset);
         case OP_INVOKE:
             return invokeInstruction(out, "OP_INVOKE", chunk, offset);
         case OP_CLOSURE: {
@@ -146,10 +202,22 @@ int disassembleInstruction(FILE* out, Chunk* chunk, int offset ){
             return constantInstruction(out, "OP_METHOD", chunk, offset);
         }
         case OP_SET_PROPERTY: {
-            return constantInstruction(out, "OP_SET_PROPERTY", chunk, offset);
+            return propertyInstruction(out, "OP_SET_PROPERTY", chunk, offset);
         }
         case OP_GET_PROPERTY: {
-            return constantInstruction(out, "OP_GET_PROPERTY", chunk, offset);
+            return propertyInstruction(out, "OP_GET_PROPERTY", chunk, offset);
+        }
+        case OP_BUILD_LIST: {
+            return byteInstruction(out, "OP_BUILD_LIST", chunk, offset);
+        }
+        case OP_BUILD_MAP: {
+            return byteInstruction(out, "OP_BUILD_MAP", chunk, offset);
+        }
+        case OP_GET_INDEX: {
+            return simpleInstruction(out, "OP_GET_INDEX", offset);
+        }
+        case OP_SET_INDEX: {
+            return simpleInstruction(out, "OP_SET_INDEX", offset);
         }
         case OP_GET_SUPER: {
             return constantInstruction(out, "OP_GET_SUPER", chunk, offset);
@@ -157,6 +225,44 @@ int disassembleInstruction(FILE* out, Chunk* chunk, int offset ){
         case OP_SUPER_INVOKE: {
             return invokeInstruction(out, "OP_SUPER_INVOKE", chunk, offset);
         }
+        case OP_POP_GET_GLOBAL:
+            return byteInstruction(out, "OP_POP_GET_GLOBAL", chunk, offset);
+        case OP_GET_LOCAL_PROPERTY:
+            return localPropertyInstruction(out, "OP_GET_LOCAL_PROPERTY", chunk, offset);
+        case OP_GET_GLOBAL_INVOKE:
+            return globalInvokeInstruction(out, "OP_GET_GLOBAL_INVOKE", chunk, offset);
+        case OP_JUMP_IF_FALSE_POP:
+            return jumpInstruction(out, "OP_JUMP_IF_FALSE_POP", 1, chunk, offset);
+        case OP_RETURN_LOCAL:
+            return byteInstruction(out, "OP_RETURN_LOCAL", chunk, offset);
+        case OP_NIL_RETURN:
+            return simpleInstruction(out, "OP_NIL_RETURN", offset);
+        case OP_ADD_CONSTANT:
+            return constantInstruction(out, "OP_ADD_CONSTANT", chunk, offset);
+        case OP_SUBTRACT_CONSTANT:
+            return constantInstruction(out, "OP_SUBTRACT_CONSTANT", chunk, offset);
+        case OP_LESS_CONSTANT:
+            return constantInstruction(out, "OP_LESS_CONSTANT", chunk, offset);
+        case OP_ADD_NUM:
+            return simpleInstruction(out, "OP_ADD_NUM", offset);
+        case OP_ADD_STR:
+            return simpleInstruction(out, "OP_ADD_STR", offset);
+        case OP_REG_MOVE:
+            return registerInstruction(out, "OP_REG_MOVE", 1, chunk, offset);
+        case OP_REG_EQUAL:
+            return registerInstruction(out, "OP_REG_EQUAL", 2, chunk, offset);
+        case OP_REG_GREATER:
+            return registerInstruction(out, "OP_REG_GREATER", 2, chunk, offset);
+        case OP_REG_LESS:
+            return registerInstruction(out, "OP_REG_LESS", 2, chunk, offset);
+        case OP_REG_ADD:
+            return registerInstruction(out, "OP_REG_ADD", 2, chunk, offset);
+        case OP_REG_SUBTRACT:
+            return registerInstruction(out, "OP_REG_SUBTRACT", 2, chunk, offset);
+        case OP_REG_MULTIPLY:
+            return registerInstruction(out, "OP_REG_MULTIPLY", 2, chunk, offset);
+        case OP_REG_DIVIDE:
+            return registerInstruction(out, "OP_REG_DIVIDE", 2, chunk, offset);
         default:
             fprintf(out, "Unknown opcode %d\n", instruction);
             return offset + 1;
@@ -0,0 +1,1360 @@
+#include "jit.h"
+
+#ifdef BASELINE_JIT
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "memory.h"
+
+// A baseline template JIT. Each bytecode instruction of a hot function is replaced by a fixed
+// snippet of x86-64: stack traffic, locals, globals, upvalues, number arithmetic, comparisons and
+// jumps run inline; property access and printing call into the runtime, and calls to natives
+// that do not allocate call the native directly. Anything else, as well
+// as every type check that fails, leaves compiled code with frame->ip pointing at the instruction
+// and lets run() execute it. Compiled code never pushes or pops a CallFrame, so run() re-enters
+// it after calls, returns and loop back-edges.
+//
+// While compiled code runs it keeps the VM in rbx, the frame's slots in r12, the frame in r13,
+// the stack top in r14 and QNAN in r15, and stores the stack top back before anything that can
+// collect garbage or exit.
+
+typedef JitStatus (*JitFn)(VM* vm, CallFrame* frame, uint8_t* entry);
+
+// What compiled code calls for instructions it does not do inline.
+typedef bool (*RuntimeFn)(VM* vm, uint64_t arg1, uint64_t arg2);
+
+enum {
+    RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+    R12 = 12, R13 = 13, R14 = 14, R15 = 15
+};
+
+#define VM_REG    RBX
+#define SLOTS_REG R12
+#define FRAME_REG R13
+#define TOP_REG   R14
+#define QNAN_REG  R15
+
+enum { XMM0 = 0, XMM1 = 1 };
+
+enum {
+    CC_O = 0x0,
+    CC_B = 0x2,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A = 0x7,
+    CC_S = 0x8,
+    CC_L = 0xC,
+    CC_G = 0xF
+};
+
+enum {
+    ALU_ADD = 0x01,
+    ALU_OR = 0x09,
+    ALU_AND = 0x21,
+    ALU_SUB = 0x29,
+    ALU_XOR = 0x31,
+    ALU_CMP = 0x39
+};
+
+enum {
+    SSE_ADD = 0x58,
+    SSE_MUL = 0x59,
+    SSE_SUB = 0x5C,
+    SSE_DIV = 0x5E
+};
+
+typedef struct {
+    int patch;  // Where the rel32 goes.
+    int target; // Bytecode offset it refers to.
+} Fixup;
+
+// The double path of an instruction whose int path runs inline, see numberOperation().
+typedef struct {
+    int notIntA;    // The jump taken when the first operand is not an int, or -1.
+    int patches[3]; // The other jumps from the int path, taken where it cannot give the result.
+    int patchCount;
+    int done;       // Native offset to go back to with the result in RAX.
+    uint8_t instruction;
+    int offset;
+    const Value* a; // The operands' values where they are constants.
+    const Value* b;
+} DoublePath;
+
+typedef struct {
+    int patches[2]; // Jumps to the comparison.
+    int target;     // Bytecode offset of the comparison, to exit to on finding a rope.
+    int resume;     // Native offset of the identity comparison.
+    int done;       // Native offset to go back to with the result in RAX.
+} ValueCompare;
+
+typedef struct {
+    MemoryManager* mm;
+    Chunk* chunk;
+    uint8_t* bytes;
+    int count;
+    int capacity;
+
+    int* labels;  // Native offset of each instruction.
+    int* entries; // Where run() may enter, -1 where compiled code would only exit again.
+    Fixup* jumps;
+    int jumpCount;
+    Fixup* exits; // No instruction has more than three per byte of bytecode.
+    int exitCount;
+    ValueCompare* valueCompares; // At most one per instruction, see equalValues().
+    int valueCompareCount;
+    DoublePath* doublePaths; // At most one per instruction.
+    int doublePathCount;
+    int exitLabel;
+    int errorLabel;
+} Assembler;
+
+static void emit8(Assembler* as, uint8_t byte) {
+    if (as->capacity < as->count + 1) {
+        int oldCapacity = as->capacity;
+        as->capacity = GROW_CAPACITY(oldCapacity);
+        as->bytes = GROW_ARRAY(as->mm, uint8_t, as->bytes, oldCapacity, as->capacity);
+    }
+    as->bytes[as->count++] = byte;
+}
+
+static void emit32(Assembler* as, uint32_t value) {
+    for (int i = 0; i < 4; i++) emit8(as, (uint8_t)(value >> (8 * i)));
+}
+
+static void emit64(Assembler* as, uint64_t value) {
+    for (int i = 0; i < 8; i++) emit8(as, (uint8_t)(value >> (8 * i)));
+}
+
+static void patch32(Assembler* as, int at, int value) {
+    for (int i = 0; i < 4; i++) as->bytes[at + i] = (uint8_t)((uint32_t)value >> (8 * i));
+}
+
+static void rexW(Assembler* as, int reg, int rm) {
+    emit8(as, (uint8_t)(0x48 | ((reg >> 3) << 2) | (rm >> 3)));
+}
+
+static void modrmReg(Assembler* as, int reg, int rm) {
+    emit8(as, (uint8_t)(0xC0 | ((reg & 7) << 3) | (rm & 7)));
+}
+
+static void modrmDisp(Assembler* as, int reg, int base, int32_t disp) {
+    emit8(as, (uint8_t)(0x80 | ((reg & 7) << 3) | (base & 7)));
+    if ((base & 7) == RSP) emit8(as, 0x24);
+    emit32(as, (uint32_t)disp);
+}
+
+static void movLoad(Assembler* as, int dst, int base, int32_t disp) {
+    rexW(as, dst, base);
+    emit8(as, 0x8B);
+    modrmDisp(as, dst, base, disp);
+}
+
+static void movStore(Assembler* as, int base, int32_t disp, int src) {
+    rexW(as, src, base);
+    emit8(as, 0x89);
+    modrmDisp(as, src, base, disp);
+}
+
+// Sign-extending 32-bit load.
+static void movsxdLoad(Assembler* as, int dst, int base, int32_t disp) {
+    rexW(as, dst, base);
+    emit8(as, 0x63);
+    modrmDisp(as, dst, base, disp);
+}
+
+static void cmpLoad(Assembler* as, int reg, int base, int32_t disp) {
+    rexW(as, reg, base);
+    emit8(as, 0x3B);
+    modrmDisp(as, reg, base, disp);
+}
+
+static void cmpMem32Imm(Assembler* as, int base, int32_t disp, int32_t imm) {
+    if (base >= 8) emit8(as, 0x41);
+    emit8(as, 0x81);
+    modrmDisp(as, 7, base, disp);
+    emit32(as, (uint32_t)imm);
+}
+
+static void cmpMem8Imm(Assembler* as, int base, int32_t disp, int8_t imm) {
+    if (base >= 8) emit8(as, 0x41);
+    emit8(as, 0x80);
+    modrmDisp(as, 7, base, disp);
+    emit8(as, (uint8_t)imm);
+}
+
+static void shlImm(Assembler* as, int reg, uint8_t amount) {
+    rexW(as, 0, reg);
+    emit8(as, 0xC1);
+    modrmReg(as, 4, reg);
+    emit8(as, amount);
+}
+
+static void movImm(Assembler* as, int dst, uint64_t imm) {
+    rexW(as, 0, dst);
+    emit8(as, (uint8_t)(0xB8 + (dst & 7)));
+    emit64(as, imm);
+}
+
+static void movReg(Assembler* as, int dst, int src) {
+    rexW(as, src, dst);
+    emit8(as, 0x89);
+    modrmReg(as, src, dst);
+}
+
+static void lea(Assembler* as, int dst, int base, int32_t disp) {
+    rexW(as, dst, base);
+    emit8(as, 0x8D);
+    modrmDisp(as, dst, base, disp);
+}
+
+static void alu(Assembler* as, int op, int dst, int src) {
+    rexW(as, src, dst);
+    emit8(as, (uint8_t)op);
+    modrmReg(as, src, dst);
+}
+
+// The 32-bit forms below only take the low eight registers, and zero the upper half of `dst`.
+static void alu32(Assembler* as, int op, int dst, int src) {
+    emit8(as, (uint8_t)op);
+    modrmReg(as, src, dst);
+}
+
+static void imul32(Assembler* as, int dst, int src) {
+    emit8(as, 0x0F);
+    emit8(as, 0xAF);
+    modrmReg(as, dst, src);
+}
+
+static void cmp32Imm(Assembler* as, int reg, int32_t imm) {
+    emit8(as, 0x81);
+    modrmReg(as, 7, reg);
+    emit32(as, (uint32_t)imm);
+}
+
+static void shrImm(Assembler* as, int reg, uint8_t amount) {
+    rexW(as, 0, reg);
+    emit8(as, 0xC1);
+    modrmReg(as, 5, reg);
+    emit8(as, amount);
+}
+
+static void aluImm(Assembler* as, int extension, int dst, int32_t imm) {
+    rexW(as, 0, dst);
+    emit8(as, 0x81);
+    modrmReg(as, extension, dst);
+    emit32(as, (uint32_t)imm);
+}
+
+#define TEST 0x85
+
+#define ADD_IMM 0
+#define AND_IMM 4
+#define SUB_IMM 5
+#define CMP_IMM 7
+
+static void movqToXmm(Assembler* as, int xmm, int gpr) {
+    emit8(as, 0x66);
+    rexW(as, xmm, gpr);
+    emit8(as, 0x0F);
+    emit8(as, 0x6E);
+    modrmReg(as, xmm, gpr);
+}
+
+static void movqFromXmm(Assembler* as, int gpr, int xmm) {
+    emit8(as, 0x66);
+    rexW(as, xmm, gpr);
+    emit8(as, 0x0F);
+    emit8(as, 0x7E);
+    modrmReg(as, xmm, gpr);
+}
+
+static void pxor(Assembler* as, int dst, int src) {
+    emit8(as, 0x66);
+    emit8(as, 0x0F);
+    emit8(as, 0xEF);
+    modrmReg(as, dst, src);
+}
+
+// Converts the int in the low half of `gpr`.
+static void cvtsi2sd(Assembler* as, int xmm, int gpr) {
+    emit8(as, 0xF2);
+    emit8(as, 0x0F);
+    emit8(as, 0x2A);
+    modrmReg(as, xmm, gpr);
+}
+
+static void sse(Assembler* as, int op, int dst, int src) {
+    emit8(as, 0xF2);
+    emit8(as, 0x0F);
+    emit8(as, (uint8_t)op);
+    modrmReg(as, dst, src);
+}
+
+static void ucomisd(Assembler* as, int a, int b) {
+    emit8(as, 0x66);
+    emit8(as, 0x0F);
+    emit8(as, 0x2E);
+    modrmReg(as, a, b);
+}
+
+// eax = condition ? 1 : 0
+static void setcc(Assembler* as, int cc) {
+    emit8(as, 0x0F);
+    emit8(as, (uint8_t)(0x90 | cc));
+    emit8(as, 0xC0);
+    emit8(as, 0x0F);
+    emit8(as, 0xB6);
+    emit8(as, 0xC0);
+}
+
+static void push(Assembler* as, int reg) {
+    if (reg >= 8) emit8(as, 0x41);
+    emit8(as, (uint8_t)(0x50 + (reg & 7)));
+}
+
+static void pop(Assembler* as, int reg) {
+    if (reg >= 8) emit8(as, 0x41);
+    emit8(as, (uint8_t)(0x58 + (reg & 7)));
+}
+
+static int jcc(Assembler* as, int cc) {
+    emit8(as, 0x0F);
+    emit8(as, (uint8_t)(0x80 | cc));
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+static int jmp(Assembler* as) {
+    emit8(as, 0xE9);
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+static void bindHere(Assembler* as, int patch) {
+    patch32(as, patch, as->count - (patch + 4));
+}
+
+static void bindBackward(Assembler* as, int patch, int label) {
+    patch32(as, patch, label - (patch + 4));
+}
+
+static void jumpTo(Assembler* as, int patch, int bytecodeTarget) {
+    Fixup* fixup = &as->jumps[as->jumpCount++];
+    fixup->patch = patch;
+    fixup->target = bytecodeTarget;
+}
+
+// Leaves compiled code so that run() executes the instruction at `offset` itself. Only valid
+// before the instruction has changed anything.
+static void sideExit(Assembler* as, int patch, int offset) {
+    Fixup* fixup = &as->exits[as->exitCount++];
+    fixup->patch = patch;
+    fixup->target = offset;
+}
+
+static void exitAt(Assembler* as, int offset) {
+    if (as->count == as->labels[offset]) as->entries[offset] = -1;
+    sideExit(as, jmp(as), offset);
+}
+
+static uint64_t instructionAddress(Assembler* as, int offset) {
+    return (uint64_t)(uintptr_t)(as->chunk->code + offset);
+}
+
+static void pushValue(Assembler* as, int reg) {
+    movStore(as, TOP_REG, 0, reg);
+    aluImm(as, ADD_IMM, TOP_REG, 8);
+}
+
+// Jumps on `cc` after comparing the value in `reg` against the int tag: CC_E for ints, CC_NE for
+// anything else.
+static int jumpIfInt(Assembler* as, int reg, int cc) {
+    movReg(as, RDX, reg);
+    shrImm(as, RDX, 32);
+    cmp32Imm(as, RDX, (int32_t)(INT_TAG >> 32));
+    return jcc(as, cc);
+}
+
+// Exits unless the value in `reg` is a double.
+static void checkDouble(Assembler* as, int reg, int offset) {
+    movReg(as, RDX, reg);
+    alu(as, ALU_AND, RDX, QNAN_REG);
+    alu(as, ALU_CMP, RDX, QNAN_REG);
+    sideExit(as, jcc(as, CC_E), offset);
+}
+
+// xmm = the int in the low half of `reg`, as a double.
+static void intToDouble(Assembler* as, int xmm, int reg) {
+    // cvtsi2sd keeps the upper half of xmm, so without this it would wait on the last write to it.
+    pxor(as, xmm, xmm);
+    cvtsi2sd(as, xmm, reg);
+}
+
+// eax = (value in RAX is nil or false), using NIL_VAL + 1 == FALSE_VAL.
+static void testFalsey(Assembler* as) {
+    movImm(as, RCX, NIL_VAL);
+    alu(as, ALU_SUB, RAX, RCX);
+    aluImm(as, CMP_IMM, RAX, 1);
+}
+
+static void boolFromFlags(Assembler* as, int cc) {
+    setcc(as, cc);
+    movImm(as, RCX, FALSE_VAL);
+    alu(as, ALU_ADD, RAX, RCX);
+}
+
+// Jumps if the value in `reg` is a rope, returning the jump to patch. Leaves RAX and RCX alone.
+static int jumpIfRope(Assembler* as, int reg) {
+    movImm(as, RSI, QNAN | SIGN_BIT);
+    movReg(as, RDX, reg);
+    alu(as, ALU_AND, RDX, RSI);
+    alu(as, ALU_CMP, RDX, RSI);
+    int notObject = jcc(as, CC_NE);
+    movImm(as, RSI, ~(QNAN | SIGN_BIT));
+    movReg(as, RDX, reg);
+    alu(as, ALU_AND, RDX, RSI);
+    cmpMem32Imm(as, RDX, offsetof(Obj, type), OBJ_ROPE);
+    int rope = jcc(as, CC_E);
+    bindHere(as, notObject);
+    return rope;
+}
+
+// RAX = (RAX == RCX) as a Lox bool. Until the VM makes a string that is not interned, equality is
+// identity, except between an int and a double, which are widened out of line. Once there are
+// strings to compare by their characters, values that differ go to valuesEqual() or, for a rope,
+// to the interpreter.
+static void equalValues(Assembler* as, int offset) {
+    ValueCompare* compare = &as->valueCompares[as->valueCompareCount++];
+    compare->target = offset;
+    cmpMem32Imm(as, VM_REG, offsetof(VM, madeStrings), 0);
+    compare->patches[0] = jcc(as, CC_NE);
+    // Unless one of them is a double, an int is only equal to the same int.
+    movReg(as, RDX, RAX);
+    alu(as, ALU_AND, RDX, RCX);
+    alu(as, ALU_AND, RDX, QNAN_REG);
+    alu(as, ALU_CMP, RDX, QNAN_REG);
+    compare->patches[1] = jcc(as, CC_NE);
+    compare->resume = as->count;
+    alu(as, ALU_CMP, RAX, RCX);
+    boolFromFlags(as, CC_E);
+    compare->done = as->count;
+}
+
+static void compareValues(Assembler* as, ValueCompare* compare) {
+    uint64_t address;
+    bool (*function)(Value, Value) = valuesEqual;
+    memcpy(&address, &function, sizeof(address));
+
+    bindHere(as, compare->patches[0]);
+    bindHere(as, compare->patches[1]);
+    int intA = jumpIfInt(as, RAX, CC_E);
+    int intB = jumpIfInt(as, RCX, CC_E);
+    alu(as, ALU_CMP, RAX, RCX);
+    bindBackward(as, jcc(as, CC_E), compare->resume);
+    cmpMem32Imm(as, VM_REG, offsetof(VM, madeStrings), 0);
+    bindBackward(as, jcc(as, CC_E), compare->resume);
+    sideExit(as, jumpIfRope(as, RAX), compare->target);
+    sideExit(as, jumpIfRope(as, RCX), compare->target);
+    movReg(as, RDI, RAX);
+    movReg(as, RSI, RCX);
+    movImm(as, RAX, address);
+    emit8(as, 0xFF);
+    emit8(as, 0xD0); // call rax
+    emit8(as, 0x84);
+    emit8(as, 0xC0); // test al, al
+    boolFromFlags(as, CC_NE);
+    bindBackward(as, jmp(as), compare->done);
+
+    // Compared as the doubles they stand for, see valuesIdentical().
+    bindHere(as, intA);
+    intToDouble(as, XMM0, RAX);
+    movqFromXmm(as, RAX, XMM0);
+    int doubleB = jumpIfInt(as, RCX, CC_NE);
+    bindHere(as, intB);
+    intToDouble(as, XMM1, RCX);
+    movqFromXmm(as, RCX, XMM1);
+    bindHere(as, doubleB);
+    bindBackward(as, jmp(as), compare->resume);
+}
+
+#ifdef GENERATIONAL_GC
+// Jumps, through the returned patch, where storing the value in `value` into the object in
+// `object` needs the write barrier: the object is old and not yet remembered, and the value is
+// young. Clobbers RDX and RSI.
+static int jumpIfBarrier(Assembler* as, int object, int value) {
+    cmpMem8Imm(as, object, offsetof(Obj, remembered), 0);
+    int remembered = jcc(as, CC_NE);
+    movImm(as, RSI, QNAN | SIGN_BIT);
+    movReg(as, RDX, value);
+    alu(as, ALU_AND, RDX, RSI);
+    alu(as, ALU_CMP, RDX, RSI);
+    int notObject = jcc(as, CC_NE);
+    movImm(as, RSI, ~(QNAN | SIGN_BIT));
+    movReg(as, RDX, value);
+    alu(as, ALU_AND, RDX, RSI);
+    movImm(as, RSI, (uint64_t)(uintptr_t)&as->mm->nursery);
+    movLoad(as, RSI, RSI, 0);
+    alu(as, ALU_SUB, RDX, RSI);
+    aluImm(as, CMP_IMM, RDX, NURSERY_SIZE);
+    int barrier = jcc(as, CC_B);
+    bindHere(as, remembered);
+    bindHere(as, notObject);
+    return barrier;
+}
+#endif
+
+static void callRuntime(Assembler* as, int offset, int length, RuntimeFn function, uint64_t arg1, uint64_t arg2) {
+    uint64_t address;
+    memcpy(&address, &function, sizeof(address));
+
+    movStore(as, VM_REG, offsetof(VM, stackTop), TOP_REG);
+    movImm(as, RAX, instructionAddress(as, offset + length));
+    movStore(as, FRAME_REG, offsetof(CallFrame, ip), RAX);
+    movReg(as, RDI, VM_REG);
+    movImm(as, RSI, arg1);
+    movImm(as, RDX, arg2);
+    movImm(as, RAX, address);
+    emit8(as, 0xFF);
+    emit8(as, 0xD0); // call rax
+    emit8(as, 0x84);
+    emit8(as, 0xC0); // test al, al
+    bindBackward(as, jcc(as, CC_E), as->errorLabel);
+    movLoad(as, TOP_REG, VM_REG, offsetof(VM, stackTop));
+}
+
+// Loads a register-instruction operand into `reg`.
+static void loadOperand(Assembler* as, int reg, uint8_t operand) {
+    if (operand & RK_CONSTANT) {
+        movImm(as, reg, as->chunk->constants.values[operand & ~RK_CONSTANT]);
+    } else {
+        movLoad(as, reg, SLOTS_REG, operand * 8);
+    }
+}
+
+
+static bool jitPrint(VM* vm, __unused uint64_t arg1, __unused uint64_t arg2) {
+    Value value = flattenValue(vm, vm->stackTop[-1]);
+    vm->stackTop--;
+    printValue(vm->outPipe, value);
+    fprintf(vm->outPipe, "\n");
+    return true;
+}
+
+static bool jitLoadProperty(VM* vm, uint64_t name, uint64_t cache) {
+    return loadProperty(vm, (ObjString*)(uintptr_t)name, (InlineCache*)(uintptr_t)cache);
+}
+
+static bool jitStoreProperty(VM* vm, uint64_t name, uint64_t cache) {
+    return storeProperty(vm, (ObjString*)(uintptr_t)name, (InlineCache*)(uintptr_t)cache);
+}
+
+// Reads or overwrites an existing field when the receiver's shape is the first one in the
+// site's inline cache, and calls into the runtime for everything else. The cache is read as it
+// stands when the code runs, so it keeps following the interpreter's updates.
+static void propertyAccess(Assembler* as, int offset, int length, uint8_t nameConstant, int cacheIndex, bool store) {
+    CacheEntry* entry = &as->chunk->caches[cacheIndex].entries[0];
+    int receiver = store ? -16 : -8;
+    int slowPaths[8];
+    int slowCount = 0;
+
+    movLoad(as, RAX, TOP_REG, receiver);
+    movImm(as, RCX, QNAN | SIGN_BIT);
+    movReg(as, RDX, RAX);
+    alu(as, ALU_AND, RDX, RCX);
+    alu(as, ALU_CMP, RDX, RCX);
+    slowPaths[slowCount++] = jcc(as, CC_NE);
+    movImm(as, RCX, ~(QNAN | SIGN_BIT));
+    alu(as, ALU_AND, RAX, RCX);
+    cmpMem32Imm(as, RAX, offsetof(Obj, type), OBJ_INSTANCE);
+    slowPaths[slowCount++] = jcc(as, CC_NE);
+
+    movLoad(as, RDX, RAX, offsetof(ObjInstance, shape));
+    alu(as, TEST, RDX, RDX);
+    slowPaths[slowCount++] = jcc(as, CC_E);
+    movImm(as, RCX, (uint64_t)(uintptr_t)entry);
+    cmpLoad(as, RDX, RCX, offsetof(CacheEntry, key));
+    slowPaths[slowCount++] = jcc(as, CC_NE);
+    if (store) {
+        // Entries with a target add a field through a shape transition; leave those to the runtime.
+        cmpMem32Imm(as, RCX, offsetof(CacheEntry, target), 0);
+        slowPaths[slowCount++] = jcc(as, CC_NE);
+        cmpMem32Imm(as, RCX, offsetof(CacheEntry, target) + 4, 0);
+        slowPaths[slowCount++] = jcc(as, CC_NE);
+#ifdef GENERATIONAL_GC
+        movLoad(as, RDI, TOP_REG, -8);
+        slowPaths[slowCount++] = jumpIfBarrier(as, RAX, RDI);
+#endif
+    }
+    movsxdLoad(as, RDX, RCX, offsetof(CacheEntry, slot));
+    alu(as, TEST, RDX, RDX);
+    slowPaths[slowCount++] = jcc(as, CC_S);
+
+    shlImm(as, RDX, 3);
+    movLoad(as, RAX, RAX, offsetof(ObjInstance, fields));
+    alu(as, ALU_ADD, RAX, RDX);
+    if (store) {
+        movLoad(as, RCX, TOP_REG, -8);
+        movStore(as, RAX, 0, RCX);
+        movStore(as, TOP_REG, -16, RCX);
+        aluImm(as, SUB_IMM, TOP_REG, 8);
+    } else {
+        movLoad(as, RAX, RAX, 0);
+        movStore(as, TOP_REG, -8, RAX);
+    }
+    int done = jmp(as);
+
+    for (int i = 0; i < slowCount; i++) bindHere(as, slowPaths[i]);
+    callRuntime(as, offset, length, store ? jitStoreProperty : jitLoadProperty,
+                as->chunk->constants.values[nameConstant] & ~(SIGN_BIT | QNAN),
+                (uint64_t)(uintptr_t)&as->chunk->caches[cacheIndex]);
+    bindHere(as, done);
+}
+
+static bool jitLoadIndex(VM* vm, __unused uint64_t arg1, __unused uint64_t arg2) {
+    return loadIndex(vm);
+}
+
+static bool jitStoreIndex(VM* vm, __unused uint64_t arg1, __unused uint64_t arg2) {
+    return storeIndex(vm);
+}
+
+// Indexes a list or float array with an int in range inline, and calls into the runtime for
+// everything else, errors included.
+static void indexAccess(Assembler* as, int offset, bool store) {
+    int container = store ? -24 : -16;
+    int index = store ? -16 : -8;
+    int slowPaths[7];
+    int slowCount = 0;
+
+    movLoad(as, RCX, TOP_REG, index);
+    slowPaths[slowCount++] = jumpIfInt(as, RCX, CC_NE);
+    movLoad(as, RAX, TOP_REG, container);
+    movImm(as, RSI, QNAN | SIGN_BIT);
+    movReg(as, RDX, RAX);
+    alu(as, ALU_AND, RDX, RSI);
+    alu(as, ALU_CMP, RDX, RSI);
+    slowPaths[slowCount++] = jcc(as, CC_NE);
+    movImm(as, RSI, ~(QNAN | SIGN_BIT));
+    alu(as, ALU_AND, RAX, RSI);
+    cmpMem32Imm(as, RAX, offsetof(Obj, type), OBJ_LIST);
+    int notList = jcc(as, CC_NE);
+
+    // Unsigned, so that a negative index is out of range too.
+    movsxdLoad(as, RDX, RAX, offsetof(ObjList, items.count));
+    alu32(as, ALU_CMP, RDX, RCX);
+    slowPaths[slowCount++] = jcc(as, CC_BE);
+#ifdef GENERATIONAL_GC
+    if (store) {
+        movLoad(as, RDI, TOP_REG, -8);
+        slowPaths[slowCount++] = jumpIfBarrier(as, RAX, RDI);
+    }
+#endif
+    // In range, so not negative, and sign extending it is as good as zero extending.
+    movsxdLoad(as, RCX, TOP_REG, index);
+    shlImm(as, RCX, 3);
+    movLoad(as, RAX, RAX, offsetof(ObjList, items.values));
+    alu(as, ALU_ADD, RAX, RCX);
+    if (store) {
+        movLoad(as, RCX, TOP_REG, -8);
+        movStore(as, RAX, 0, RCX);
+        movStore(as, TOP_REG, container, RCX);
+        aluImm(as, SUB_IMM, TOP_REG, 16);
+    } else {
+        movLoad(as, RAX, RAX, 0);
+        movStore(as, TOP_REG, container, RAX);
+        aluImm(as, SUB_IMM, TOP_REG, 8);
+    }
+    int listDone = jmp(as);
+
+    // Float arrays hold their doubles unboxed, so a load is the bits as they are and a store takes
+    // a double as it is or widens an int. The other stores go to setItem() for its error.
+    bindHere(as, notList);
+    cmpMem32Imm(as, RAX, offsetof(Obj, type), OBJ_FLOAT_ARRAY);
+    slowPaths[slowCount++] = jcc(as, CC_NE);
+    movsxdLoad(as, RDX, RAX, offsetof(ObjFloatArray, count));
+    alu32(as, ALU_CMP, RDX, RCX);
+    slowPaths[slowCount++] = jcc(as, CC_BE);
+    movsxdLoad(as, RCX, TOP_REG, index);
+    shlImm(as, RCX, 3);
+    alu(as, ALU_ADD, RAX, RCX);
+    if (store) {
+        movLoad(as, RCX, TOP_REG, -8);
+        int notInt = jumpIfInt(as, RCX, CC_NE);
+        intToDouble(as, XMM0, RCX);
+        movqFromXmm(as, RDX, XMM0);
+        movStore(as, RAX, offsetof(ObjFloatArray, values), RDX);
+        int stored = jmp(as);
+        bindHere(as, notInt);
+        movReg(as, RDX, RCX);
+        alu(as, ALU_AND, RDX, QNAN_REG);
+        alu(as, ALU_CMP, RDX, QNAN_REG);
+        slowPaths[slowCount++] = jcc(as, CC_E);
+        movStore(as, RAX, offsetof(ObjFloatArray, values), RCX);
+        bindHere(as, stored);
+        movStore(as, TOP_REG, container, RCX);
+        aluImm(as, SUB_IMM, TOP_REG, 16);
+    } else {
+        movLoad(as, RAX, RAX, offsetof(ObjFloatArray, values));
+        movStore(as, TOP_REG, container, RAX);
+        aluImm(as, SUB_IMM, TOP_REG, 8);
+    }
+    int done = jmp(as);
+
+    for (int i = 0; i < slowCount; i++) bindHere(as, slowPaths[i]);
+    callRuntime(as, offset, 1, store ? jitStoreIndex : jitLoadIndex, 0, 0);
+    bindHere(as, done);
+    bindHere(as, listDone);
+}
+
+// Calls a NATIVE_NO_ALLOC native taking `argCount` arguments in place, leaving every other callee
+// to run(). The native neither allocates nor reads the VM stack, so vm->stackTop stays as it is;
+// only the frame's ip is written, for the stack trace should the native raise an error.
+static void nativeCall(Assembler* as, int offset, uint8_t argCount) {
+    int calleeSlot = -(argCount + 1) * 8;
+
+    movLoad(as, RAX, TOP_REG, calleeSlot);
+    movImm(as, RCX, QNAN | SIGN_BIT);
+    movReg(as, RDX, RAX);
+    alu(as, ALU_AND, RDX, RCX);
+    alu(as, ALU_CMP, RDX, RCX);
+    sideExit(as, jcc(as, CC_NE), offset);
+    movImm(as, RCX, ~(QNAN | SIGN_BIT));
+    alu(as, ALU_AND, RAX, RCX);
+    cmpMem32Imm(as, RAX, offsetof(Obj, type), OBJ_NATIVE);
+    sideExit(as, jcc(as, CC_NE), offset);
+    movsxdLoad(as, RDX, RAX, offsetof(ObjNative, flags));
+    aluImm(as, AND_IMM, RDX, NATIVE_NO_ALLOC);
+    sideExit(as, jcc(as, CC_E), offset);
+    // Unsigned, so that NATIVE_VARIADIC is above any argument count.
+    cmpMem32Imm(as, RAX, offsetof(ObjNative, arity), argCount);
+    sideExit(as, jcc(as, CC_A), offset);
+    cmpMem32Imm(as, RAX, offsetof(ObjNative, maxArity), argCount);
+    sideExit(as, jcc(as, CC_B), offset);
+    // The runtime flattens ropes passed to a native. One exit serves every argument.
+    cmpMem32Imm(as, VM_REG, offsetof(VM, madeStrings), 0);
+    int noRopes = jcc(as, CC_E);
+    int checks = jmp(as);
+    int ropeArgument = as->count;
+    sideExit(as, jmp(as), offset);
+    bindHere(as, checks);
+    for (int i = 1; i <= argCount; i++) {
+        movLoad(as, RCX, TOP_REG, -i * 8);
+        bindBackward(as, jumpIfRope(as, RCX), ropeArgument);
+    }
+    bindHere(as, noRopes);
+
+    movImm(as, RCX, instructionAddress(as, offset + 2));
+    movStore(as, FRAME_REG, offsetof(CallFrame, ip), RCX);
+    movLoad(as, RAX, RAX, offsetof(ObjNative, function));
+    movReg(as, RDI, VM_REG);
+    movImm(as, RSI, argCount);
+    lea(as, RDX, TOP_REG, -argCount * 8);
+    lea(as, RCX, TOP_REG, calleeSlot);
+    emit8(as, 0xFF);
+    emit8(as, 0xD0); // call rax
+    emit8(as, 0x84);
+    emit8(as, 0xC0); // test al, al
+    bindBackward(as, jcc(as, CC_E), as->errorLabel);
+    lea(as, TOP_REG, TOP_REG, -argCount * 8);
+}
+
+static int sseOp(uint8_t instruction) {
+    switch (instruction) {
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_CONSTANT:
+        case OP_REG_SUBTRACT: return SSE_SUB;
+        case OP_MULTIPLY:
+        case OP_REG_MULTIPLY: return SSE_MUL;
+        case OP_DIVIDE:
+        case OP_REG_DIVIDE: return SSE_DIV;
+        default: return SSE_ADD;
+    }
+}
+
+// Computes a op b on xmm0 and xmm1 into RAX: a number for arithmetic, a bool for comparisons.
+static void numberOp(Assembler* as, uint8_t instruction) {
+    switch (instruction) {
+        case OP_LESS:
+        case OP_LESS_CONSTANT:
+        case OP_REG_LESS:
+            ucomisd(as, XMM1, XMM0);
+            boolFromFlags(as, CC_A);
+            break;
+        case OP_GREATER:
+        case OP_REG_GREATER:
+            ucomisd(as, XMM0, XMM1);
+            boolFromFlags(as, CC_A);
+            break;
+        default:
+            sse(as, sseOp(instruction), XMM0, XMM1);
+            movqFromXmm(as, RAX, XMM0);
+            break;
+    }
+}
+
+// Loads the number in `reg` into `xmm` as a double, widening an int. `constant` is the operand's
+// value where it is a constant, else NULL. Anything but a number exits.
+static void loadDouble(Assembler* as, int xmm, int reg, const Value* constant, int offset) {
+    if (constant != NULL) {
+        movImm(as, reg, NUMBER_VAL(AS_NUMBER(*constant)));
+        movqToXmm(as, xmm, reg);
+        return;
+    }
+    int notInt = jumpIfInt(as, reg, CC_NE);
+    intToDouble(as, xmm, reg);
+    int done = jmp(as);
+    bindHere(as, notInt);
+    checkDouble(as, reg, offset);
+    movqToXmm(as, xmm, reg);
+    bindHere(as, done);
+}
+
+static bool hasIntPath(uint8_t instruction) {
+    return instruction != OP_DIVIDE && instruction != OP_REG_DIVIDE;
+}
+
+// RAX = RAX op RCX on two ints, as addNumbers() and the rest do it. Adds the jumps to take where
+// the result needs doubles to the path's patches.
+static void intOp(Assembler* as, uint8_t instruction, DoublePath* path) {
+    switch (instruction) {
+        case OP_LESS:
+        case OP_LESS_CONSTANT:
+        case OP_REG_LESS:
+            alu32(as, ALU_CMP, RAX, RCX);
+            boolFromFlags(as, CC_L);
+            return;
+        case OP_GREATER:
+        case OP_REG_GREATER:
+            alu32(as, ALU_CMP, RAX, RCX);
+            boolFromFlags(as, CC_G);
+            return;
+        case OP_MULTIPLY:
+        case OP_REG_MULTIPLY:
+            movReg(as, RDX, RAX);
+            imul32(as, RDX, RCX);
+            path->patches[path->patchCount++] = jcc(as, CC_O);
+            // A zero product may be -0, which only a double can be.
+            alu32(as, TEST, RDX, RDX);
+            path->patches[path->patchCount++] = jcc(as, CC_E);
+            break;
+        default:
+            movReg(as, RDX, RAX);
+            alu32(as, sseOp(instruction) == SSE_SUB ? ALU_SUB : ALU_ADD, RDX, RCX);
+            path->patches[path->patchCount++] = jcc(as, CC_O);
+            break;
+    }
+    movImm(as, RAX, INT_TAG);
+    alu(as, ALU_OR, RAX, RDX);
+}
+
+// RAX = RAX op RCX for two numbers, a number for arithmetic or a bool for comparisons. `a` and `b`
+// are the operands' values where they are constants, else NULL. Where both may be ints and the
+// instruction has an int path, that is what runs inline, and doubles go out of line.
+static void numberOperation(Assembler* as, uint8_t instruction, const Value* a, const Value* b, int offset) {
+    if (!hasIntPath(instruction) || (a != NULL && !IS_INT(*a)) || (b != NULL && !IS_INT(*b))) {
+        loadDouble(as, XMM0, RAX, a, offset);
+        loadDouble(as, XMM1, RCX, b, offset);
+        numberOp(as, instruction);
+        return;
+    }
+    DoublePath* path = &as->doublePaths[as->doublePathCount++];
+    path->patchCount = 0;
+    path->instruction = instruction;
+    path->offset = offset;
+    path->a = a;
+    path->b = b;
+    path->notIntA = a == NULL ? jumpIfInt(as, RAX, CC_NE) : -1;
+    if (b == NULL) path->patches[path->patchCount++] = jumpIfInt(as, RCX, CC_NE);
+    intOp(as, instruction, path);
+    path->done = as->count;
+}
+
+// Laid out so that doubles run straight through, with ints widened off to the side.
+static void compileDoublePath(Assembler* as, DoublePath* path) {
+    // The other jumps come with an int in RAX.
+    for (int i = 0; i < path->patchCount; i++) bindHere(as, path->patches[i]);
+    int loadedA = -1;
+    if (path->a == NULL) {
+        intToDouble(as, XMM0, RAX);
+        loadedA = jmp(as);
+        bindHere(as, path->notIntA);
+        checkDouble(as, RAX, path->offset);
+        movqToXmm(as, XMM0, RAX);
+        bindHere(as, loadedA);
+    } else {
+        loadDouble(as, XMM0, RAX, path->a, path->offset);
+    }
+
+    int intB = -1;
+    if (path->b == NULL) {
+        intB = jumpIfInt(as, RCX, CC_E);
+        checkDouble(as, RCX, path->offset);
+        movqToXmm(as, XMM1, RCX);
+    } else {
+        loadDouble(as, XMM1, RCX, path->b, path->offset);
+    }
+    int loadedB = as->count;
+    numberOp(as, path->instruction);
+    bindBackward(as, jmp(as), path->done);
+
+    if (intB != -1) {
+        bindHere(as, intB);
+        intToDouble(as, XMM1, RCX);
+        bindBackward(as, jmp(as), loadedB);
+    }
+}
+
+static void binaryNumber(Assembler* as, uint8_t instruction, int offset) {
+    movLoad(as, RAX, TOP_REG, -16);
+    movLoad(as, RCX, TOP_REG, -8);
+    numberOperation(as, instruction, NULL, NULL, offset);
+    movStore(as, TOP_REG, -16, RAX);
+    aluImm(as, SUB_IMM, TOP_REG, 8);
+}
+
+static void constantNumber(Assembler* as, uint8_t instruction, int offset) {
+    Value* constant = &as->chunk->constants.values[as->chunk->code[offset + 1]];
+    if (!IS_NUMBER(*constant)) {
+        exitAt(as, offset);
+        return;
+    }
+    movLoad(as, RAX, TOP_REG, -8);
+    movImm(as, RCX, *constant);
+    numberOperation(as, instruction, NULL, constant, offset);
+    movStore(as, TOP_REG, -8, RAX);
+}
+
+// The value of a constant operand, or NULL for a register.
+static Value* operandConstant(Assembler* as, uint8_t operand) {
+    if (!(operand & RK_CONSTANT)) return NULL;
+    return &as->chunk->constants.values[operand & ~RK_CONSTANT];
+}
+
+static void registerOp(Assembler* as, uint8_t instruction, int offset) {
+    uint8_t* code = as->chunk->code + offset;
+    uint8_t dst = code[1];
+    uint8_t a = code[2];
+    uint8_t b = code[3];
+    uint8_t top = code[4];
+
+    loadOperand(as, RAX, a);
+    loadOperand(as, RCX, b);
+    if (instruction == OP_REG_EQUAL) {
+        equalValues(as, offset);
+    } else {
+        Value* constantA = operandConstant(as, a);
+        Value* constantB = operandConstant(as, b);
+        if ((constantA != NULL && !IS_NUMBER(*constantA)) || (constantB != NULL && !IS_NUMBER(*constantB))) {
+            exitAt(as, offset);
+            return;
+        }
+        numberOperation(as, instruction, constantA, constantB, offset);
+    }
+    movStore(as, SLOTS_REG, dst * 8, RAX);
+    lea(as, TOP_REG, SLOTS_REG, top * 8);
+}
+
+static void loadUpvalueLocation(Assembler* as, int reg, uint8_t index) {
+    movLoad(as, reg, FRAME_REG, offsetof(CallFrame, closure));
+    movLoad(as, reg, reg, (int32_t)(offsetof(ObjClosure, upvalues) + index * sizeof(ObjUpvalue*)));
+    movLoad(as, reg, reg, offsetof(ObjUpvalue, location));
+}
+
+static int32_t globalOffset(uint8_t index) {
+    return (int32_t)(offsetof(VM, globals) + offsetof(Globals, values) + index * sizeof(Value));
+}
+
+static void compileInstruction(Assembler* as, int offset) {
+    uint8_t* code = as->chunk->code + offset;
+    uint8_t instruction = code[0];
+
+    switch (instruction) {
+        case OP_CONSTANT:
+            movImm(as, RAX, as->chunk->constants.values[code[1]]);
+            pushValue(as, RAX);
+            break;
+        case OP_NIL:
+            movImm(as, RAX, NIL_VAL);
+            pushValue(as, RAX);
+            break;
+        case OP_TRUE:
+            movImm(as, RAX, TRUE_VAL);
+            pushValue(as, RAX);
+            break;
+        case OP_FALSE:
+            movImm(as, RAX, FALSE_VAL);
+            pushValue(as, RAX);
+            break;
+        case OP_POP:
+            aluImm(as, SUB_IMM, TOP_REG, 8);
+            break;
+        case OP_GET_LOCAL:
+            movLoad(as, RAX, SLOTS_REG, code[1] * 8);
+            pushValue(as, RAX);
+            break;
+        case OP_SET_LOCAL:
+            movLoad(as, RAX, TOP_REG, -8);
+            movStore(as, SLOTS_REG, code[1] * 8, RAX);
+            break;
+        case OP_POP_GET_GLOBAL:
+            aluImm(as, SUB_IMM, TOP_REG, 8);
+            movLoad(as, RAX, VM_REG, globalOffset(code[1]));
+            pushValue(as, RAX);
+            break;
+        case OP_GET_GLOBAL:
+            movLoad(as, RAX, VM_REG, globalOffset(code[1]));
+            pushValue(as, RAX);
+            break;
+        case OP_DEFINE_GLOBAL:
+            aluImm(as, SUB_IMM, TOP_REG, 8);
+            movLoad(as, RAX, TOP_REG, 0);
+            movStore(as, VM_REG, globalOffset(code[1]), RAX);
+            break;
+        case OP_SET_GLOBAL:
+            movLoad(as, RAX, TOP_REG, -8);
+            movStore(as, VM_REG, globalOffset(code[1]), RAX);
+            break;
+        case OP_GET_UPVALUE:
+            loadUpvalueLocation(as, RCX, code[1]);
+            movLoad(as, RAX, RCX, 0);
+            pushValue(as, RAX);
+            break;
+        case OP_SET_UPVALUE:
+#ifdef GENERATIONAL_GC
+            movLoad(as, RCX, FRAME_REG, offsetof(CallFrame, closure));
+            movLoad(as, RCX, RCX, (int32_t)(offsetof(ObjClosure, upvalues) + code[1] * sizeof(ObjUpvalue*)));
+            movLoad(as, RAX, TOP_REG, -8);
+            sideExit(as, jumpIfBarrier(as, RCX, RAX), offset);
+            movLoad(as, RCX, RCX, offsetof(ObjUpvalue, location));
+#else
+            loadUpvalueLocation(as, RCX, code[1]);
+            movLoad(as, RAX, TOP_REG, -8);
+#endif
+            movStore(as, RCX, 0, RAX);
+            break;
+        case OP_EQUAL:
+            movLoad(as, RAX, TOP_REG, -16);
+            movLoad(as, RCX, TOP_REG, -8);
+            equalValues(as, offset);
+            movStore(as, TOP_REG, -16, RAX);
+            aluImm(as, SUB_IMM, TOP_REG, 8);
+            break;
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            binaryNumber(as, instruction, offset);
+            break;
+        case OP_ADD_CONSTANT:
+        case OP_SUBTRACT_CONSTANT:
+        case OP_LESS_CONSTANT:
+            constantNumber(as, instruction, offset);
+            break;
+        case OP_NOT:
+            movLoad(as, RAX, TOP_REG, -8);
+            testFalsey(as);
+            boolFromFlags(as, CC_BE);
+            movStore(as, TOP_REG, -8, RAX);
+            break;
+        case OP_NEGATE:
+            movLoad(as, RAX, TOP_REG, -8);
+            loadDouble(as, XMM0, RAX, NULL, offset);
+            movqFromXmm(as, RAX, XMM0);
+            movImm(as, RCX, SIGN_BIT);
+            alu(as, ALU_XOR, RAX, RCX);
+            movStore(as, TOP_REG, -8, RAX);
+            break;
+        case OP_LOOP:
+#ifdef GENERATIONAL_GC
+            // run() collects the nursery at the back-edge.
+            movImm(as, RCX, (uint64_t)(uintptr_t)&as->mm->nurseryFull);
+            cmpMem8Imm(as, RCX, 0, 0);
+            sideExit(as, jcc(as, CC_NE), offset);
+#endif
+            jumpTo(as, jmp(as), jumpTarget(as->chunk, offset));
+            break;
+        case OP_JUMP:
+            jumpTo(as, jmp(as), jumpTarget(as->chunk, offset));
+            break;
+        case OP_JUMP_IF_FALSE:
+            movLoad(as, RAX, TOP_REG, -8);
+            testFalsey(as);
+            jumpTo(as, jcc(as, CC_BE), jumpTarget(as->chunk, offset));
+            break;
+        case OP_JUMP_IF_FALSE_POP:
+            movLoad(as, RAX, TOP_REG, -8);
+            testFalsey(as);
+            jumpTo(as, jcc(as, CC_BE), jumpTarget(as->chunk, offset));
+            aluImm(as, SUB_IMM, TOP_REG, 8);
+            break;
+        case OP_PRINT:
+            callRuntime(as, offset, 1, jitPrint, 0, 0);
+            break;
+        case OP_CALL:
+            nativeCall(as, offset, code[1]);
+            break;
+        case OP_GET_LOCAL_PROPERTY:
+            movLoad(as, RAX, SLOTS_REG, code[1] * 8);
+            pushValue(as, RAX);
+            propertyAccess(as, offset, 5, code[2], (code[3] << 8) | code[4], false);
+            break;
+        case OP_GET_PROPERTY:
+            propertyAccess(as, offset, 4, code[1], (code[2] << 8) | code[3], false);
+            break;
+        case OP_SET_PROPERTY:
+            propertyAccess(as, offset, 4, code[1], (code[2] << 8) | code[3], true);
+            break;
+        case OP_GET_INDEX:
+            indexAccess(as, offset, false);
+            break;
+        case OP_SET_INDEX:
+            indexAccess(as, offset, true);
+            break;
+        case OP_REG_MOVE:
+            loadOperand(as, RAX, code[2]);
+            movStore(as, SLOTS_REG, code[1] * 8, RAX);
+            lea(as, TOP_REG, SLOTS_REG, code[3] * 8);
+            break;
+        case OP_REG_EQUAL:
+        case OP_REG_GREATER:
+        case OP_REG_LESS:
+        case OP_REG_ADD:
+        case OP_REG_SUBTRACT:
+        case OP_REG_MULTIPLY:
+        case OP_REG_DIVIDE:
+            registerOp(as, instruction, offset);
+            break;
+        default:
+            // Calls, returns, closures and classes change frames or allocate; run() does those.
+            exitAt(as, offset);
+            break;
+    }
+}
+
+// Entering compiled code costs about as much as interpreting an instruction or two, so run()
+// only enters where at least MIN_NATIVE_RUN instructions follow before the code exits again.
+#define MIN_NATIVE_RUN 2
+
+static void skipShortRuns(Assembler* as) {
+    Chunk* chunk = as->chunk;
+    int* run = ALLOCATE(as->mm, int, chunk->count + 1);
+    run[chunk->count] = 0;
+    for (int offset = chunk->count - 1; offset >= 0; offset--) {
+        if (as->labels[offset] == -1) continue;
+
+        if (as->entries[offset] == -1) {
+            run[offset] = 0;
+        } else if (isJumpInstruction(chunk->code[offset])) {
+            run[offset] = MIN_NATIVE_RUN;
+        } else {
+            run[offset] = 1 + run[offset + instructionLength(chunk, offset)];
+        }
+        if (run[offset] < MIN_NATIVE_RUN) as->entries[offset] = -1;
+    }
+    FREE_ARRAY(as->mm, int, run, chunk->count + 1);
+}
+
+static void compilePrologue(Assembler* as) {
+    push(as, RBX);
+    push(as, R12);
+    push(as, R13);
+    push(as, R14);
+    push(as, R15);
+    movReg(as, VM_REG, RDI);
+    movReg(as, FRAME_REG, RSI);
+    movLoad(as, SLOTS_REG, FRAME_REG, offsetof(CallFrame, slots));
+    movLoad(as, TOP_REG, VM_REG, offsetof(VM, stackTop));
+    movImm(as, QNAN_REG, QNAN);
+    emit8(as, 0xFF);
+    emit8(as, 0xE2); // jmp rdx
+
+    // Exit with the bytecode address to resume at in rax.
+    as->exitLabel = as->count;
+    movStore(as, FRAME_REG, offsetof(CallFrame, ip), RAX);
+    movStore(as, VM_REG, offsetof(VM, stackTop), TOP_REG);
+    emit8(as, 0x31);
+    emit8(as, 0xC0); // xor eax, eax
+    int epilogue = as->count;
+    pop(as, R15);
+    pop(as, R14);
+    pop(as, R13);
+    pop(as, R12);
+    pop(as, RBX);
+    emit8(as, 0xC3);
+
+    // The runtime has reported an error and reset the stack; there is nothing to write back.
+    as->errorLabel = as->count;
+    emit8(as, 0xB8);
+    emit32(as, JIT_ERROR); // mov eax, JIT_ERROR
+    bindBackward(as, jmp(as), epilogue);
+}
+
+// Compiled functions are packed into shared regions rather than getting a mapping each; with
+// a page per function every one of them starts at the same cache set. A region's first page
+// holds its bookkeeping and stays writable, the rest is only writable while code is copied in.
+struct CodeRegion {
+    size_t size;
+    size_t used;
+    int liveCount;
+};
+
+#define PAGE_SIZE 4096
+#define REGION_SIZE (64 * PAGE_SIZE)
+#define CODE_ALIGNMENT 16
+
+// The region new code goes into. It is shared by every VM in the process.
+static CodeRegion* openRegion = NULL;
+
+static uint8_t* regionCode(CodeRegion* region) {
+    return (uint8_t*)region + PAGE_SIZE;
+}
+
+static void releaseRegion(CodeRegion* region) {
+    if (--region->liveCount > 0) return;
+    if (region == openRegion) openRegion = NULL;
+    munmap(region, region->size);
+}
+
+static CodeRegion* newRegion(size_t codeSize) {
+    size_t size = PAGE_SIZE + REGION_SIZE;
+    if (codeSize > REGION_SIZE) size = PAGE_SIZE + (codeSize + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+
+    void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return NULL;
+
+    CodeRegion* region = (CodeRegion*)memory;
+    region->size = size;
+    region->used = 0;
+    // The open region holds a reference of its own, so it survives its functions being freed.
+    region->liveCount = 1;
+    return region;
+}
+
+static uint8_t* installCode(const uint8_t* bytes, size_t size, CodeRegion** regionOut) {
+    CodeRegion* region = openRegion;
+    if (region == NULL || region->used + size > region->size - PAGE_SIZE) {
+        region = newRegion(size);
+        if (region == NULL) return NULL;
+        if (openRegion != NULL) releaseRegion(openRegion);
+        openRegion = region;
+    }
+
+    uint8_t* code = regionCode(region);
+    size_t codeSize = region->size - PAGE_SIZE;
+    if (mprotect(code, codeSize, PROT_READ | PROT_WRITE) != 0) return NULL;
+    uint8_t* start = code + region->used;
+    memcpy(start, bytes, size);
+    if (mprotect(code, codeSize, PROT_READ | PROT_EXEC) != 0) return NULL;
+
+    region->used = (region->used + size + CODE_ALIGNMENT - 1) / CODE_ALIGNMENT * CODE_ALIGNMENT;
+    region->liveCount++;
+    *regionOut = region;
+    return start;
+}
+
+static void freeAssembler(Assembler* as, int count) {
+    FREE_ARRAY(as->mm, uint8_t, as->bytes, as->capacity);
+    FREE_ARRAY(as->mm, int, as->labels, count);
+    FREE_ARRAY(as->mm, Fixup, as->jumps, count);
+    FREE_ARRAY(as->mm, Fixup, as->exits, count * 3);
+    FREE_ARRAY(as->mm, ValueCompare, as->valueCompares, count);
+    FREE_ARRAY(as->mm, DoublePath, as->doublePaths, count);
+}
+
+bool compileJit(VM* vm, ObjFunction* function) {
+    MemoryManager* mm = vm->mm;
+    Chunk* chunk = &function->chunk;
+    int count = chunk->count;
+
+    Assembler as;
+    as.mm = mm;
+    as.chunk = chunk;
+    as.bytes = NULL;
+    as.count = 0;
+    as.capacity = 0;
+    as.labels = ALLOCATE(mm, int, count);
+    as.entries = ALLOCATE(mm, int, count);
+    as.jumps = ALLOCATE(mm, Fixup, count);
+    as.jumpCount = 0;
+    as.exits = ALLOCATE(mm, Fixup, count * 3);
+    as.exitCount = 0;
+    as.valueCompares = ALLOCATE(mm, ValueCompare, count);
+    as.valueCompareCount = 0;
+    as.doublePaths = ALLOCATE(mm, DoublePath, count);
+    as.doublePathCount = 0;
+    for (int i = 0; i < count; i++) {
+        as.labels[i] = -1;
+        as.entries[i] = -1;
+    }
+
+    compilePrologue(&as);
+    for (int offset = 0; offset < count; offset += instructionLength(chunk, offset)) {
+        as.labels[offset] = as.count;
+        as.entries[offset] = as.count;
+        compileInstruction(&as, offset);
+    }
+
+    skipShortRuns(&as);
+
+    for (int i = 0; i < as.jumpCount; i++) {
+        Fixup* fixup = &as.jumps[i];
+        patch32(&as, fixup->patch, as.labels[fixup->target] - (fixup->patch + 4));
+    }
+
+    for (int i = 0; i < as.valueCompareCount; i++) {
+        compareValues(&as, &as.valueCompares[i]);
+    }
+    for (int i = 0; i < as.doublePathCount; i++) {
+        compileDoublePath(&as, &as.doublePaths[i]);
+    }
+
+    // Side exits are cold, so they go after all the instructions.
+    for (int i = 0; i < as.exitCount; i++) {
+        Fixup* fixup = &as.exits[i];
+        patch32(&as, fixup->patch, as.count - (fixup->patch + 4));
+        movImm(&as, RAX, instructionAddress(&as, fixup->target));
+        bindBackward(&as, jmp(&as), as.exitLabel);
+    }
+
+    CodeRegion* region;
+    uint8_t* memory = installCode(as.bytes, (size_t)as.count, &region);
+    freeAssembler(&as, count);
+    if (memory == NULL) {
+        FREE_ARRAY(mm, int, as.entries, count);
+        return false;
+    }
+
+    JitCode* jit = ALLOCATE(mm, JitCode, 1);
+    jit->code = memory;
+    jit->region = region;
+    jit->entries = as.entries;
+    jit->entryCount = count;
+    function->jit = jit;
+    return true;
+}
+
+JitStatus enterJit(VM* vm, CallFrame* frame) {
+    ObjFunction* function = frame->function;
+    JitCode* jit = function->jit;
+    int entry = jit->entries[frame->ip - function->chunk.code];
+    if (entry < 0) return JIT_EXIT;
+
+    JitFn fn;
+    memcpy(&fn, &jit->code, sizeof(fn));
+    return fn(vm, frame, jit->code + entry);
+}
+
+void freeJit(MemoryManager* mm, JitCode* jit) {
+    releaseRegion(jit->region);
+    FREE_ARRAY(mm, int, jit->entries, jit->entryCount);
+    FREE(mm, JitCode, jit);
+}
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef CLOX_JIT_H
+#define CLOX_JIT_H
+
+#include "vm.h"
+
+#define JIT_THRESHOLD 1000
+
+#ifdef BASELINE_JIT
+
+typedef enum {
+    JIT_EXIT,  // Carry on interpreting at frame->ip.
+    JIT_ERROR  // A runtime error has already been reported.
+} JitStatus;
+
+typedef struct CodeRegion CodeRegion;
+
+typedef struct JitCode {
+    uint8_t* code;
+    CodeRegion* region;
+    int* entries; // Native offset of each bytecode instruction, -1 for operand bytes.
+    int entryCount;
+} JitCode;
+
+bool compileJit(VM* vm, ObjFunction* function);
+JitStatus enterJit(VM* vm, CallFrame* frame);
+void freeJit(MemoryManager* mm, JitCode* jit);
+
+#endif
+
+#endif //CLOX_JIT_H
@@ -0,0 +1,275 @@
+#include <math.h>
+
+#include "kernels.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define SIMD_KERNELS
+#endif
+
+// The plain loops, which are also what finishes off the last few doubles after the vector loops.
+
+static double sumScalar(const double* a, int count) {
+    double sum = 0;
+    for (int i = 0; i < count; i++) sum += a[i];
+    return sum;
+}
+
+static double dotScalar(const double* a, const double* b, int count) {
+    double sum = 0;
+    for (int i = 0; i < count; i++) sum += a[i] * b[i];
+    return sum;
+}
+
+static double minScalar(double min, const double* a, int count) {
+    for (int i = 0; i < count; i++) {
+        if (a[i] < min) min = a[i];
+    }
+    return min;
+}
+
+static double maxScalar(double max, const double* a, int count) {
+    for (int i = 0; i < count; i++) {
+        if (a[i] > max) max = a[i];
+    }
+    return max;
+}
+
+static void scaleScalar(double* a, int count, double factor) {
+    for (int i = 0; i < count; i++) a[i] *= factor;
+}
+
+static void axpyScalar(double alpha, const double* x, double* y, int count) {
+    for (int i = 0; i < count; i++) y[i] += alpha * x[i];
+}
+
+static void mapScalar(double* a, int count, FloatOp op) {
+    for (int i = 0; i < count; i++) {
+        switch (op) {
+            case FLOAT_ABS: a[i] = fabs(a[i]); break;
+            case FLOAT_NEGATE: a[i] = -a[i]; break;
+            case FLOAT_SQRT: a[i] = sqrt(a[i]); break;
+            case FLOAT_SQUARE: a[i] = a[i] * a[i]; break;
+        }
+    }
+}
+
+#ifdef SIMD_KERNELS
+
+// SSE2 is part of x86-64, so these need no check. The reductions keep two vectors of partial
+// results, so that each addition need not wait for the one before.
+
+static double sumSse2(const double* a, int count) {
+    __m128d sum0 = _mm_setzero_pd();
+    __m128d sum1 = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        sum0 = _mm_add_pd(sum0, _mm_loadu_pd(a + i));
+        sum1 = _mm_add_pd(sum1, _mm_loadu_pd(a + i + 2));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(sum0, sum1));
+    return lanes[0] + lanes[1] + sumScalar(a + i, count - i);
+}
+
+static double dotSse2(const double* a, const double* b, int count) {
+    __m128d sum0 = _mm_setzero_pd();
+    __m128d sum1 = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128d product0 = _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+        __m128d product1 = _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2));
+        sum0 = _mm_add_pd(sum0, product0);
+        sum1 = _mm_add_pd(sum1, product1);
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(sum0, sum1));
+    return lanes[0] + lanes[1] + dotScalar(a + i, b + i, count - i);
+}
+
+static double minSse2(const double* a, int count) {
+    __m128d min = _mm_set1_pd(a[0]);
+    int i = 0;
+    for (; i + 2 <= count; i += 2) min = _mm_min_pd(min, _mm_loadu_pd(a + i));
+    double lanes[2];
+    _mm_storeu_pd(lanes, min);
+    return minScalar(lanes[0] < lanes[1] ? lanes[0] : lanes[1], a + i, count - i);
+}
+
+static double maxSse2(const double* a, int count) {
+    __m128d max = _mm_set1_pd(a[0]);
+    int i = 0;
+    for (; i + 2 <= count; i += 2) max = _mm_max_pd(max, _mm_loadu_pd(a + i));
+    double lanes[2];
+    _mm_storeu_pd(lanes, max);
+    return maxScalar(lanes[0] > lanes[1] ? lanes[0] : lanes[1], a + i, count - i);
+}
+
+static void scaleSse2(double* a, int count, double factor) {
+    __m128d factors = _mm_set1_pd(factor);
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        _mm_storeu_pd(a + i, _mm_mul_pd(_mm_loadu_pd(a + i), factors));
+    }
+    scaleScalar(a + i, count - i, factor);
+}
+
+static void axpySse2(double alpha, const double* x, double* y, int count) {
+    __m128d alphas = _mm_set1_pd(alpha);
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128d product = _mm_mul_pd(alphas, _mm_loadu_pd(x + i));
+        _mm_storeu_pd(y + i, _mm_add_pd(_mm_loadu_pd(y + i), product));
+    }
+    axpyScalar(alpha, x + i, y + i, count - i);
+}
+
+static void mapSse2(double* a, int count, FloatOp op) {
+    __m128d signs = _mm_set1_pd(-0.0);
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128d values = _mm_loadu_pd(a + i);
+        switch (op) {
+            case FLOAT_ABS: values = _mm_andnot_pd(signs, values); break;
+            case FLOAT_NEGATE: values = _mm_xor_pd(signs, values); break;
+            case FLOAT_SQRT: values = _mm_sqrt_pd(values); break;
+            case FLOAT_SQUARE: values = _mm_mul_pd(values, values); break;
+        }
+        _mm_storeu_pd(a + i, values);
+    }
+    mapScalar(a + i, count - i, op);
+}
+
+// The same with four lanes. Only called once hasAvx() says the CPU and OS support AVX.
+
+#define AVX __attribute__((target("avx")))
+
+AVX static double sumAvx(const double* a, int count) {
+    __m256d sum0 = _mm256_setzero_pd();
+    __m256d sum1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        sum0 = _mm256_add_pd(sum0, _mm256_loadu_pd(a + i));
+        sum1 = _mm256_add_pd(sum1, _mm256_loadu_pd(a + i + 4));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(sum0, sum1));
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) + sumScalar(a + i, count - i);
+}
+
+AVX static double dotAvx(const double* a, const double* b, int count) {
+    __m256d sum0 = _mm256_setzero_pd();
+    __m256d sum1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256d product0 = _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+        __m256d product1 = _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4));
+        sum0 = _mm256_add_pd(sum0, product0);
+        sum1 = _mm256_add_pd(sum1, product1);
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(sum0, sum1));
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) + dotScalar(a + i, b + i, count - i);
+}
+
+AVX static double minAvx(const double* a, int count) {
+    __m256d min = _mm256_set1_pd(a[0]);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) min = _mm256_min_pd(min, _mm256_loadu_pd(a + i));
+    double lanes[4];
+    _mm256_storeu_pd(lanes, min);
+    return minScalar(minScalar(lanes[0], lanes + 1, 3), a + i, count - i);
+}
+
+AVX static double maxAvx(const double* a, int count) {
+    __m256d max = _mm256_set1_pd(a[0]);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) max = _mm256_max_pd(max, _mm256_loadu_pd(a + i));
+    double lanes[4];
+    _mm256_storeu_pd(lanes, max);
+    return maxScalar(maxScalar(lanes[0], lanes + 1, 3), a + i, count - i);
+}
+
+AVX static void scaleAvx(double* a, int count, double factor) {
+    __m256d factors = _mm256_set1_pd(factor);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm256_storeu_pd(a + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), factors));
+    }
+    scaleScalar(a + i, count - i, factor);
+}
+
+AVX static void axpyAvx(double alpha, const double* x, double* y, int count) {
+    __m256d alphas = _mm256_set1_pd(alpha);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d product = _mm256_mul_pd(alphas, _mm256_loadu_pd(x + i));
+        _mm256_storeu_pd(y + i, _mm256_add_pd(_mm256_loadu_pd(y + i), product));
+    }
+    axpyScalar(alpha, x + i, y + i, count - i);
+}
+
+AVX static void mapAvx(double* a, int count, FloatOp op) {
+    __m256d signs = _mm256_set1_pd(-0.0);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d values = _mm256_loadu_pd(a + i);
+        switch (op) {
+            case FLOAT_ABS: values = _mm256_andnot_pd(signs, values); break;
+            case FLOAT_NEGATE: values = _mm256_xor_pd(signs, values); break;
+            case FLOAT_SQRT: values = _mm256_sqrt_pd(values); break;
+            case FLOAT_SQUARE: values = _mm256_mul_pd(values, values); break;
+        }
+        _mm256_storeu_pd(a + i, values);
+    }
+    mapScalar(a + i, count - i, op);
+}
+
+static bool hasAvx(void) {
+    static int avx = -1;
+    if (avx < 0) avx = __builtin_cpu_supports("avx") ? 1 : 0;
+    return avx;
+}
+
+#define KERNEL(name, ...) (hasAvx() ? name##Avx(__VA_ARGS__) : name##Sse2(__VA_ARGS__))
+#else
+#define KERNEL(name, ...) name##Scalar(__VA_ARGS__)
+#endif
+
+double floatsSum(const double* a, int count) {
+    return KERNEL(sum, a, count);
+}
+
+double floatsDot(const double* a, const double* b, int count) {
+    return KERNEL(dot, a, b, count);
+}
+
+#ifdef SIMD_KERNELS
+double floatsMin(const double* a, int count) {
+    return KERNEL(min, a, count);
+}
+
+double floatsMax(const double* a, int count) {
+    return KERNEL(max, a, count);
+}
+#else
+double floatsMin(const double* a, int count) {
+    return minScalar(a[0], a + 1, count - 1);
+}
+
+double floatsMax(const double* a, int count) {
+    return maxScalar(a[0], a + 1, count - 1);
+}
+#endif
+
+void floatsScale(double* a, int count, double factor) {
+    KERNEL(scale, a, count, factor);
+}
+
+void floatsAxpy(double alpha, const double* x, double* y, int count) {
+    KERNEL(axpy, alpha, x, y, count);
+}
+
+void floatsMap(double* a, int count, FloatOp op) {
+    KERNEL(map, a, count, op);
+}
@@ -0,0 +1,28 @@
+#ifndef CLOX_KERNELS_H
+#define CLOX_KERNELS_H
+
+#include "common.h"
+
+// Loops over arrays of doubles for the float array natives. On x86-64 they run four lanes at a
+// time with AVX where the CPU has it and two with SSE2 otherwise; elsewhere they are plain loops.
+// Sums and dot products add up each lane separately, so they may differ from a loop in the last
+// bits.
+
+typedef enum {
+    FLOAT_ABS,
+    FLOAT_NEGATE,
+    FLOAT_SQRT,
+    FLOAT_SQUARE
+} FloatOp;
+
+double floatsSum(const double* a, int count);
+double floatsDot(const double* a, const double* b, int count);
+// Both take at least one double.
+double floatsMin(const double* a, int count);
+double floatsMax(const double* a, int count);
+// In place: a *= factor, y += alpha * x and a = op(a).
+void floatsScale(double* a, int count, double factor);
+void floatsAxpy(double alpha, const double* x, double* y, int count);
+void floatsMap(double* a, int count, FloatOp op);
+
+#endif //CLOX_KERNELS_H
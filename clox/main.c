@@ -1,9 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "vm.h"
 #include "file.h"
 #include "memory.h"
+#include "compiler.h"
+#include "aot.h"
 
 static void repl(VM* vm) {
     char line[1024];
@@ -19,6 +22,25 @@ static void repl(VM* vm) {
     }
 }
 
+static void emitFile(VM* vm, const char* path, const char* outputPath) {
+    char* source = readFile(path);
+    ObjFunction* function = compile(vm->mm, &vm->strings, &vm->globals, source);
+    free(source);
+    if (function == NULL) exit(65);
+
+    FILE* output = stdout;
+    if (outputPath != NULL) {
+        output = fopen(outputPath, "w");
+        if (output == NULL) {
+            fprintf(stderr, "Could not open file \"%s\".\n", outputPath);
+            exit(74);
+        }
+    }
+    bool emitted = emitC(vm, output, function);
+    if (output != stdout) fclose(output);
+    if (!emitted) exit(70);
+}
+
 static void runFile(VM* vm, const char* path) {
     char* source = readFile(path);
     InterpretResult result = interpret(vm, source);
@@ -33,8 +55,7 @@ int main(int argc, const char* argv[]) {
     initMemoryManager(&mm);
 
     VM vm;
-    initVM(&vm);
-    vm.mm = &mm;
+    initVM(&vm, &mm);
 
     MemoryComponent vmComponent;
     vmComponent.data = &vm;
@@ -50,12 +71,28 @@ int main(int argc, const char* argv[]) {
     initNativeFunctionEnvironment(&vm);
     internBuiltinStrings(&vm);
 
-    if (argc == 1) {
+    int arg = 1;
+    bool emit = false;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        if (strcmp(argv[arg], "--registers") == 0) {
+            vm.tier = TIER_REGISTER;
+        } else if (strcmp(argv[arg], "--no-jit") == 0) {
+            vm.jitEnabled = false;
+        } else if (strcmp(argv[arg], "--emit-c") == 0) {
+            emit = true;
+        } else {
+            break;
+        }
+    }
+
+    if (emit && (argc == arg + 1 || argc == arg + 2)) {
+        emitFile(&vm, argv[arg], argc == arg + 2 ? argv[arg + 1] : NULL);
+    } else if (argc == arg && !emit) {
         repl(&vm);
-    } else if (argc == 2) {
-        runFile(&vm, argv[1]);
+    } else if (argc == arg + 1) {
+        runFile(&vm, argv[arg]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
+        fprintf(stderr, "Usage: clox [--registers] [--no-jit] [path] | clox --emit-c path [output]\n");
         exit(64);
     }
 
@@ -1,7 +1,9 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "memory.h"
 #include "debug.h"
+#include "jit.h"
 
 #ifdef DEBUG_LOG_GC
 #include <stdio.h>
@@ -10,62 +12,96 @@
 #define GC_HEAP_GROW_FACTOR 2
 
 
-static void freeObject(MemoryManager* mm, Obj* object) {
-#ifdef DEBUG_LOG_GC
-    printf("%p free type %d\n", (void*)object, object->type);
-#endif
+static size_t objectSize(Obj* object) {
     switch (object->type) {
-        case OBJ_BOUND_METHOD: {
-            FREE(mm, ObjBoundMethod, object);
-            break;
-        }
-        case OBJ_CLASS: {
-            ObjClass* klass = (ObjClass*)object;
-            freeTable(&klass->methods);
-            FREE(mm, ObjClass, object);
+        case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+        case OBJ_CLASS: return sizeof(ObjClass);
+        case OBJ_CLOSURE: return CLOSURE_SIZE(((ObjClosure*)object)->upvalueCount);
+        case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+        case OBJ_FUNCTION: return sizeof(ObjFunction);
+        case OBJ_INSTANCE:
+            return sizeof(ObjInstance) + sizeof(Value) * ((ObjInstance*)object)->inlineCapacity;
+        case OBJ_NATIVE: return sizeof(ObjNative);
+        case OBJ_SHAPE: return sizeof(ObjShape);
+        case OBJ_STRING: return STRING_SIZE(((ObjString*)object)->length);
+        case OBJ_ROPE: return sizeof(ObjRope);
+        case OBJ_LIST: return sizeof(ObjList);
+        case OBJ_MAP: return sizeof(ObjMap);
+        case OBJ_FLOAT_ARRAY: return FLOAT_ARRAY_SIZE(((ObjFloatArray*)object)->count);
+    }
+    return 0;
+}
+
+// Frees what the object owns apart from itself.
+static void freeContents(MemoryManager* mm, Obj* object) {
+    switch (object->type) {
+        case OBJ_CLASS:
+            freeTable(&((ObjClass*)object)->methods);
             break;
-        }
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
             freeChunk(mm, &function->chunk);
-            FREE(mm, ObjFunction, object);
+            FREE_ARRAY(mm, uint8_t, function->ownedSlots, function->ownedSlotCount);
+#ifdef BASELINE_JIT
+            if (function->jit != NULL) freeJit(mm, function->jit);
+#endif
             break;
         }
-        case OBJ_NATIVE: {
-            FREE(mm, ObjNative, object);
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            if (instance->fields != instance->inlineFields) {
+                FREE_ARRAY(mm, Value, instance->fields, instance->fieldCapacity);
+            }
+            freeTable(&instance->dictionary);
             break;
         }
-        case OBJ_STRING: {
-            ObjString* string = (ObjString*)object;
-            FREE_ARRAY(mm, char, string->chars, string->length + 1);
-            FREE(mm, ObjString, object);
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            freeTable(&shape->slots);
+            freeTable(&shape->transitions);
             break;
         }
-        case OBJ_CLOSURE: {
-            ObjClosure* closure = (ObjClosure*) object;
-            FREE_ARRAY(mm, ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-            FREE(mm, ObjClosure, object);
+        case OBJ_LIST:
+            freeValueArray(mm, &((ObjList*)object)->items);
             break;
-        }
-        case OBJ_UPVALUE: {
-            FREE(mm, ObjUpvalue, object);
+        case OBJ_MAP:
+            freeValueTable(&((ObjMap*)object)->table);
             break;
-        }
-        case OBJ_INSTANCE: {
-            ObjInstance* instance = (ObjInstance*)object;
-            freeTable(&instance->fields);
-            FREE(mm, ObjInstance, object);
+        case OBJ_BOUND_METHOD:
+        case OBJ_CLOSURE:
+        case OBJ_UPVALUE:
+        case OBJ_NATIVE:
+        case OBJ_STRING:
+        case OBJ_ROPE:
+        case OBJ_FLOAT_ARRAY:
             break;
-        }
     }
 }
 
+static void freeObject(MemoryManager* mm, Obj* object) {
+#ifdef DEBUG_LOG_GC
+    printf("%p free type %d\n", (void*)object, object->type);
+#endif
+    freeContents(mm, object);
+    reallocate(mm, object, objectSize(object), 0);
+}
+
 static void markArray(MemoryManager* mm, ValueArray* array) {
     for (int i = 0; i < array->count; i++) {
         markValue(mm, array->values[i]);
     }
 }
 
+static void markInlineCaches(MemoryManager* mm, Chunk* chunk) {
+    for (int i = 0; i < chunk->cacheCount; i++) {
+        InlineCache* cache = &chunk->caches[i];
+        for (int j = 0; j < cache->count && j < INLINE_CACHE_SIZE; j++) {
+            markObject(mm, cache->entries[j].key);
+            markObject(mm, cache->entries[j].target);
+        }
+    }
+}
+
 static void blackenObject(MemoryManager* mm, Obj* object) {
 #ifdef DEBUG_LOG_GC
     printf("%p blacken ", (void *) object);
@@ -83,10 +119,13 @@ static void blackenObject(MemoryManager* mm, Obj* object) {
             ObjClass* klass = (ObjClass*)object;
             markObject(mm, (Obj*)klass->name);
             markTable(&klass->methods);
+            markObject(mm, (Obj*)klass->rootShape);
+            markObject(mm, (Obj*)klass->spare);
             break;
         }
         case OBJ_NATIVE:
         case OBJ_STRING:
+        case OBJ_FLOAT_ARRAY:
             break;
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*)object;
@@ -105,14 +144,42 @@ static void blackenObject(MemoryManager* mm, Obj* object) {
             ObjFunction *function = (ObjFunction *) object;
             markObject(mm, (Obj*)function->name);
             markArray(mm, &function->chunk.constants);
+            markInlineCaches(mm, &function->chunk);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
             markObject(mm, (Obj*)instance->klass);
-            markTable(&instance->fields);
+            markTable(&instance->dictionary);
+            if (instance->shape != NULL) {
+                markObject(mm, (Obj*)instance->shape);
+                for (int i = 0; i < instance->shape->slotCount; i++) {
+                    markValue(mm, instance->fields[i]);
+                }
+            }
             break;
         }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            markObject(mm, (Obj*)shape->parent);
+            markObject(mm, (Obj*)shape->name);
+            markTable(&shape->slots);
+            markTable(&shape->transitions);
+            break;
+        }
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*)object;
+            markObject(mm, rope->left);
+            markObject(mm, rope->right);
+            markObject(mm, (Obj*)rope->flat);
+            break;
+        }
+        case OBJ_LIST:
+            markArray(mm, &((ObjList*)object)->items);
+            break;
+        case OBJ_MAP:
+            markValueTable(&((ObjMap*)object)->table);
+            break;
     }
 }
 
@@ -145,9 +212,242 @@ static void sweep(MemoryManager* mm) {
     }
 }
 
+#ifdef GENERATIONAL_GC
+
+#define YOUNG_ALIGNMENT 8
+
+static size_t youngSize(Obj* object) {
+    return (objectSize(object) + YOUNG_ALIGNMENT - 1) & ~(size_t)(YOUNG_ALIGNMENT - 1);
+}
+
+void enableNursery(MemoryManager* mm) {
+    if (mm->nursery != NULL) return;
+    mm->nursery = (uint8_t*)malloc(NURSERY_SIZE);
+    if (mm->nursery == NULL) exit(1);
+    mm->nurseryTop = mm->nursery;
+}
+
+void* allocateYoung(MemoryManager* mm, size_t size) {
+    if (mm->nursery == NULL || size > MAX_YOUNG_SIZE) return NULL;
+#ifdef DEBUG_STRESS_GC
+    if (!mm->collecting) collectGarbage(mm);
+#endif
+    size = (size + YOUNG_ALIGNMENT - 1) & ~(size_t)(YOUNG_ALIGNMENT - 1);
+    if (mm->nurseryTop + size > mm->nursery + NURSERY_SIZE) {
+        mm->nurseryFull = true;
+        return NULL;
+    }
+    void* result = mm->nurseryTop;
+    mm->nurseryTop += size;
+    return result;
+}
+
+void rememberObject(MemoryManager* mm, Obj* object) {
+    if (mm->rememberedCapacity < mm->rememberedCount + 1) {
+        mm->rememberedCapacity = GROW_CAPACITY(mm->rememberedCapacity);
+        mm->remembered = (Obj**)realloc(mm->remembered, sizeof(Obj*) * mm->rememberedCapacity);
+        if (mm->remembered == NULL) exit(1);
+    }
+    mm->remembered[mm->rememberedCount++] = object;
+    object->remembered = true;
+}
+
+static void pushGray(MemoryManager* mm, Obj* object) {
+    if (mm->grayCapacity < mm->grayCount + 1) {
+        mm->grayCapacity = GROW_CAPACITY(mm->grayCapacity);
+        mm->grayStack = (Obj**)realloc(mm->grayStack, sizeof(Obj*) * mm->grayCapacity);
+        if (mm->grayStack == NULL) exit(1);
+    }
+    mm->grayStack[mm->grayCount++] = object;
+}
+
+// A copied object is marked, with `next` pointing at the copy. Copies go on the gray stack, for
+// forwardReferences() to copy what they refer to in turn.
+Obj* forwardObject(MemoryManager* mm, Obj* object) {
+    if (object == NULL || !isYoung(mm, object)) return object;
+    if (object->isMarked) return object->next;
+
+    size_t size = objectSize(object);
+    Obj* copy = (Obj*)reallocate(mm, NULL, 0, size);
+    memcpy(copy, object, size);
+    copy->remembered = false;
+    copy->next = mm->objects;
+    mm->objects = copy;
+
+    // Pointers into the object itself move with it.
+    if (object->type == OBJ_INSTANCE) {
+        ObjInstance* instance = (ObjInstance*)object;
+        if (instance->fields == instance->inlineFields) {
+            ((ObjInstance*)copy)->fields = ((ObjInstance*)copy)->inlineFields;
+        }
+    } else if (object->type == OBJ_UPVALUE) {
+        ObjUpvalue* upvalue = (ObjUpvalue*)object;
+        if (upvalue->location == &upvalue->closed) {
+            ((ObjUpvalue*)copy)->location = &((ObjUpvalue*)copy)->closed;
+        }
+    }
+
+    object->isMarked = true;
+    object->next = copy;
+    pushGray(mm, copy);
+    return copy;
+}
+
+void forwardValue(MemoryManager* mm, Value* value) {
+    if (IS_OBJ(*value)) *value = OBJ_VAL(forwardObject(mm, AS_OBJ(*value)));
+}
+
+static void forwardArray(MemoryManager* mm, ValueArray* array) {
+    for (int i = 0; i < array->count; i++) {
+        forwardValue(mm, &array->values[i]);
+    }
+}
+
+#define FORWARD(mm, field) ((field) = (void*)forwardObject(mm, (Obj*)(field)))
+
+// What blackenObject() marks, this copies and updates.
+static void forwardReferences(MemoryManager* mm, Obj* object) {
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            forwardValue(mm, &bound->receiver);
+            FORWARD(mm, bound->method);
+            break;
+        }
+        case OBJ_CLASS: {
+            ObjClass* klass = (ObjClass*)object;
+            forwardTable(&klass->methods);
+            FORWARD(mm, klass->spare);
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*)object;
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                FORWARD(mm, closure->upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_UPVALUE:
+            forwardValue(mm, &((ObjUpvalue*)object)->closed);
+            break;
+        case OBJ_FUNCTION: {
+            // Only remembered for the targets in its inline caches.
+            Chunk* chunk = &((ObjFunction*)object)->chunk;
+            for (int i = 0; i < chunk->cacheCount; i++) {
+                InlineCache* cache = &chunk->caches[i];
+                for (int j = 0; j < cache->count && j < INLINE_CACHE_SIZE; j++) {
+                    FORWARD(mm, cache->entries[j].target);
+                }
+            }
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            forwardTable(&instance->dictionary);
+            if (instance->shape != NULL) {
+                for (int i = 0; i < instance->shape->slotCount; i++) {
+                    forwardValue(mm, &instance->fields[i]);
+                }
+            }
+            break;
+        }
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*)object;
+            FORWARD(mm, rope->left);
+            FORWARD(mm, rope->right);
+            FORWARD(mm, rope->flat);
+            break;
+        }
+        case OBJ_LIST:
+            forwardArray(mm, &((ObjList*)object)->items);
+            break;
+        case OBJ_MAP:
+            forwardValueTable(&((ObjMap*)object)->table);
+            break;
+        case OBJ_NATIVE:
+        case OBJ_SHAPE:
+        case OBJ_STRING:
+        case OBJ_FLOAT_ARRAY:
+            // Shapes are always old, and only ever refer to other shapes and interned strings.
+            break;
+    }
+}
+
+#undef FORWARD
+
+// A copying collection of the nursery alone. Old objects are never traced: the ones that may
+// refer to young objects are in the remembered set, and every other pointer into the nursery is
+// a root. Young objects left behind die, and what they own is freed.
+void collectNursery(MemoryManager* mm, MemoryComponentFn forwardRoots, void* data) {
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+    size_t before = mm->bytesAllocated;
+#endif
+    mm->collecting = true;
+    forwardRoots(data);
+    for (int i = 0; i < mm->rememberedCount; i++) {
+        Obj* object = mm->remembered[i];
+        object->remembered = false;
+        forwardReferences(mm, object);
+    }
+    mm->rememberedCount = 0;
+    // Copies are laid out in the order they are made. Turning around each object's children on the
+    // stack scans the first one first, so a tree is copied close to the order it gets walked in.
+    while (mm->grayCount > 0) {
+        int start = --mm->grayCount;
+        forwardReferences(mm, mm->grayStack[start]);
+        for (int i = start, j = mm->grayCount - 1; i < j; i++, j--) {
+            Obj* object = mm->grayStack[i];
+            mm->grayStack[i] = mm->grayStack[j];
+            mm->grayStack[j] = object;
+        }
+    }
+
+    for (uint8_t* next = mm->nursery; next < mm->nurseryTop;) {
+        Obj* object = (Obj*)next;
+        next += youngSize(object);
+        if (!object->isMarked) freeContents(mm, object);
+    }
+    mm->nurseryTop = mm->nursery;
+    mm->nurseryFull = false;
+    mm->collecting = false;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   promoted %zu bytes\n", mm->bytesAllocated - before);
+#endif
+    if (mm->bytesAllocated > mm->nextGC) collectGarbage(mm);
+}
+
+// A full collection leaves young objects where they are. Those it marked lose the mark again, and
+// the rest are left for the next minor collection to find unreached.
+static void clearYoungMarks(MemoryManager* mm) {
+    for (uint8_t* next = mm->nursery; next < mm->nurseryTop; next += youngSize((Obj*)next)) {
+        ((Obj*)next)->isMarked = false;
+    }
+}
+
+static void forgetUnmarked(MemoryManager* mm) {
+    int count = 0;
+    for (int i = 0; i < mm->rememberedCount; i++) {
+        if (mm->remembered[i]->isMarked) mm->remembered[count++] = mm->remembered[i];
+    }
+    mm->rememberedCount = count;
+}
+
+static void freeNursery(MemoryManager* mm) {
+    for (uint8_t* next = mm->nursery; next < mm->nurseryTop; next += youngSize((Obj*)next)) {
+        freeContents(mm, (Obj*)next);
+    }
+    free(mm->nursery);
+    free(mm->remembered);
+}
+
+#endif
+
 void* reallocate(MemoryManager* mm, void* pointer, size_t oldSize, size_t newSize) {
     mm->bytesAllocated += newSize - oldSize;
-    if (newSize > oldSize) {
+    if (newSize > oldSize && !mm->collecting) {
 #ifdef DEBUG_STRESS_GC
         collectGarbage(mm);
 #endif
@@ -174,6 +474,9 @@ void freeMemoryManager(MemoryManager* mm) {
         object = next;
     }
     free(mm->grayStack);
+#ifdef GENERATIONAL_GC
+    freeNursery(mm);
+#endif
 
     initMemoryManager(mm);
 }
@@ -192,6 +495,16 @@ void initMemoryManager(MemoryManager* memoryManager) {
 
     memoryManager->bytesAllocated = 0;
     memoryManager->nextGC = 1024 * 1024;
+    memoryManager->collecting = false;
+
+#ifdef GENERATIONAL_GC
+    memoryManager->nursery = NULL;
+    memoryManager->nurseryTop = NULL;
+    memoryManager->nurseryFull = false;
+    memoryManager->remembered = NULL;
+    memoryManager->rememberedCount = 0;
+    memoryManager->rememberedCapacity = 0;
+#endif
 }
 
 void collectGarbage(MemoryManager* mm) {
@@ -199,6 +512,7 @@ void collectGarbage(MemoryManager* mm) {
     printf("-- gc begin\n");
     size_t before = mm->bytesAllocated;
 #endif
+    mm->collecting = true;
     // Mark all roots.
     for (
             MemoryComponent* currentComponent = mm->memoryComponents;
@@ -221,9 +535,16 @@ void collectGarbage(MemoryManager* mm) {
     }
 
     // Clear unmarked objects.
+#ifdef GENERATIONAL_GC
+    forgetUnmarked(mm);
+#endif
     sweep(mm);
+#ifdef GENERATIONAL_GC
+    clearYoungMarks(mm);
+#endif
 
     mm->nextGC = mm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+    mm->collecting = false;
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");;
@@ -31,6 +31,14 @@ typedef struct MemoryComponent {
 
 typedef struct Obj Obj;
 
+#ifdef GENERATIONAL_GC
+// Objects made while the VM runs are bump allocated in the nursery, and most die there. A minor
+// collection copies the ones still reachable to the old generation and empties it. Objects bigger
+// than MAX_YOUNG_SIZE, and the kinds that live as long as the program, start out old.
+#define NURSERY_SIZE (512 * 1024)
+#define MAX_YOUNG_SIZE 1024
+#endif
+
 typedef struct MemoryManager {
     MemoryComponent* memoryComponents;
     Obj* objects;
@@ -44,6 +52,19 @@ typedef struct MemoryManager {
 
     size_t bytesAllocated;
     size_t nextGC;
+    bool collecting; // Weak reference handlers may allocate, which must not start another collection.
+
+#ifdef GENERATIONAL_GC
+    uint8_t* nursery; // NULL until enableNursery().
+    uint8_t* nurseryTop;
+    // Set once an object did not fit. Objects then go to the old generation until the next minor
+    // collection, which only runs at a safepoint; see collectNursery().
+    bool nurseryFull;
+    // Old objects that may refer to young ones. A minor collection treats them as roots.
+    Obj** remembered;
+    int rememberedCount;
+    int rememberedCapacity;
+#endif
 } MemoryManager;
 
 void initMemoryManager(MemoryManager* mm);
@@ -55,5 +76,37 @@ void popStack(MemoryManager* mm);
 void collectGarbage(MemoryManager* mm);
 void* reallocate(MemoryManager* mm, void* pointer, size_t oldSize, size_t newSize);
 
+#ifdef GENERATIONAL_GC
+void enableNursery(MemoryManager* mm);
+// Room for a new object, or NULL where it has to go to the old generation instead.
+void* allocateYoung(MemoryManager* mm, size_t size);
+// Copies the young objects reachable from the roots `forwardRoots` passes to forwardValue() and
+// forwardObject(), or from the remembered set, to the old generation, and empties the nursery.
+// Nothing else may hold a pointer to a young object, so this is only called where the VM keeps
+// none in C locals.
+void collectNursery(MemoryManager* mm, MemoryComponentFn forwardRoots, void* data);
+void rememberObject(MemoryManager* mm, Obj* object);
+
+static inline bool isYoung(MemoryManager* mm, void* object) {
+    return (uintptr_t)object - (uintptr_t)mm->nursery < NURSERY_SIZE;
+}
+
+static inline bool nurseryInUse(MemoryManager* mm) {
+    return mm->nurseryTop != mm->nursery;
+}
+
+// Goes after every store of a value into an object's fields, items or upvalue. An old object that
+// ends up referring to a young one has to be in the remembered set. Young objects and those already
+// in the set have `remembered` set, so most stores only test that.
+#define WRITE_BARRIER(mm, object, value) \
+    do { \
+        if (!((Obj*)(object))->remembered && IS_OBJ(value) && isYoung(mm, AS_OBJ(value))) { \
+            rememberObject(mm, (Obj*)(object)); \
+        } \
+    } while (false)
+#else
+#define WRITE_BARRIER(mm, object, value) ((void)0)
+#endif
+
 
 #endif //CLOX_MEMORY_H
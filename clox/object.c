@@ -7,14 +7,25 @@
 #define ALLOCATE_OBJ(mm, type, objectType) \
     (type*)allocateObject(mm, sizeof(type), objectType)
 
-static Obj* allocateObject(MemoryManager* mm, size_t size, ObjType type) {
+// For objects that live about as long as the program: functions, natives, classes, shapes and
+// interned strings. Inline caches and the intern table refer to them, so they never move.
+#define ALLOCATE_TENURED(mm, type, objectType) \
+    (type*)allocateTenured(mm, sizeof(type), objectType)
+
+static Obj* allocateTenured(MemoryManager* mm, size_t size, ObjType type) {
     Obj* object = (Obj*)reallocate(mm, NULL, 0, size);
     object->type = type;
     object->isMarked = false;
+    object->remembered = false;
 
     object->next = mm->objects;
     mm->objects = object;
 
+#ifdef GENERATIONAL_GC
+    // Whatever the constructor stores in it may be young, and constructors have no write barriers.
+    if (nurseryInUse(mm)) rememberObject(mm, object);
+#endif
+
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)object, size, type);
 #endif
@@ -22,6 +33,20 @@ static Obj* allocateObject(MemoryManager* mm, size_t size, ObjType type) {
     return object;
 }
 
+static Obj* allocateObject(MemoryManager* mm, size_t size, ObjType type) {
+#ifdef GENERATIONAL_GC
+    Obj* object = (Obj*)allocateYoung(mm, size);
+    if (object != NULL) {
+        object->type = type;
+        object->isMarked = false;
+        object->remembered = true;
+        object->next = NULL;
+        return object;
+    }
+#endif
+    return allocateTenured(mm, size, type);
+}
+
 static void printFunction(FILE* out, ObjFunction* function) {
     if (function->name == NULL ) {
         fprintf(out, "<script>");
@@ -30,6 +55,55 @@ static void printFunction(FILE* out, ObjFunction* function) {
     fprintf(out, "<fn %s>", function->name->chars);
 }
 
+// A list or map inside itself prints as "[...]", as do ones nested deeper than this.
+#define MAX_PRINT_DEPTH 64
+
+// The lists and maps being printed, outermost first.
+static Obj* printing[MAX_PRINT_DEPTH];
+static int printDepth = 0;
+
+static bool startPrinting(Obj* object) {
+    bool elided = printDepth == MAX_PRINT_DEPTH;
+    for (int i = 0; i < printDepth && !elided; i++) elided = printing[i] == object;
+    if (!elided) printing[printDepth++] = object;
+    return !elided;
+}
+
+static void printList(FILE* out, ObjList* list) {
+    if (!startPrinting((Obj*)list)) {
+        fprintf(out, "[...]");
+        return;
+    }
+    fprintf(out, "[");
+    for (int i = 0; i < list->items.count; i++) {
+        if (i > 0) fprintf(out, ", ");
+        printValue(out, list->items.values[i]);
+    }
+    fprintf(out, "]");
+    printDepth--;
+}
+
+static void printMap(FILE* out, ObjMap* map) {
+    if (!startPrinting((Obj*)map)) {
+        fprintf(out, "[...]");
+        return;
+    }
+    // Like the literal, with the empty map as "[:]".
+    fprintf(out, "[");
+    bool first = true;
+    for (int i = 0; i < map->table.used; i++) {
+        ValueEntry* entry = &map->table.entries[i];
+        if (IS_NIL(entry->key)) continue;
+        if (!first) fprintf(out, ", ");
+        printValue(out, entry->key);
+        fprintf(out, ": ");
+        printValue(out, entry->value);
+        first = false;
+    }
+    fprintf(out, first ? ":]" : "]");
+    printDepth--;
+}
+
 void printObject(FILE* out, Value value) {
     switch(OBJ_TYPE(value)) {
         case OBJ_BOUND_METHOD: {
@@ -59,6 +133,36 @@ void printObject(FILE* out, Value value) {
         case OBJ_INSTANCE:
             fprintf(out, "%s instance", AS_INSTANCE(value)->klass->name->chars);
             break;
+        case OBJ_SHAPE:
+            fprintf(out, "shape");
+            break;
+        case OBJ_LIST:
+            printList(out, AS_LIST(value));
+            break;
+        case OBJ_MAP:
+            printMap(out, AS_MAP(value));
+            break;
+        case OBJ_FLOAT_ARRAY: {
+            ObjFloatArray* array = AS_FLOAT_ARRAY(value);
+            fprintf(out, "[");
+            for (int i = 0; i < array->count; i++) {
+                fprintf(out, i > 0 ? ", %g" : "%g", array->values[i]);
+            }
+            fprintf(out, "]");
+            break;
+        }
+        case OBJ_ROPE: {
+            // The VM flattens a rope before printing it, but not the ones inside a list or map.
+            // Either way the characters come out the same.
+            ObjRope* rope = AS_ROPE(value);
+            if (rope->flat != NULL) {
+                fprintf(out, "%s", rope->flat->chars);
+            } else {
+                printObject(out, OBJ_VAL(rope->left));
+                printObject(out, OBJ_VAL(rope->right));
+            }
+            break;
+        }
     }
 }
 
@@ -70,22 +174,23 @@ ObjBoundMethod* newBoundMethod(MemoryManager* mm, Value receiver, ObjClosure* me
 }
 
 ObjClass* newClass(MemoryManager* mm, ObjString* name) {
-    ObjClass* klass = ALLOCATE_OBJ(mm, ObjClass, OBJ_CLASS);
+    ObjClass* klass = ALLOCATE_TENURED(mm, ObjClass, OBJ_CLASS);
     klass->name = name;
     initTable(&klass->methods, mm);
+    klass->methodsVersion = 0;
+    klass->rootShape = NULL;
+    klass->instanceSlots = 0;
+    klass->spare = NULL;
     return klass;
 }
 
 ObjClosure* newClosure(MemoryManager* mm, ObjFunction* function) {
-    ObjUpvalue** upvalues = ALLOCATE(mm, ObjUpvalue*, function->upvalueCount);
-    for (int i = 0; i < function->upvalueCount; i++) {
-        upvalues[i] = NULL;
-    }
-
-    ObjClosure* closure  = ALLOCATE_OBJ(mm, ObjClosure, OBJ_CLOSURE);
+    ObjClosure* closure = (ObjClosure*)allocateObject(mm, CLOSURE_SIZE(function->upvalueCount), OBJ_CLOSURE);
     closure->function = function;
-    closure->upvalues = upvalues;
     closure->upvalueCount = function->upvalueCount;
+    for (int i = 0; i < function->upvalueCount; i++) {
+        closure->upvalues[i] = NULL;
+    }
     return closure;
 }
 
@@ -93,55 +198,263 @@ ObjUpvalue* newUpvalue(MemoryManager* mm, Value* slot) {
     ObjUpvalue* upvalue = ALLOCATE_OBJ(mm, ObjUpvalue, OBJ_UPVALUE);
     upvalue->closed = NIL_VAL;
     upvalue->location = slot;
-    upvalue->next = NULL;
     return upvalue;
 }
 
 ObjFunction* newFunction(MemoryManager* mm) {
-    ObjFunction* function = ALLOCATE_OBJ(mm, ObjFunction, OBJ_FUNCTION);
+    ObjFunction* function = ALLOCATE_TENURED(mm, ObjFunction, OBJ_FUNCTION);
     function->upvalueCount = 0;
     function->arity = 0;
+    function->stackSize = 1;
+    function->thisEscapes = true;
+    function->ownedSlots = NULL;
+    function->ownedSlotCount = 0;
     function->name = NULL;
+    function->hotness = 0;
+    function->jit = NULL;
+    function->compiled = NULL;
     initChunk(&function->chunk);
     return function;
 }
 
+static ObjShape* newShape(MemoryManager* mm, ObjShape* parent, ObjString* name) {
+    ObjShape* shape = ALLOCATE_TENURED(mm, ObjShape, OBJ_SHAPE);
+    shape->parent = parent;
+    shape->name = name;
+    shape->slotCount = parent == NULL ? 0 : parent->slotCount + 1;
+    initTable(&shape->slots, mm);
+    initTable(&shape->transitions, mm);
+    return shape;
+}
+
+static ObjShape* shapeTransition(MemoryManager* mm, ObjShape* shape, ObjString* name) {
+    Value existing;
+    if (tableGet(&shape->transitions, name, &existing)) {
+        return (ObjShape*)AS_OBJ(existing);
+    }
+
+    ObjShape* child = newShape(mm, shape, name);
+    Value childForStack = OBJ_VAL(child);
+    pushStack(mm, &childForStack);
+    tableAddAll(&shape->slots, &child->slots);
+    tableSet(&child->slots, name, NUMBER_VAL((double)shape->slotCount));
+    tableSet(&shape->transitions, name, childForStack);
+    popStack(mm);
+
+    return child;
+}
+
+int shapeSlot(ObjShape* shape, ObjString* name) {
+    Value slot;
+    if (!tableGet(&shape->slots, name, &slot)) return -1;
+    return (int)AS_NUMBER(slot);
+}
+
+// The class must be reachable while this runs, as the root shape is created on first use.
 ObjInstance* newInstance(MemoryManager* mm, ObjClass* klass) {
-    ObjInstance* instance = ALLOCATE_OBJ(mm, ObjInstance, OBJ_INSTANCE);
+    if (klass->spare != NULL) {
+        ObjInstance* instance = klass->spare;
+        klass->spare = NULL;
+        return instance;
+    }
+
+    if (klass->rootShape == NULL) {
+        klass->rootShape = newShape(mm, NULL, NULL);
+    }
+
+    int inlineCapacity = klass->instanceSlots;
+    ObjInstance* instance = (ObjInstance*)allocateObject(mm, sizeof(ObjInstance) + sizeof(Value) * inlineCapacity, OBJ_INSTANCE);
     instance->klass = klass;
-    initTable(&instance->fields, mm);
+    instance->shape = klass->rootShape;
+    instance->fields = instance->inlineFields;
+    instance->fieldCapacity = inlineCapacity;
+    instance->inlineCapacity = inlineCapacity;
+    initTable(&instance->dictionary, mm);
+    instance->local = false;
     return instance;
 }
 
-ObjNative* newNative(MemoryManager* mm, int arity, NativeFn function) {
-    ObjNative* native = ALLOCATE_OBJ(mm, ObjNative, OBJ_NATIVE);
+// For an instance nothing refers to any more. Its class keeps one for the next newInstance() to
+// hand out again. The instance keeps its field storage, inline or not, and is reset to the root
+// shape; the stale values past slotCount are never read. Dictionary instances are left to the
+// collector.
+void releaseInstance(MemoryManager* mm, ObjInstance* instance) {
+    ObjClass* klass = instance->klass;
+    if (klass->spare != NULL || instance->shape == NULL) return;
+
+    instance->shape = klass->rootShape;
+    instance->local = false;
+    klass->spare = instance;
+    WRITE_BARRIER(mm, klass, OBJ_VAL(instance));
+}
+
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value) {
+    if (instance->shape == NULL) {
+        return tableGet(&instance->dictionary, name, value);
+    }
+
+    int slot = shapeSlot(instance->shape, name);
+    if (slot == -1) return false;
+
+    *value = instance->fields[slot];
+    return true;
+}
+
+static void addField(MemoryManager* mm, ObjInstance* instance, ObjString* name, Value value) {
+    ObjShape* shape = shapeTransition(mm, instance->shape, name);
+    int slot = instance->shape->slotCount;
+
+    if (slot >= instance->fieldCapacity) {
+        int capacity = GROW_CAPACITY(instance->fieldCapacity);
+        Value* fields = ALLOCATE(mm, Value, capacity);
+        memcpy(fields, instance->fields, sizeof(Value) * slot);
+        if (instance->fields != instance->inlineFields) {
+            FREE_ARRAY(mm, Value, instance->fields, instance->fieldCapacity);
+        }
+        instance->fields = fields;
+        instance->fieldCapacity = capacity;
+    }
+
+    instance->fields[slot] = value;
+    instance->shape = shape;
+
+    // Size the inline storage of later instances after the fields this one ended up with.
+    ObjClass* klass = instance->klass;
+    if (shape->slotCount > klass->instanceSlots && shape->slotCount <= MAX_INLINE_SLOTS) {
+        klass->instanceSlots = shape->slotCount;
+    }
+}
+
+static void convertToDictionary(MemoryManager* mm, ObjInstance* instance) {
+    ObjShape* shape = instance->shape;
+    for (ObjShape* field = shape; field->parent != NULL; field = field->parent) {
+        tableSet(&instance->dictionary, field->name, instance->fields[field->parent->slotCount]);
+    }
+
+    if (instance->fields != instance->inlineFields) {
+        FREE_ARRAY(mm, Value, instance->fields, instance->fieldCapacity);
+    }
+    instance->fields = instance->inlineFields;
+    instance->fieldCapacity = instance->inlineCapacity;
+    instance->shape = NULL;
+}
+
+// The instance and the value must be reachable, as a new field may allocate.
+void instanceSetField(MemoryManager* mm, ObjInstance* instance, ObjString* name, Value value) {
+    if (instance->shape != NULL) {
+        int slot = shapeSlot(instance->shape, name);
+        if (slot != -1) {
+            instance->fields[slot] = value;
+        } else if (instance->shape->slotCount < MAX_SHAPE_SLOTS) {
+            addField(mm, instance, name, value);
+        } else {
+            convertToDictionary(mm, instance);
+            tableSet(&instance->dictionary, name, value);
+        }
+    } else {
+        tableSet(&instance->dictionary, name, value);
+    }
+    WRITE_BARRIER(mm, instance, value);
+}
+
+ObjNative* newNative(MemoryManager* mm, int arity, int maxArity, int flags, NativeFn function) {
+    ObjNative* native = ALLOCATE_TENURED(mm, ObjNative, OBJ_NATIVE);
     native->arity = arity;
+    native->maxArity = maxArity;
+    native->flags = flags;
     native->function = function;
     return native;
 }
 
-static ObjString* allocateString(MemoryManager* mm, Table* strings, char* chars, int length, uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(mm, ObjString, OBJ_STRING);
-    string->length = length;
-    string->chars = chars;
-    string->hash = hash;
+ObjList* newList(MemoryManager* mm, Value* items, int count) {
+    // The storage comes first, as nothing would keep a new list alive while it is allocated.
+    Value* values = count > 0 ? ALLOCATE(mm, Value, count) : NULL;
+    ObjList* list = ALLOCATE_OBJ(mm, ObjList, OBJ_LIST);
+    initValueArray(&list->items);
+    list->items.values = values;
+    list->items.capacity = count;
+    list->items.count = count;
+    if (count > 0) memcpy(values, items, sizeof(Value) * count);
+    return list;
+}
 
+ObjFloatArray* newFloatArray(MemoryManager* mm, int count) {
+    ObjFloatArray* array = (ObjFloatArray*)allocateObject(mm, FLOAT_ARRAY_SIZE(count), OBJ_FLOAT_ARRAY);
+    array->count = count;
+    memset(array->values, 0, sizeof(double) * count);
+    return array;
+}
+
+ObjMap* newMap(MemoryManager* mm) {
+    ObjMap* map = ALLOCATE_OBJ(mm, ObjMap, OBJ_MAP);
+    initValueTable(&map->table, mm);
+    return map;
+}
+
+static uint64_t hashWord(uint64_t hash, uint64_t word) {
+    hash ^= word * 0x87c37b91114253d5u;
+    hash = (hash << 31) | (hash >> 33);
+    return hash * 0x4cf5ad432745937fu;
+}
+
+// Takes eight bytes at a time, and finishes with MurmurHash3's 64-bit avalanche so that every byte
+// reaches the low bits the tables mask with.
+static uint32_t hashString(const char* key, int length) {
+    uint64_t hash = 0x9e3779b97f4a7c15u ^ (uint64_t)length;
+    int i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, key + i, sizeof(word));
+        hash = hashWord(hash, word);
+    }
+    if (i < length) {
+        uint64_t word = 0;
+        for (int j = length - 1; j >= i; j--) word = (word << 8) | (uint8_t)key[j];
+        hash = hashWord(hash, word);
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdu;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53u;
+    hash ^= hash >> 33;
+    return (uint32_t)hash;
+}
+
+static void addString(MemoryManager* mm, Table* strings, ObjString* string) {
     Value stringForStack = OBJ_VAL(string);
     pushStack(mm, &stringForStack);
     tableSet(strings, string, NIL_VAL);
     popStack(mm);
+}
 
+static ObjString* initString(Obj* object, int length) {
+    ObjString* string = (ObjString*)object;
+    string->length = length;
+    string->hashed = false;
+    string->interned = false;
+    string->chars[length] = '\0';
     return string;
 }
 
-static uint32_t hashString(const char* key, int length) {
-    uint32_t hash = 2166136261u;
+ObjString* allocateString(MemoryManager* mm, int length) {
+    return initString(allocateObject(mm, STRING_SIZE(length), OBJ_STRING), length);
+}
 
-    for (int i = 0; i < length; i++) {
-        hash ^= (uint32_t) key[i];
-        hash *= 1677619u;
+// Strings made at run time are often only printed, so their hash waits until a comparison asks.
+uint32_t stringHash(ObjString* string) {
+    if (!string->hashed) {
+        string->hash = hashString(string->chars, string->length);
+        string->hashed = true;
     }
-    return hash;
+    return string->hash;
+}
+
+// Two interned strings are equal only if they are the same string.
+bool stringsEqual(ObjString* a, ObjString* b) {
+    if (a == b) return true;
+    if ((a->interned && b->interned) || a->length != b->length) return false;
+    return stringHash(a) == stringHash(b) && memcmp(a->chars, b->chars, a->length) == 0;
 }
 
 ObjString* copyString(MemoryManager* mm, Table* strings, const char* chars, int length) {
@@ -149,21 +462,70 @@ ObjString* copyString(MemoryManager* mm, Table* strings, const char* chars, int
     ObjString* interned = tableFindString(strings, chars, length, hash);
     if (interned != NULL) return interned;
 
-    char* heapChars = ALLOCATE(mm, char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
+    ObjString* string = initString(allocateTenured(mm, STRING_SIZE(length), OBJ_STRING), length);
+    memcpy(string->chars, chars, length);
+    string->hash = hash;
+    string->hashed = true;
+    string->interned = true;
 
-    return allocateString(mm, strings, heapChars, length, hash);
+    addString(mm, strings, string);
+    return string;
 }
 
+// A flattened rope stands in for its result, so that a new rope can drop the old pieces.
+static Obj* ropePiece(Value value) {
+    if (IS_ROPE(value) && AS_ROPE(value)->flat != NULL) return (Obj*)AS_ROPE(value)->flat;
+    return AS_OBJ(value);
+}
 
-ObjString* takeString(MemoryManager* mm, Table* strings, char* chars, int length) {
-    uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(strings, chars, length, hash);
-    if (interned != NULL) {
-        FREE_ARRAY(mm, char, chars, length + 1);
-        return interned;
+ObjRope* newRope(MemoryManager* mm, Value left, Value right) {
+    ObjRope* rope = ALLOCATE_OBJ(mm, ObjRope, OBJ_ROPE);
+    rope->left = ropePiece(left);
+    rope->right = ropePiece(right);
+    rope->length = 0;
+    rope->depth = 0;
+    Obj* pieces[] = {rope->left, rope->right};
+    for (int i = 0; i < 2; i++) {
+        if (pieces[i]->type == OBJ_ROPE) {
+            ObjRope* piece = (ObjRope*)pieces[i];
+            rope->length += piece->length;
+            if (piece->depth > rope->depth) rope->depth = piece->depth;
+        } else {
+            rope->length += ((ObjString*)pieces[i])->length;
+        }
+    }
+    rope->depth++;
+    rope->flat = NULL;
+    return rope;
+}
+
+// Copies the pieces left to right, keeping the right halves still to do on a stack of its own
+// rather than recursing, as a string built in a loop makes a rope as deep as the loop is long.
+ObjString* flattenRope(MemoryManager* mm, ObjRope* rope) {
+    if (rope->flat != NULL) return rope->flat;
+
+    int depth = rope->depth;
+    Obj** pending = ALLOCATE(mm, Obj*, depth);
+    ObjString* string = allocateString(mm, rope->length);
+    char* next = string->chars;
+    int count = 0;
+    pending[count++] = (Obj*)rope;
+    while (count > 0) {
+        Obj* piece = pending[--count];
+        while (piece->type == OBJ_ROPE && ((ObjRope*)piece)->flat == NULL) {
+            pending[count++] = ((ObjRope*)piece)->right;
+            piece = ((ObjRope*)piece)->left;
+        }
+        ObjString* chars = piece->type == OBJ_ROPE ? ((ObjRope*)piece)->flat : (ObjString*)piece;
+        memcpy(next, chars->chars, chars->length);
+        next += chars->length;
     }
 
-    return allocateString(mm, strings, chars, length, hash);
+    FREE_ARRAY(mm, Obj*, pending, depth);
+    rope->flat = string;
+    WRITE_BARRIER(mm, rope, OBJ_VAL(string));
+    rope->left = NULL;
+    rope->right = NULL;
+    rope->depth = 0;
+    return rope->flat;
 }
@@ -14,6 +14,10 @@
 #define IS_NATIVE(value)       isObjType(value, OBJ_NATIVE)
 #define IS_STRING(value)       isObjType(value, OBJ_STRING)
 #define IS_INSTANCE(value)     isObjType(value, OBJ_INSTANCE)
+#define IS_ROPE(value)         isObjType(value, OBJ_ROPE)
+#define IS_LIST(value)         isObjType(value, OBJ_LIST)
+#define IS_MAP(value)          isObjType(value, OBJ_MAP)
+#define IS_FLOAT_ARRAY(value)  isObjType(value, OBJ_FLOAT_ARRAY)
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
 #define AS_CLASS(value)        ((ObjClass*)AS_OBJ(value))
@@ -23,6 +27,10 @@
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
 #define AS_INSTANCE(value)     ((ObjInstance*)AS_OBJ(value))
+#define AS_ROPE(value)         ((ObjRope*)AS_OBJ(value))
+#define AS_LIST(value)         ((ObjList*)AS_OBJ(value))
+#define AS_MAP(value)          ((ObjMap*)AS_OBJ(value))
+#define AS_FLOAT_ARRAY(value)  ((ObjFloatArray*)AS_OBJ(value))
 
 typedef enum {
     OBJ_BOUND_METHOD,
@@ -32,62 +40,147 @@ typedef enum {
     OBJ_FUNCTION,
     OBJ_INSTANCE,
     OBJ_NATIVE,
-    OBJ_STRING
+    OBJ_SHAPE,
+    OBJ_STRING,
+    OBJ_ROPE,
+    OBJ_LIST,
+    OBJ_MAP,
+    OBJ_FLOAT_ARRAY
 } ObjType;
 
 struct Obj {
     ObjType type;
     bool isMarked;
-    struct Obj* next;
+    bool remembered; // Young, or in the remembered set: stores into it need no write barrier.
+    struct Obj* next; // Unused while young, until a minor collection points it at the copy.
 };
 
+struct VM;
+struct CallFrame;
+
+// The body of a function compiled ahead of time to C, see aot.h.
+typedef bool (*AotFn)(struct VM* vm, struct CallFrame* frame);
+
 typedef struct {
     Obj obj;
     int arity;
     Chunk chunk;
     ObjString* name;
     int upvalueCount;
+    int stackSize;       // Deepest the stack gets above frame->slots, callee and arguments included.
+    bool thisEscapes;    // A method that may let `this` outlive the call, see ownsInstance().
+    uint8_t* ownedSlots; // Of locals holding instances from OP_CALL_LOCAL, released at a return.
+    int ownedSlotCount;
+    int hotness;         // Calls plus loop back-edges, counted up to the JIT threshold.
+    struct JitCode* jit; // Native code, once the function got hot.
+    AotFn compiled;      // Set instead of running the chunk, see aot.h.
 } ObjFunction;
 
-typedef int (*NativeFn)(int argCount, Value* args, Value* result);
+// Natives write their result to `result` and return true, or return nativeError() (see vm.h) to
+// raise a runtime error. The result slot is on the VM stack, so a value stored there early is
+// safe from the collector. `args` is only valid until the native returns.
+typedef bool (*NativeFn)(struct VM* vm, int argCount, Value* args, Value* result);
+
+#define NATIVE_VARIADIC -1
+
+typedef enum {
+    // Never allocates and never touches the VM stack, so compiled code can call it without first
+    // writing its stack top back for the collector.
+    NATIVE_NO_ALLOC = 1 << 0
+} NativeFlags;
 
 typedef struct {
     Obj obj;
-    int arity;
+    int arity;    // Fewest arguments taken.
+    int maxArity; // Most arguments taken, or NATIVE_VARIADIC.
+    int flags;
     NativeFn function;
 } ObjNative;
 
+// Strings from the compiler are interned, so that property names and globals can be looked up by
+// pointer. Strings made while running are not, and compare by their characters; see
+// stringsEqual(). Only interned strings may be table keys.
 struct ObjString {
     Obj obj;
     int length;
-    char* chars;
-    uint32_t hash;
+    uint32_t hash; // Valid once `hashed`, which interned strings always are. See stringHash().
+    bool hashed;
+    bool interned;
+    char chars[];  // Null-terminated.
 };
 
+#define STRING_SIZE(length) (sizeof(ObjString) + (length) + 1)
+
+// Concatenations shorter than this are copied right away; longer ones make a rope.
+#define MIN_ROPE_LENGTH 64
+
+// The concatenation of two strings, left for later instead of copying their characters. Strings
+// built up piece by piece then take time linear in their final length. Anything that needs the
+// characters of a rope first calls flattenRope(), which caches the result and lets go of the
+// pieces.
+typedef struct {
+    Obj obj;
+    int length;
+    int depth;       // Most ropes on any path down to a string, bounding the walk in flattenRope().
+    Obj* left;       // An ObjString or an ObjRope, until flattened.
+    Obj* right;
+    ObjString* flat;
+} ObjRope;
+
 typedef struct ObjUpvalue {
     Obj obj;
     Value* location;
-    struct ObjUpvalue* next;
     Value closed;
 } ObjUpvalue;
 
+// Functions that capture nothing are never wrapped in a closure; see OP_CLOSURE in compiler.c.
 typedef struct {
     Obj obj;
     ObjFunction* function;
-    ObjUpvalue** upvalues;
     int upvalueCount;
+    ObjUpvalue* upvalues[];
 } ObjClosure;
 
+#define CLOSURE_SIZE(upvalueCount) (sizeof(ObjClosure) + sizeof(ObjUpvalue*) * (upvalueCount))
+
+// Instances past this many fields give up on shapes and keep their fields in a dictionary.
+#define MAX_SHAPE_SLOTS 64
+// Upper bound on the field storage allocated inline with a new instance.
+#define MAX_INLINE_SLOTS 16
+
+// A shape describes the field layout shared by every instance that had the same fields added in
+// the same order. Adding a field moves an instance along a transition to a child shape.
+typedef struct ObjShape {
+    Obj obj;
+    struct ObjShape* parent;
+    ObjString* name;
+    int slotCount;
+    Table slots;
+    Table transitions;
+} ObjShape;
+
 typedef struct {
     Obj obj;
     ObjString* name;
     Table methods;
+    int methodsVersion; // Bumped on every write to `methods`, invalidating cached lookups.
+    ObjShape* rootShape;
+    int instanceSlots;
+    struct ObjInstance* spare; // Handed back by releaseInstance(), handed out by newInstance().
 } ObjClass;
 
-typedef struct {
+typedef struct ObjInstance {
     Obj obj;
     ObjClass* klass;
-    Table fields;
+    ObjShape* shape;
+    Value* fields;
+    int fieldCapacity;
+    int inlineCapacity;
+    Table dictionary;
+    // Made by OP_CALL_LOCAL and held only by its local, until something lets it escape. See
+    // ownsInstance() in compiler.c for what the compiler guarantees and vm.c for what it cannot.
+    bool local;
+    Value inlineFields[];
 } ObjInstance;
 
 typedef struct {
@@ -96,6 +189,30 @@ typedef struct {
     ObjClosure* method;
 } ObjBoundMethod;
 
+// A growable array of values, made by a list literal and indexed by ints from zero.
+typedef struct {
+    Obj obj;
+    ValueArray items;
+} ObjList;
+
+// A hash map from any value but nil to values, made by a map literal. Keeps its keys in the order
+// they were added.
+typedef struct {
+    Obj obj;
+    ValueTable table;
+} ObjMap;
+
+// A fixed number of doubles, stored raw rather than as values. Reading one boxes it and writing
+// one unboxes it; the kernels in kernels.h work on them directly. Holds no references, so the
+// collector never looks inside.
+typedef struct {
+    Obj obj;
+    int count;
+    double values[];
+} ObjFloatArray;
+
+#define FLOAT_ARRAY_SIZE(count) (sizeof(ObjFloatArray) + sizeof(double) * (count))
+
 static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
@@ -106,10 +223,28 @@ ObjClosure* newClosure(MemoryManager* mm, ObjFunction* function);
 ObjUpvalue* newUpvalue(MemoryManager* mm, Value* slot);
 ObjFunction* newFunction(MemoryManager* mm);
 ObjInstance* newInstance(MemoryManager* mm, ObjClass* klass);
-ObjNative* newNative(MemoryManager* mm, int arity, NativeFn function);
-
+void releaseInstance(MemoryManager* mm, ObjInstance* instance);
+ObjNative* newNative(MemoryManager* mm, int arity, int maxArity, int flags, NativeFn function);
+// A list holding a copy of the `count` values at `items`, which must be reachable while this runs.
+ObjList* newList(MemoryManager* mm, Value* items, int count);
+ObjMap* newMap(MemoryManager* mm);
+// All zeros.
+ObjFloatArray* newFloatArray(MemoryManager* mm, int count);
+
+int shapeSlot(ObjShape* shape, ObjString* name);
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value);
+void instanceSetField(MemoryManager* mm, ObjInstance* instance, ObjString* name, Value value);
+
+// Returns an interned string.
 ObjString* copyString(MemoryManager* mm, Table* strings, const char* chars, int length);
-ObjString* takeString(MemoryManager* mm, Table* strings, char* chars, int length);
+// For building a string in place: makes room for `length` characters, which the caller fills in.
+// The result is not interned.
+ObjString* allocateString(MemoryManager* mm, int length);
+uint32_t stringHash(ObjString* string);
+bool stringsEqual(ObjString* a, ObjString* b);
+// Both pieces are strings or ropes, and must be reachable while these run.
+ObjRope* newRope(MemoryManager* mm, Value left, Value right);
+ObjString* flattenRope(MemoryManager* mm, ObjRope* rope);
 
 void printObject(FILE* out, Value value);
 
@@ -0,0 +1,127 @@
+#include "optimizer.h"
+#include "memory.h"
+
+typedef struct {
+    OpCode first;
+    OpCode second;
+    OpCode fused;
+} Fusion;
+
+// Picked from dynamic opcode-pair counts over the benchmark corpus (each benchmark weighted
+// equally), keeping the pairs that do not straddle a call or a return. A fused instruction
+// carries the operands of `first` followed by the operands of `second`. None of the first halves
+// can raise a runtime error.
+static const Fusion fusions[] = {
+        { OP_POP,           OP_GET_GLOBAL,   OP_POP_GET_GLOBAL },     // 10.7%
+        { OP_GET_LOCAL,     OP_GET_PROPERTY, OP_GET_LOCAL_PROPERTY }, //  5.9%
+        { OP_GET_GLOBAL,    OP_INVOKE,       OP_GET_GLOBAL_INVOKE },  //  5.2%
+        { OP_JUMP_IF_FALSE, OP_POP,          OP_JUMP_IF_FALSE_POP },  //  3.2%
+        { OP_GET_LOCAL,     OP_RETURN,       OP_RETURN_LOCAL },       //  3.2%
+        { OP_CONSTANT,      OP_LESS,         OP_LESS_CONSTANT },      //  2.2%
+        { OP_NIL,           OP_RETURN,       OP_NIL_RETURN },         //  1.9%
+        { OP_CONSTANT,      OP_SUBTRACT,     OP_SUBTRACT_CONSTANT },  //  1.7%
+        { OP_CONSTANT,      OP_ADD,          OP_ADD_CONSTANT },       //  0.5%
+};
+
+#define FUSION_COUNT (sizeof(fusions) / sizeof(fusions[0]))
+
+static int findFusion(uint8_t first, uint8_t second) {
+    for (int i = 0; i < (int)FUSION_COUNT; i++) {
+        if (fusions[i].first == first && fusions[i].second == second) return i;
+    }
+    return -1;
+}
+
+// Rewrites adjacent instruction pairs into their superinstruction, then re-aims every jump at
+// the relocated code. A pair is never fused when the second instruction is a jump target, as
+// that would leave the jump landing in the middle of the fused instruction.
+void fuseSuperinstructions(MemoryManager* mm, Chunk* chunk) {
+    int count = chunk->count;
+    if (count == 0) return;
+
+    bool* isTarget = ALLOCATE(mm, bool, count + 1);
+    int* newOffsets = ALLOCATE(mm, int, count + 1);
+    int* fusedWith = ALLOCATE(mm, int, count + 1);
+    for (int i = 0; i <= count; i++) {
+        isTarget[i] = false;
+        newOffsets[i] = -1;
+        fusedWith[i] = -1;
+    }
+
+    for (int offset = 0; offset < count; offset += instructionLength(chunk, offset)) {
+        if (isJumpInstruction(chunk->code[offset])) {
+            isTarget[jumpTarget(chunk, offset)] = true;
+        }
+    }
+
+    // Decide which pairs to fuse and where each surviving instruction ends up.
+    int newCount = 0;
+    for (int offset = 0; offset < count;) {
+        int length = instructionLength(chunk, offset);
+        int next = offset + length;
+        newOffsets[offset] = newCount;
+        if (next < count && !isTarget[next]) {
+            fusedWith[offset] = findFusion(chunk->code[offset], chunk->code[next]);
+        }
+        if (fusedWith[offset] != -1) {
+            int nextLength = instructionLength(chunk, next);
+            newCount += length + nextLength - 1;
+            offset = next + nextLength;
+        } else {
+            newCount += length;
+            offset = next;
+        }
+    }
+    newOffsets[count] = newCount;
+
+    if (newCount == count) {
+        FREE_ARRAY(mm, bool, isTarget, count + 1);
+        FREE_ARRAY(mm, int, newOffsets, count + 1);
+        FREE_ARRAY(mm, int, fusedWith, count + 1);
+        return;
+    }
+
+    uint8_t* code = ALLOCATE(mm, uint8_t, newCount);
+    int* lines = ALLOCATE(mm, int, newCount);
+    for (int offset = 0; offset < count;) {
+        int length = instructionLength(chunk, offset);
+        int start = newOffsets[offset];
+        int end = start;
+        for (int i = 0; i < length; i++, end++) {
+            code[end] = chunk->code[offset + i];
+            lines[end] = chunk->lines[offset + i];
+        }
+
+        int oldEnd = offset + length;
+        if (fusedWith[offset] != -1) {
+            int nextLength = instructionLength(chunk, oldEnd);
+            code[start] = fusions[fusedWith[offset]].fused;
+            for (int i = 1; i < nextLength; i++, end++) {
+                code[end] = chunk->code[oldEnd + i];
+            }
+            // Only the second half can raise an error, so all of it reports that one's line.
+            for (int i = start; i < end; i++) lines[i] = chunk->lines[oldEnd];
+            oldEnd += nextLength;
+        }
+
+        if (isJumpInstruction(chunk->code[offset])) {
+            int target = newOffsets[jumpTarget(chunk, offset)];
+            int jump = chunk->code[offset] == OP_LOOP ? start + 3 - target : target - (start + 3);
+            code[start + 1] = (jump >> 8) & 0xff;
+            code[start + 2] = jump & 0xff;
+        }
+
+        offset = oldEnd;
+    }
+
+    FREE_ARRAY(mm, uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(mm, int, chunk->lines, chunk->capacity);
+    chunk->code = code;
+    chunk->lines = lines;
+    chunk->count = newCount;
+    chunk->capacity = newCount;
+
+    FREE_ARRAY(mm, bool, isTarget, count + 1);
+    FREE_ARRAY(mm, int, newOffsets, count + 1);
+    FREE_ARRAY(mm, int, fusedWith, count + 1);
+}
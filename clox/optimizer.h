@@ -0,0 +1,8 @@
+#ifndef CLOX_OPTIMIZER_H
+#define CLOX_OPTIMIZER_H
+
+#include "chunk.h"
+
+void fuseSuperinstructions(MemoryManager* mm, Chunk* chunk);
+
+#endif //CLOX_OPTIMIZER_H
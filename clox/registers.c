@@ -0,0 +1,362 @@
+#include "registers.h"
+#include "memory.h"
+
+// The register tier is produced from the stack bytecode rather than by a second compiler. The
+// operand stack is simulated at translation time: GET_LOCAL and CONSTANT merely note where their
+// value lives, and the arithmetic that consumes them becomes a three-address instruction reading
+// its operands straight out of the frame. Every other instruction is copied unchanged, so both
+// kinds of instruction run in the same dispatch loop over the same frame layout.
+//
+// Between instructions the first `materialized` stack slots hold their values and vm->stackTop
+// points just past them. The slots from there up to `depth` are pending: copies of a local or a
+// constant that have not been written to the frame yet.
+
+typedef enum {
+    PENDING_LOCAL,
+    PENDING_CONSTANT
+} PendingKind;
+
+typedef struct {
+    PendingKind kind;
+    uint8_t index;
+} Pending;
+
+typedef struct {
+    MemoryManager* mm;
+    Chunk out;
+    int line;
+    int depth;
+    int materialized;
+    Pending pending[UINT8_COUNT];
+    int lastResult; // Offset in `out` of the last three-address instruction emitted, or -1.
+} Translator;
+
+static void emitByte(Translator* translator, uint8_t byte) {
+    writeChunk(translator->mm, &translator->out, byte, translator->line);
+}
+
+static uint8_t pendingOperand(Pending pending) {
+    return pending.kind == PENDING_CONSTANT ? (uint8_t)(pending.index | RK_CONSTANT) : pending.index;
+}
+
+// The next slot to materialize is always the one at stackTop, so a plain push writes it.
+static void materializeOne(Translator* translator) {
+    Pending pending = translator->pending[translator->materialized++];
+    emitByte(translator, pending.kind == PENDING_CONSTANT ? OP_CONSTANT : OP_GET_LOCAL);
+    emitByte(translator, pending.index);
+}
+
+static void flush(Translator* translator) {
+    while (translator->materialized < translator->depth) {
+        materializeOne(translator);
+    }
+}
+
+static void pushPending(Translator* translator, PendingKind kind, uint8_t index) {
+    Pending* pending = &translator->pending[translator->depth++];
+    pending->kind = kind;
+    pending->index = index;
+}
+
+static void adjustDepth(Translator* translator, int effect) {
+    translator->depth += effect;
+    if (translator->depth < 0) translator->depth = 0; // Only in unreachable code.
+    translator->materialized = translator->depth;
+}
+
+static void copyBytes(Translator* translator, Chunk* chunk, int offset, int length) {
+    flush(translator);
+    for (int i = 0; i < length; i++) {
+        emitByte(translator, chunk->code[offset + i]);
+    }
+}
+
+static bool isTerminal(uint8_t instruction) {
+    return instruction == OP_JUMP ||
+           instruction == OP_LOOP ||
+           instruction == OP_RETURN ||
+           instruction == OP_RETURN_LOCAL ||
+           instruction == OP_NIL_RETURN;
+}
+
+static OpCode registerForm(uint8_t instruction) {
+    switch (instruction) {
+        case OP_EQUAL: return OP_REG_EQUAL;
+        case OP_GREATER: return OP_REG_GREATER;
+        case OP_LESS:
+        case OP_LESS_CONSTANT: return OP_REG_LESS;
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_ADD_CONSTANT: return OP_REG_ADD;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_CONSTANT: return OP_REG_SUBTRACT;
+        case OP_MULTIPLY: return OP_REG_MULTIPLY;
+        case OP_DIVIDE: return OP_REG_DIVIDE;
+        default: return OP_REG_MOVE; // Unreachable.
+    }
+}
+
+static OpCode stackForm(uint8_t instruction) {
+    switch (instruction) {
+        case OP_LESS_CONSTANT: return OP_LESS;
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_ADD_CONSTANT: return OP_ADD;
+        case OP_SUBTRACT_CONSTANT: return OP_SUBTRACT;
+        default: return (OpCode)instruction;
+    }
+}
+
+// Replaces the top two stack slots with the result of `instruction`, written to the slot the
+// stack machine would have left it in. Falls back on the stack instruction when an operand
+// cannot be encoded.
+static void binaryInstruction(Translator* translator, uint8_t instruction) {
+    int result = translator->depth - 2;
+    uint8_t operands[2];
+    bool encodable = result >= 0 && result + 1 < UINT8_MAX;
+    for (int i = 0; encodable && i < 2; i++) {
+        int slot = result + i;
+        if (slot >= translator->materialized) {
+            operands[i] = pendingOperand(translator->pending[slot]);
+        } else if (slot < RK_CONSTANT) {
+            operands[i] = (uint8_t)slot;
+        } else {
+            encodable = false;
+        }
+    }
+
+    if (!encodable) {
+        flush(translator);
+        emitByte(translator, stackForm(instruction));
+        adjustDepth(translator, -1);
+        return;
+    }
+
+    // Pending slots under the result would otherwise end up below stackTop without a value.
+    while (translator->materialized < result) {
+        materializeOne(translator);
+    }
+
+    translator->lastResult = translator->out.count;
+    emitByte(translator, registerForm(instruction));
+    emitByte(translator, (uint8_t)result);
+    emitByte(translator, operands[0]);
+    emitByte(translator, operands[1]);
+    emitByte(translator, (uint8_t)(result + 1));
+    translator->depth = result + 1;
+    translator->materialized = result + 1;
+}
+
+static bool referencesLocal(Translator* translator, int below, uint8_t slot) {
+    for (int i = translator->materialized; i < below; i++) {
+        Pending pending = translator->pending[i];
+        if (pending.kind == PENDING_LOCAL && pending.index == slot) return true;
+    }
+    return false;
+}
+
+static void setLocal(Translator* translator, Chunk* chunk, int offset, uint8_t slot) {
+    if (slot >= translator->materialized) flush(translator);
+
+    int top = translator->depth - 1;
+    int last = translator->lastResult;
+
+    // `a = b + c;` The arithmetic writes straight into the local, and the value left on the stack
+    // becomes a pending copy of it, which the statement's POP then discards without any code.
+    if (last != -1 && translator->out.count == last + 5 && slot < RK_CONSTANT &&
+        translator->materialized == translator->depth && translator->out.code[last + 1] == top) {
+        translator->out.code[last + 1] = slot;
+        translator->out.code[last + 4] = (uint8_t)top;
+        translator->materialized = top;
+        translator->pending[top].kind = PENDING_LOCAL;
+        translator->pending[top].index = slot;
+        translator->lastResult = -1;
+        return;
+    }
+
+    if (top >= translator->materialized && !referencesLocal(translator, top, slot)) {
+        Pending value = translator->pending[top];
+        if (value.kind == PENDING_LOCAL && value.index == slot) return;
+
+        emitByte(translator, OP_REG_MOVE);
+        emitByte(translator, slot);
+        emitByte(translator, pendingOperand(value));
+        emitByte(translator, (uint8_t)translator->materialized);
+        return;
+    }
+
+    copyBytes(translator, chunk, offset, 2);
+}
+
+static void translateInstruction(Translator* translator, Chunk* chunk, int offset, int length) {
+    uint8_t instruction = chunk->code[offset];
+    bool canPend = translator->depth < UINT8_MAX;
+
+    switch (instruction) {
+        case OP_GET_LOCAL: {
+            uint8_t slot = chunk->code[offset + 1];
+            if (slot >= translator->materialized) flush(translator);
+            if (canPend && slot < RK_CONSTANT) {
+                pushPending(translator, PENDING_LOCAL, slot);
+                return;
+            }
+            break;
+        }
+        case OP_CONSTANT: {
+            uint8_t constant = chunk->code[offset + 1];
+            if (canPend && constant < RK_CONSTANT) {
+                pushPending(translator, PENDING_CONSTANT, constant);
+                return;
+            }
+            break;
+        }
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            binaryInstruction(translator, instruction);
+            return;
+        case OP_LESS_CONSTANT:
+        case OP_ADD_CONSTANT:
+        case OP_SUBTRACT_CONSTANT: {
+            uint8_t constant = chunk->code[offset + 1];
+            if (canPend && constant < RK_CONSTANT) {
+                pushPending(translator, PENDING_CONSTANT, constant);
+                binaryInstruction(translator, instruction);
+                return;
+            }
+            break;
+        }
+        case OP_SET_LOCAL:
+            setLocal(translator, chunk, offset, chunk->code[offset + 1]);
+            return;
+        case OP_POP:
+            if (translator->depth > translator->materialized) {
+                translator->depth--;
+                return;
+            }
+            break;
+        case OP_POP_GET_GLOBAL:
+            if (translator->depth > translator->materialized) {
+                translator->depth--;
+                flush(translator);
+                emitByte(translator, OP_GET_GLOBAL);
+                emitByte(translator, chunk->code[offset + 1]);
+                adjustDepth(translator, 1);
+                return;
+            }
+            break;
+        default:
+            break;
+    }
+
+    copyBytes(translator, chunk, offset, length);
+    adjustDepth(translator, stackEffect(chunk, offset));
+}
+
+void translateToRegisters(MemoryManager* mm, ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    for (int i = 0; i < chunk->constants.count; i++) {
+        if (IS_FUNCTION(chunk->constants.values[i])) {
+            translateToRegisters(mm, AS_FUNCTION(chunk->constants.values[i]));
+        }
+    }
+
+    int count = chunk->count;
+    if (count == 0) return;
+
+    int* targetDepth = ALLOCATE(mm, int, count + 1);
+    int* newOffsets = ALLOCATE(mm, int, count + 1);
+    int* jumps = ALLOCATE(mm, int, count);
+    int* jumpSites = ALLOCATE(mm, int, count);
+    int jumpCount = 0;
+    for (int i = 0; i <= count; i++) {
+        targetDepth[i] = -1;
+        newOffsets[i] = -1;
+    }
+
+    bool* isTarget = ALLOCATE(mm, bool, count + 1);
+    for (int i = 0; i <= count; i++) isTarget[i] = false;
+    for (int offset = 0; offset < count; offset += instructionLength(chunk, offset)) {
+        if (isJumpInstruction(chunk->code[offset])) {
+            isTarget[jumpTarget(chunk, offset)] = true;
+        }
+    }
+
+    Translator translator;
+    translator.mm = mm;
+    initChunk(&translator.out);
+    translator.depth = function->arity + 1;
+    translator.materialized = translator.depth;
+    translator.lastResult = -1;
+
+    bool reachable = true;
+    for (int offset = 0; offset < count;) {
+        int length = instructionLength(chunk, offset);
+        uint8_t instruction = chunk->code[offset];
+        translator.line = chunk->lines[offset];
+
+        // Every path into a jump target has to agree on the frame, so nothing may be pending.
+        if (isTarget[offset]) {
+            if (reachable) {
+                flush(&translator);
+            } else if (targetDepth[offset] != -1) {
+                adjustDepth(&translator, targetDepth[offset] - translator.depth);
+            }
+            translator.lastResult = -1;
+            reachable = true;
+        }
+        newOffsets[offset] = translator.out.count;
+
+        if (isJumpInstruction(instruction)) {
+            flush(&translator);
+            int target = jumpTarget(chunk, offset);
+            if (targetDepth[target] == -1) targetDepth[target] = translator.depth;
+            jumps[jumpCount] = offset;
+            jumpSites[jumpCount++] = translator.out.count;
+        }
+
+        translateInstruction(&translator, chunk, offset, length);
+        if (isTerminal(instruction)) reachable = false;
+        offset += length;
+    }
+    newOffsets[count] = translator.out.count;
+
+    bool fits = true;
+    for (int i = 0; i < jumpCount; i++) {
+        int site = jumpSites[i];
+        int target = newOffsets[jumpTarget(chunk, jumps[i])];
+        int jump = translator.out.code[site] == OP_LOOP ? site + 3 - target : target - (site + 3);
+        if (target == -1 || jump < 0 || jump > UINT16_MAX) {
+            fits = false;
+            break;
+        }
+        translator.out.code[site + 1] = (jump >> 8) & 0xff;
+        translator.out.code[site + 2] = jump & 0xff;
+    }
+
+    // A function whose register form cannot be encoded keeps running its stack bytecode.
+    if (fits) {
+        FREE_ARRAY(mm, uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(mm, int, chunk->lines, chunk->capacity);
+        chunk->code = translator.out.code;
+        chunk->lines = translator.out.lines;
+        chunk->count = translator.out.count;
+        chunk->capacity = translator.out.capacity;
+    } else {
+        FREE_ARRAY(mm, uint8_t, translator.out.code, translator.out.capacity);
+        FREE_ARRAY(mm, int, translator.out.lines, translator.out.capacity);
+    }
+
+    FREE_ARRAY(mm, int, targetDepth, count + 1);
+    FREE_ARRAY(mm, int, newOffsets, count + 1);
+    FREE_ARRAY(mm, int, jumps, count);
+    FREE_ARRAY(mm, int, jumpSites, count);
+    FREE_ARRAY(mm, bool, isTarget, count + 1);
+}
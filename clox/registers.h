@@ -0,0 +1,8 @@
+#ifndef CLOX_REGISTERS_H
+#define CLOX_REGISTERS_H
+
+#include "object.h"
+
+void translateToRegisters(MemoryManager* mm, ObjFunction* function);
+
+#endif //CLOX_REGISTERS_H
@@ -4,101 +4,218 @@
 #include "object.h"
 #include "table.h"
 
-#define TABLE_MAX_LOAD 0.75
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Every slot has a control byte: CONTROL_EMPTY, CONTROL_DELETED, or for a full slot the low seven
+// bits of its key's hash. The rest of the hash picks the group of GROUP_WIDTH slots a probe starts
+// at, and a probe compares the control bytes of a whole group at once, so a lookup only reads the
+// entries whose bytes match and is over once it meets a group with an empty slot. Tables smaller
+// than a group pad their control bytes with empty ones.
+#define GROUP_WIDTH 16
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xfe
+
+// Full and deleted slots together, out of eight.
+#define TABLE_MAX_LOAD 7
+#define MIN_CAPACITY 8
+
+typedef uint32_t BitMask; // One bit per slot in a group.
+
+static inline uint8_t hashFragment(uint32_t hash) {
+    return (uint8_t)(hash & 0x7f);
+}
 
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-    //uint32_t index = key->hash % capacity;
-    uint32_t index = key->hash & (capacity - 1);
-    Entry* tombstone = NULL;
+static inline int groupCount(int capacity) {
+    return capacity < GROUP_WIDTH ? 1 : capacity / GROUP_WIDTH;
+}
 
-    for (;;) {
-        Entry* entry = &entries[index];
+static inline int controlBytes(int capacity) {
+    return capacity == 0 ? 0 : groupCount(capacity) * GROUP_WIDTH;
+}
 
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                if (tombstone == NULL) tombstone = entry;
-            }
-        } else if (entry->key == key) {
-            return entry;
-        }
+// The control bytes and the entries after them share one allocation, so that a small table's
+// bytes sit next to its first entries.
+static inline size_t tableBytes(int capacity) {
+    return (size_t)controlBytes(capacity) + sizeof(Entry) * (size_t)capacity;
+}
+
+static inline BitMask matchByte(const uint8_t* group, uint8_t byte) {
+#if defined(__SSE2__)
+    __m128i bytes = _mm_loadu_si128((const __m128i*)group);
+    return (BitMask)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)byte)));
+#else
+    BitMask mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++) {
+        if (group[i] == byte) mask |= (BitMask)1 << i;
+    }
+    return mask;
+#endif
+}
+
+// Empty and deleted slots, the bytes with their top bit set.
+static inline BitMask matchFree(const uint8_t* group) {
+#if defined(__SSE2__)
+    return (BitMask)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#else
+    BitMask mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++) {
+        if (group[i] & 0x80) mask |= (BitMask)1 << i;
+    }
+    return mask;
+#endif
+}
+
+static inline int lowestBit(BitMask mask) {
+    return __builtin_ctz(mask);
+}
+
+// Probes visit the groups in triangular steps, which reaches all of them as the count is a power
+// of two.
+typedef struct {
+    int group;
+    int step;
+    int mask;
+} Probe;
+
+static inline Probe startProbe(int capacity, uint32_t hash) {
+    Probe probe;
+    probe.mask = groupCount(capacity) - 1;
+    probe.group = (int)(hash >> 7) & probe.mask;
+    probe.step = 0;
+    return probe;
+}
 
-        index = (index + 1) & (capacity - 1);
+static inline void nextGroup(Probe* probe) {
+    probe->step++;
+    probe->group = (probe->group + probe->step) & probe->mask;
+}
+
+// The slot holding `key`, or -1.
+static inline int findEntry(Table* table, ObjString* key) {
+    uint8_t fragment = hashFragment(key->hash);
+    for (Probe probe = startProbe(table->capacity, key->hash);; nextGroup(&probe)) {
+        int first = probe.group * GROUP_WIDTH;
+        const uint8_t* control = &table->control[first];
+        for (BitMask match = matchByte(control, fragment); match != 0; match &= match - 1) {
+            int slot = first + lowestBit(match);
+            if (table->entries[slot].key == key) return slot;
+        }
+        if (matchByte(control, CONTROL_EMPTY) != 0) return -1;
+    }
+}
 
+// The first empty or deleted slot on the probe for `hash`, where a new key goes.
+static int findFreeSlot(Table* table, uint32_t hash) {
+    BitMask slots = table->capacity < GROUP_WIDTH ? ((BitMask)1 << table->capacity) - 1 : 0xffff;
+    for (Probe probe = startProbe(table->capacity, hash);; nextGroup(&probe)) {
+        int first = probe.group * GROUP_WIDTH;
+        BitMask available = matchFree(&table->control[first]) & slots;
+        if (available != 0) return first + lowestBit(available);
     }
 }
 
+static void fillSlot(Table* table, int slot, ObjString* key, Value value) {
+    if (table->control[slot] == CONTROL_DELETED) table->tombstones--;
+    table->count++;
+    table->control[slot] = hashFragment(key->hash);
+    table->entries[slot].key = key;
+    table->entries[slot].value = value;
+}
+
 bool tableGet(Table* table, ObjString* key, Value* value) {
     if (table->count == 0) return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if(entry->key == NULL) return false;
+    int slot = findEntry(table, key);
+    if (slot < 0) return false;
 
-    *value = entry->value;
+    *value = table->entries[slot].value;
     return true;
 }
 
 static void adjustCapacity(MemoryManager* mm, Table* table, int capacity) {
-    Entry* entries = ALLOCATE(mm, Entry, capacity);
+    Table resized;
+    resized.memoryManager = mm;
+    resized.count = 0;
+    resized.tombstones = 0;
+    resized.capacity = capacity;
+    resized.control = ALLOCATE(mm, uint8_t, tableBytes(capacity));
+    resized.entries = (Entry*)(resized.control + controlBytes(capacity));
+    memset(resized.control, CONTROL_EMPTY, controlBytes(capacity));
     for (int i = 0; i < capacity; i++) {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
-
+        resized.entries[i].key = NULL;
+        resized.entries[i].value = NIL_VAL;
     }
 
-    table->count = 0;
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
         if (entry->key == NULL) continue;
-
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        fillSlot(&resized, findFreeSlot(&resized, entry->key->hash), entry->key, entry->value);
     }
 
-    FREE_ARRAY(mm, Entry, table->entries, table->capacity);
-    table->entries = entries;
-    table->capacity = capacity;
+    FREE_ARRAY(mm, uint8_t, table->control, tableBytes(table->capacity));
+    *table = resized;
+}
+
+// The smallest capacity that holds `count` keys at most half full. Rebuilding at it leaves room
+// for as many keys again before the next rebuild, however the table got there.
+static int capacityFor(int count) {
+    int capacity = MIN_CAPACITY;
+    while (capacity < count * 2) capacity *= 2;
+    return capacity;
 }
 
 void initTable(Table* table, MemoryManager* mm) {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
+    table->control = NULL;
     table->entries = NULL;
     table->memoryManager = mm;
 }
 
 void freeTable(Table* table) {
-    FREE_ARRAY(table->memoryManager, Entry, table->entries, table->capacity);
+    FREE_ARRAY(table->memoryManager, uint8_t, table->control, tableBytes(table->capacity));
     initTable(table, NULL);
 }
 
 bool tableSet(Table* table, ObjString* key, Value value) {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table->memoryManager, table, capacity);
+    if (table->count > 0) {
+        int slot = findEntry(table, key);
+        if (slot >= 0) {
+            table->entries[slot].value = value;
+            return false;
+        }
     }
-    Entry* entry = findEntry(table->entries, table->capacity, key);
 
-    bool isNewKey = entry->key == NULL;
-    if (isNewKey && IS_NIL(entry->value)) table->count++;
-
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+    // Tombstones count towards the load, as probes have to pass them. Rebuilding drops them, so a
+    // table full of them is rebuilt at the capacity it has, or a smaller one, rather than grown.
+    if ((table->count + table->tombstones + 1) * 8 > table->capacity * TABLE_MAX_LOAD) {
+        adjustCapacity(table->memoryManager, table, capacityFor(table->count + 1));
+    }
+    fillSlot(table, findFreeSlot(table, key->hash), key, value);
+    return true;
 }
 
 bool tableDelete(Table* table, ObjString* key) {
     if (table->count == 0) return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
-
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
-
+    int slot = findEntry(table, key);
+    if (slot < 0) return false;
+
+    table->entries[slot].key = NULL;
+    table->entries[slot].value = NIL_VAL;
+    table->count--;
+    // Probes only go on past groups that are full, and once full a group has no empty slot until
+    // the table is rebuilt. So where this group still has one, no key lies beyond it on this
+    // slot's account, and the slot can be empty again rather than a tombstone.
+    if (matchByte(&table->control[slot / GROUP_WIDTH * GROUP_WIDTH], CONTROL_EMPTY) != 0) {
+        table->control[slot] = CONTROL_EMPTY;
+    } else {
+        table->control[slot] = CONTROL_DELETED;
+        table->tombstones++;
+    }
     return true;
 }
 
@@ -115,31 +232,78 @@ void tableAddAll(Table* from, Table* to) {
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
     if (table->count == 0) return NULL;
 
-    uint32_t index = hash & (table->capacity - 1);
-
-    for (;;) {
-        Entry* entry = &table->entries[index];
-
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) return NULL;
-        } else if (entry->key->length == length &&
-                   entry->key->hash == hash &&
-                   memcmp(entry->key->chars, chars, length) == 0) {
-            return entry->key;
+    uint8_t fragment = hashFragment(hash);
+    for (Probe probe = startProbe(table->capacity, hash);; nextGroup(&probe)) {
+        int first = probe.group * GROUP_WIDTH;
+        const uint8_t* control = &table->control[first];
+        for (BitMask match = matchByte(control, fragment); match != 0; match &= match - 1) {
+            ObjString* key = table->entries[first + lowestBit(match)].key;
+            if (key->length == length &&
+                key->hash == hash &&
+                memcmp(key->chars, chars, length) == 0) {
+                return key;
+            }
         }
+        if (matchByte(control, CONTROL_EMPTY) != 0) return NULL;
+    }
+}
+
+int tableProbeLength(Table* table, ObjString* key) {
+    if (table->count == 0) return 0;
 
-        index = (index + 1) & (table->capacity - 1);
+    uint8_t fragment = hashFragment(key->hash);
+    int groups = 1;
+    for (Probe probe = startProbe(table->capacity, key->hash);; nextGroup(&probe), groups++) {
+        int first = probe.group * GROUP_WIDTH;
+        const uint8_t* control = &table->control[first];
+        for (BitMask match = matchByte(control, fragment); match != 0; match &= match - 1) {
+            if (table->entries[first + lowestBit(match)].key == key) return groups;
+        }
+        if (matchByte(control, CONTROL_EMPTY) != 0) return 0;
     }
 }
 
 void markTable(Table* table) {
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
+        if (entry->key == NULL) continue;
         markObject(table->memoryManager, (Obj*)entry->key);
         markValue(table->memoryManager, entry->value);
     }
 }
 
+#ifdef GENERATIONAL_GC
+// Keys are interned strings, which are never young.
+void forwardTable(Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        if (entry->key != NULL) forwardValue(table->memoryManager, &entry->value);
+    }
+}
+#endif
+
+TableStats tableStats(Table* table) {
+    TableStats stats;
+    stats.count = table->count;
+    stats.tombstones = table->tombstones;
+    stats.capacity = table->capacity;
+    stats.meanProbe = 0;
+    stats.maxProbe = 0;
+
+    long probes = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        if (table->entries[i].key == NULL) continue;
+        int length = tableProbeLength(table, table->entries[i].key);
+        probes += length;
+        if (length > stats.maxProbe) stats.maxProbe = length;
+    }
+    if (table->count > 0) stats.meanProbe = (double)probes / table->count;
+    return stats;
+}
+
+// A sweep can delete most of the intern table at once, and nothing inserts afterwards to make
+// room. So the sweep rebuilds the table itself once tombstones outnumber the keys, or the keys
+// fill less than an eighth of it.
 void tableRemoveUnmarked(Table* table) {
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
@@ -147,4 +311,162 @@ void tableRemoveUnmarked(Table* table) {
             tableDelete(table, entry->key);
         }
     }
+
+    bool sparse = table->count * 8 < table->capacity && table->capacity > MIN_CAPACITY;
+    if (sparse || table->tombstones > table->count) {
+        adjustCapacity(table->memoryManager, table, capacityFor(table->count));
+    }
+}
+
+#define INDEX_EMPTY -1
+#define INDEX_DELETED -2
+
+static uint32_t mixBits(uint64_t bits) {
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdu;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+// Values that are equal hash the same: an int like the double it stands for, a string by its
+// characters.
+static uint32_t hashValue(Value value) {
+    if (IS_STRING(value)) return stringHash(AS_STRING(value));
+    if (IS_OBJ(value)) return mixBits((uint64_t)(uintptr_t)AS_OBJ(value));
+    if (IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        if (number == 0) number = 0; // -0 too.
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        return mixBits(bits);
+    }
+    return IS_NIL(value) ? 1 : (AS_BOOL(value) ? 3 : 2);
+}
+
+// The index slot holding `key`, or else the slot to add it at.
+static int32_t* findSlot(ValueTable* table, Value key, uint32_t hash) {
+    uint32_t mask = (uint32_t)table->capacity * 2 - 1;
+    uint32_t slot = hash & mask;
+    int32_t* tombstone = NULL;
+
+    for (;;) {
+        int32_t* position = &table->index[slot];
+        if (*position == INDEX_EMPTY) {
+            return tombstone != NULL ? tombstone : position;
+        } else if (*position == INDEX_DELETED) {
+            if (tombstone == NULL) tombstone = position;
+        } else if (valuesEqual(table->entries[*position].key, key)) {
+            return position;
+        }
+        slot = (slot + 1) & mask;
+    }
+}
+
+// Moves the live entries, in order, to new storage with room for `capacity`, and indexes them
+// afresh. Deleted entries and tombstones in the index are left behind.
+static void resizeValueTable(ValueTable* table, int capacity) {
+    MemoryManager* mm = table->memoryManager;
+    ValueEntry* entries = ALLOCATE(mm, ValueEntry, capacity);
+    int32_t* index = ALLOCATE(mm, int32_t, capacity * 2);
+    for (int i = 0; i < capacity * 2; i++) index[i] = INDEX_EMPTY;
+
+    int used = 0;
+    for (int i = 0; i < table->used; i++) {
+        if (!IS_NIL(table->entries[i].key)) entries[used++] = table->entries[i];
+    }
+
+    FREE_ARRAY(mm, ValueEntry, table->entries, table->capacity);
+    FREE_ARRAY(mm, int32_t, table->index, table->capacity * 2);
+    table->entries = entries;
+    table->index = index;
+    table->capacity = capacity;
+    table->used = used;
+    for (int i = 0; i < used; i++) {
+        *findSlot(table, entries[i].key, hashValue(entries[i].key)) = i;
+    }
+}
+
+void initValueTable(ValueTable* table, MemoryManager* mm) {
+    table->memoryManager = mm;
+    table->count = 0;
+    table->used = 0;
+    table->capacity = 0;
+    table->entries = NULL;
+    table->index = NULL;
+}
+
+void freeValueTable(ValueTable* table) {
+    FREE_ARRAY(table->memoryManager, ValueEntry, table->entries, table->capacity);
+    FREE_ARRAY(table->memoryManager, int32_t, table->index, table->capacity * 2);
+    initValueTable(table, NULL);
+}
+
+bool valueTableGet(ValueTable* table, Value key, Value* value) {
+    if (table->count == 0) return false;
+
+    int32_t position = *findSlot(table, key, hashValue(key));
+    if (position < 0) return false;
+
+    *value = table->entries[position].value;
+    return true;
+}
+
+bool valueTableSet(ValueTable* table, Value key, Value value) {
+    uint32_t hash = hashValue(key);
+    if (table->count > 0) {
+        int32_t position = *findSlot(table, key, hash);
+        if (position >= 0) {
+            table->entries[position].value = value;
+            return false;
+        }
+    }
+
+    if (table->used == table->capacity) {
+        // Squeezing out deleted entries is enough while at most half are live.
+        bool compact = table->count * 2 <= table->capacity && table->capacity > 0;
+        resizeValueTable(table, compact ? table->capacity : GROW_CAPACITY(table->capacity));
+    }
+    int32_t* slot = findSlot(table, key, hash);
+    *slot = table->used;
+    table->entries[table->used].key = key;
+    table->entries[table->used].value = value;
+    table->used++;
+    table->count++;
+    return true;
+}
+
+bool valueTableDelete(ValueTable* table, Value key) {
+    if (table->count == 0) return false;
+
+    int32_t* slot = findSlot(table, key, hashValue(key));
+    if (*slot < 0) return false;
+
+    table->entries[*slot].key = NIL_VAL;
+    table->entries[*slot].value = NIL_VAL;
+    *slot = INDEX_DELETED;
+    table->count--;
+    return true;
+}
+
+#ifdef GENERATIONAL_GC
+// Objects other than strings hash by address, so the index is rebuilt if any of them moved.
+void forwardValueTable(ValueTable* table) {
+    MemoryManager* mm = table->memoryManager;
+    bool moved = false;
+    for (int i = 0; i < table->used; i++) {
+        ValueEntry* entry = &table->entries[i];
+        Value key = entry->key;
+        forwardValue(mm, &entry->key);
+        forwardValue(mm, &entry->value);
+        if (IS_OBJ(key) && !IS_STRING(key) && AS_OBJ(entry->key) != AS_OBJ(key)) moved = true;
+    }
+    if (moved) resizeValueTable(table, table->capacity);
+}
+#endif
+
+void markValueTable(ValueTable* table) {
+    for (int i = 0; i < table->used; i++) {
+        markValue(table->memoryManager, table->entries[i].key);
+        markValue(table->memoryManager, table->entries[i].value);
+    }
 }
@@ -10,12 +10,23 @@ typedef struct {
     Value value;
 } Entry;
 
+// Open addressing with a control byte per slot, probed a group of slots at a time. See table.c.
 typedef struct {
     MemoryManager* memoryManager;
+    int count;        // Keys.
+    int tombstones;   // Deleted slots that probes still have to pass.
+    int capacity;     // A power of two.
+    uint8_t* control; // Padded to a whole group, and followed by the entries.
+    Entry* entries;   // The key is NULL in empty and deleted slots.
+} Table;
+
+typedef struct {
     int count;
+    int tombstones;
     int capacity;
-    Entry* entries;
-} Table;
+    double meanProbe; // Groups of slots read to find a key, averaged over the keys.
+    int maxProbe;
+} TableStats;
 
 //TODO(kjaa): initTable should take and store the allocator!
 //            that would save every subsequent op from having to be passed an allocator.
@@ -27,7 +38,48 @@ bool tableSet(Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
 void tableAddAll(Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
+// Deletes the keys the collector left unmarked, then drops tombstones or shrinks the table where
+// the deletions call for it.
 void tableRemoveUnmarked(Table* table);
 void markTable(Table* table);
+#ifdef GENERATIONAL_GC
+void forwardTable(Table* table);
+#endif
+// Groups of slots a lookup of `key` reads to find it, or 0 if it is not there.
+int tableProbeLength(Table* table, ObjString* key);
+TableStats tableStats(Table* table);
+
+// A table keyed by any value but nil, for maps. Unlike Table, keys compare by value: strings by
+// their characters, numbers by what they stand for and other objects by identity. Ropes must be
+// flattened before they are used as keys.
+//
+// Entries are kept densely in the order they were added, and a separate index of twice as many
+// slots maps hashes to positions in them. Empty slots in the index cost four bytes rather than a
+// whole entry, and walking the entries touches nothing but live data and the holes left by
+// deletions, which are squeezed out the next time the entries fill up.
+typedef struct {
+    Value key; // NIL_VAL once deleted.
+    Value value;
+} ValueEntry;
+
+typedef struct {
+    MemoryManager* memoryManager;
+    int count;    // Live entries.
+    int used;     // Entries taken, deleted ones included.
+    int capacity; // Of `entries`. The index has twice as many slots.
+    ValueEntry* entries;
+    int32_t* index; // A position in `entries`, or one of the INDEX_ values in table.c.
+} ValueTable;
+
+void initValueTable(ValueTable* table, MemoryManager* mm);
+void freeValueTable(ValueTable* table);
+
+bool valueTableGet(ValueTable* table, Value key, Value* value);
+bool valueTableSet(ValueTable* table, Value key, Value value);
+bool valueTableDelete(ValueTable* table, Value key);
+void markValueTable(ValueTable* table);
+#ifdef GENERATIONAL_GC
+void forwardValueTable(ValueTable* table);
+#endif
 
 #endif //CLOX_TABLE_H
@@ -0,0 +1,9 @@
+# Runs PROGRAM and checks that it succeeds and prints exactly the contents of EXPECTED.
+execute_process(COMMAND ${PROGRAM} OUTPUT_VARIABLE actual RESULT_VARIABLE result)
+file(READ ${EXPECTED} expected)
+if (NOT result EQUAL 0)
+    message(FATAL_ERROR "${PROGRAM} exited with ${result}")
+endif ()
+if (NOT actual STREQUAL expected)
+    message(FATAL_ERROR "${PROGRAM} printed:\n${actual}\nexpected:\n${expected}")
+endif ()
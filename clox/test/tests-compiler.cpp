@@ -76,3 +76,38 @@ TEST_CASE("Disassembly Dump Tests","[compiler]") {
         }
     }
 }
+
+#ifdef SUPERINSTRUCTIONS
+TEST_CASE("Superinstructions report the line of their second half","[compiler]") {
+    MemoryManager nullCollector;
+    initMemoryManager(&nullCollector);
+    nullCollector.pushStack = nullCollectorStackPush;
+    nullCollector.popStack = nullMemoryComponentFn;
+
+    Table strings;
+    initTable(&strings, &nullCollector);
+    Globals globals;
+    initGlobals(&globals, &nullCollector);
+
+    ObjFunction* script = compile(&nullCollector, &strings, &globals,
+                                  "var n;\n"
+                                  "fun f() {\n"
+                                  "  n\n"
+                                  "    .foo();\n"
+                                  "}\n");
+    REQUIRE(script != NULL);
+    ObjFunction* f = NULL;
+    for (int i = 0; i < script->chunk.constants.count; i++) {
+        Value constant = script->chunk.constants.values[i];
+        if (IS_FUNCTION(constant)) f = AS_FUNCTION(constant);
+    }
+    REQUIRE(f != NULL);
+
+    // n is read on line 3, but only the invocation on line 4 can fail.
+    REQUIRE(f->chunk.code[0] == OP_GET_GLOBAL_INVOKE);
+    for (int i = 0; i < 4; i++) CHECK(f->chunk.lines[i] == 4);
+
+    freeGlobals(&globals);
+    freeMemoryManager(&nullCollector);
+}
+#endif
@@ -0,0 +1,186 @@
+#include "catch2/catch.hpp"
+
+extern "C" {
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+}
+
+// The keys are the collector's roots, as the VM's would be, along with what copyString() pushes
+// while it interns one. A build collecting on every allocation then keeps the keys already made
+// while it makes the next.
+struct Keys {
+    MemoryManager* mm;
+    Table* strings;
+    ObjString* keys[1000];
+    int count;
+    Value stack[8];
+    int stackCount;
+};
+
+static void pushKeysStack(void* data, void* value) {
+    Keys* keys = (Keys*)data;
+    keys->stack[keys->stackCount++] = *(Value*)value;
+}
+
+static void popKeysStack(void* data) {
+    ((Keys*)data)->stackCount--;
+}
+
+static void markKeys(void* data) {
+    Keys* keys = (Keys*)data;
+    for (int i = 0; i < keys->count; i++) markObject(keys->mm, (Obj*)keys->keys[i]);
+    for (int i = 0; i < keys->stackCount; i++) markValue(keys->mm, keys->stack[i]);
+}
+
+static void removeUnmarkedStrings(void* data) {
+    tableRemoveUnmarked(((Keys*)data)->strings);
+}
+
+static ObjString* key(MemoryManager* mm, Table* strings, int i) {
+    char chars[16];
+    int length = snprintf(chars, sizeof(chars), "k%d", i);
+    return copyString(mm, strings, chars, length);
+}
+
+TEST_CASE("Table","[table]") {
+    MemoryManager mm;
+    initMemoryManager(&mm);
+
+    Table strings;
+    initTable(&strings, &mm);
+    const int count = 1000;
+    Keys roots;
+    roots.mm = &mm;
+    roots.strings = &strings;
+    roots.count = 0;
+    roots.stackCount = 0;
+
+    MemoryComponent keysComponent;
+    keysComponent.data = &roots;
+    keysComponent.markRoots = markKeys;
+    keysComponent.handleWeakReferences = removeUnmarkedStrings;
+    keysComponent.next = mm.memoryComponents;
+    mm.memoryComponents = &keysComponent;
+
+    mm.dataStack = &roots;
+    mm.pushStack = pushKeysStack;
+    mm.popStack = popKeysStack;
+
+    ObjString** keys = roots.keys;
+    for (int i = 0; i < count; i++) {
+        keys[i] = key(&mm, &strings, i);
+        roots.count++;
+    }
+
+    SECTION("Set, get and find") {
+        Table table;
+        initTable(&table, &mm);
+        for (int i = 0; i < count; i++) CHECK(tableSet(&table, keys[i], INT_VAL(i)));
+        CHECK_FALSE(tableSet(&table, keys[7], INT_VAL(-7)));
+
+        Value value;
+        for (int i = 0; i < count; i++) {
+            REQUIRE(tableGet(&table, keys[i], &value));
+            CHECK(value == INT_VAL(i == 7 ? -7 : i));
+            CHECK(tableFindString(&table, keys[i]->chars, keys[i]->length, keys[i]->hash) == keys[i]);
+        }
+        ObjString* missing = copyString(&mm, &strings, "missing", 7);
+        CHECK_FALSE(tableGet(&table, missing, &value));
+        CHECK(tableFindString(&table, "missing", 7, missing->hash) == NULL);
+        freeTable(&table);
+    }
+
+    SECTION("Deleted keys can come back") {
+        Table table;
+        initTable(&table, &mm);
+        for (int i = 0; i < count; i++) tableSet(&table, keys[i], INT_VAL(i));
+        for (int i = 0; i < count; i += 2) CHECK(tableDelete(&table, keys[i]));
+        CHECK_FALSE(tableDelete(&table, keys[0]));
+
+        Value value;
+        for (int i = 0; i < count; i++) {
+            CHECK(tableGet(&table, keys[i], &value) == (i % 2 == 1));
+        }
+        for (int i = 0; i < count; i += 2) CHECK(tableSet(&table, keys[i], INT_VAL(-i)));
+        for (int i = 0; i < count; i++) {
+            REQUIRE(tableGet(&table, keys[i], &value));
+            CHECK(value == INT_VAL(i % 2 == 1 ? i : -i));
+        }
+        freeTable(&table);
+    }
+
+    SECTION("Small tables churn") {
+        Table table;
+        initTable(&table, &mm);
+        for (int round = 0; round < 100; round++) {
+            for (int i = 0; i < 5; i++) tableSet(&table, keys[round * 5 + i], INT_VAL(i));
+            for (int i = 0; i < 5; i++) CHECK(tableDelete(&table, keys[round * 5 + i]));
+        }
+        CHECK(table.capacity == 8);
+        CHECK(table.count == 0);
+        freeTable(&table);
+    }
+
+    SECTION("Churn does not grow a table") {
+        Table table;
+        initTable(&table, &mm);
+        for (int i = 0; i < 100; i++) tableSet(&table, keys[i], INT_VAL(i));
+        int capacity = table.capacity;
+        for (int i = 100; i < count; i++) {
+            tableSet(&table, keys[i], INT_VAL(i));
+            tableDelete(&table, keys[i]);
+        }
+        CHECK(table.count == 100);
+        CHECK(table.capacity == capacity);
+
+        TableStats stats = tableStats(&table);
+        CHECK(stats.count == 100);
+        CHECK(stats.tombstones == table.tombstones);
+        CHECK(stats.maxProbe >= 1);
+        freeTable(&table);
+    }
+
+    SECTION("Removing unmarked keys shrinks a table") {
+        Table table;
+        initTable(&table, &mm);
+        for (int i = 0; i < count; i++) tableSet(&table, keys[i], NIL_VAL);
+        // Marked by hand, as in the middle of a collection, so shrinking must not start another.
+        mm.collecting = true;
+        for (int i = 0; i < count; i++) keys[i]->obj.isMarked = i % 100 == 0;
+        tableRemoveUnmarked(&table);
+        for (int i = 0; i < count; i++) keys[i]->obj.isMarked = false;
+        mm.collecting = false;
+
+        CHECK(table.count == 10);
+        CHECK(table.tombstones == 0);
+        CHECK(table.capacity == 32);
+        Value value;
+        for (int i = 0; i < count; i++) CHECK(tableGet(&table, keys[i], &value) == (i % 100 == 0));
+        freeTable(&table);
+    }
+
+    SECTION("Add all") {
+        Table from;
+        Table to;
+        initTable(&from, &mm);
+        initTable(&to, &mm);
+        for (int i = 0; i < 100; i++) tableSet(&from, keys[i], INT_VAL(i));
+        tableSet(&to, keys[0], NIL_VAL);
+        tableSet(&to, keys[500], NIL_VAL);
+        tableAddAll(&from, &to);
+
+        Value value;
+        for (int i = 0; i < 100; i++) {
+            REQUIRE(tableGet(&to, keys[i], &value));
+            CHECK(value == INT_VAL(i));
+        }
+        CHECK(tableGet(&to, keys[500], &value));
+        freeTable(&from);
+        freeTable(&to);
+    }
+
+    mm.memoryComponents = keysComponent.next;
+    freeTable(&strings);
+    freeMemoryManager(&mm);
+}
@@ -1,11 +1,67 @@
 #include "catch2/catch.hpp"
 
 extern "C" {
+#include <string.h>
+
 #include "memory.h"
 #include "file.h"
 #include "vm.h"
 }
 
+// A VM on a memory manager of its own, wired up the way main.c does it and printing to a temporary
+// file. Tiers, stack limits and natives are left to each test to set after construction.
+struct VMFixture {
+    MemoryManager mm;
+    VM vm;
+    MemoryComponent vmComponent;
+    FILE* out;
+
+    VMFixture() {
+        initMemoryManager(&mm);
+        initVM(&vm, &mm);
+
+        vmComponent.data = &vm;
+        vmComponent.markRoots = markVMRoots;
+        vmComponent.handleWeakReferences = handleWeakVMReferences;
+        vmComponent.next = mm.memoryComponents;
+        mm.memoryComponents = &vmComponent;
+
+        mm.dataStack = &vm;
+        mm.pushStack = pushStackVM;
+        mm.popStack = popStackVM;
+
+        internBuiltinStrings(&vm);
+
+        out = tmpfile();
+        vm.outPipe = out;
+    }
+
+    // Both point into the fixture itself.
+    VMFixture(const VMFixture&) = delete;
+    VMFixture& operator=(const VMFixture&) = delete;
+
+    // The temporary file is removed once closed.
+    ~VMFixture() {
+        fclose(out);
+
+        mm.memoryComponents = vmComponent.next;
+        vmComponent.data = nullptr;
+        vmComponent.markRoots = nullptr;
+        vmComponent.handleWeakReferences = nullptr;
+        vmComponent.next = nullptr;
+
+        freeVM(&vm);
+        freeMemoryManager(&mm);
+    }
+
+    std::string output() {
+        char* chars = readFileHandle(out, "output");
+        std::string text(chars);
+        free(chars);
+        return text;
+    }
+};
+
 TEST_CASE("Print Tests","[vm]") {
     const std::string printTests[] =
             {
@@ -43,62 +99,200 @@ TEST_CASE("Print Tests","[vm]") {
                     "coffeemaker",
                     "doughnut",
                     "a-method",
-                    "super"
+                    "super",
+                    "superinstructions",
+                    "shapes",
+                    "inline-caches",
+                    "quickening",
+                    "deep-recursion",
+                    "tail-calls",
+                    "bare-functions",
+                    "upvalue-order",
+                    "local-instances",
+                    "ropes",
+                    "runtime-strings",
+                    "ints",
+                    "lists",
+                    "maps",
+                    "floats",
+                    "generations"
             };
     const std::string printTestDir = "/Users/kja/repos/crafting-interpreters/clox/test/testData/vm/print/";
 
+    // A JIT threshold of 1 compiles every function on its first call or back-edge. Small stacks
+    // start at a single frame and the smallest value stack, and grow on almost every call.
+    struct Configuration { const char* name; ExecutionTier tier; bool jit; bool smallStacks; };
+    const Configuration configurations[] = {
+            { "", TIER_STACK, false, false },
+            { " (registers)", TIER_REGISTER, false, false },
+            { " (jit)", TIER_STACK, true, false },
+            { " (registers, jit)", TIER_REGISTER, true, false },
+            { " (small stacks)", TIER_STACK, false, true },
+            { " (registers, jit, small stacks)", TIER_REGISTER, true, true },
+    };
+
+    for (const auto &configuration : configurations)
     for (const auto &testName : printTests) {
-        DYNAMIC_SECTION(testName) {
+        DYNAMIC_SECTION(testName << configuration.name) {
             const std::string sourcePath = printTestDir + testName + ".lox";
             const std::string expectationsPath = sourcePath + ".out";
 
-            FILE* tmp = tmpfile();
-
-            MemoryManager mm;
-            initMemoryManager(&mm);
-
-            VM vm;
-            initVM(&vm, &mm);
-
-            MemoryComponent vmComponent;
-            vmComponent.data = &vm;
-            vmComponent.markRoots = markVMRoots;
-            vmComponent.handleWeakReferences = handleWeakVMReferences;
-            vmComponent.next = mm.memoryComponents;
-            mm.memoryComponents = &vmComponent;
-
-            mm.dataStack = &vm;
-            mm.pushStack = pushStackVM;
-            mm.popStack = popStackVM;
-
+            VMFixture fixture;
+            VM& vm = fixture.vm;
+            vm.tier = configuration.tier;
+            vm.jitEnabled = configuration.jit;
+            vm.jitThreshold = 1;
+            if (configuration.smallStacks) {
+                StackLimits limits = vm.stackLimits;
+                limits.initialFrames = 1;
+                limits.initialSlots = STACK_HEADROOM;
+                setStackLimits(&vm, limits);
+                REQUIRE(vm.stackCapacity == STACK_HEADROOM);
+            }
             initNativeFunctionEnvironment(&vm);
-            internBuiltinStrings(&vm);
-
-            vm.outPipe = tmp;
             vm.errPipe = stdout;
 
             char *testSource = readFile(sourcePath.c_str());
             InterpretResult result = interpret(&vm, testSource);
 
             CHECK(result == INTERPRET_OK);
+            // Every call keeps headroom above its frame, so even the script's outgrows the stack.
+            if (configuration.smallStacks) CHECK(vm.stackCapacity > STACK_HEADROOM);
 
-            char *actual = readFileHandle(tmp, "actual");
             char *expected = readFile(expectationsPath.c_str());
-            CHECK_THAT(actual, Catch::Matchers::Equals(expected));
+            CHECK(fixture.output() == expected);
 
             free(expected);
-            free(actual);
-            fclose(tmp);
             free(testSource);
+        }
+    }
+}
+
+TEST_CASE("Stack overflow at the configured limit","[vm]") {
+    VMFixture fixture;
+    VM& vm = fixture.vm;
+    StackLimits limits = vm.stackLimits;
+    limits.maxFrames = 100;
+    setStackLimits(&vm, limits);
+
+    // The script's frame plus 99 calls fit; the 100th call does not.
+    CHECK(interpret(&vm, "fun f(n) { if (n > 0) f(n - 1); } f(98);") == INTERPRET_OK);
+    CHECK(vm.frameCapacity == 100);
+    CHECK(interpret(&vm, "f(99);") == INTERPRET_RUNTIME_ERROR);
+}
+
+static bool sumNative(VM* vm, int argCount, Value* args, Value* result) {
+    double sum = 0;
+    for (int i = 0; i < argCount; i++) {
+        if (!IS_NUMBER(args[i])) return nativeError(vm, "Operands must be numbers.");
+        sum += AS_NUMBER(args[i]);
+    }
+    *result = NUMBER_VAL(sum);
+    return true;
+}
+
+static bool joinNative(VM* vm, int argCount, Value* args, Value* result) {
+    for (int i = 0; i < argCount; i++) {
+        if (!IS_STRING(args[i])) return nativeError(vm, "Operands must be strings.");
+    }
+    if (argCount == 1) {
+        *result = args[0];
+        return true;
+    }
+    ObjString* a = AS_STRING(args[0]);
+    ObjString* b = AS_STRING(args[1]);
+    ObjString* joined = allocateString(vm->mm, a->length + b->length);
+    memcpy(joined->chars, a->chars, a->length);
+    memcpy(joined->chars + a->length, b->chars, b->length);
+    *result = OBJ_VAL(joined);
+    return true;
+}
+
+TEST_CASE("Native functions","[vm]") {
+    for (bool jit : { false, true }) {
+        DYNAMIC_SECTION((jit ? "jit" : "interpreter")) {
+            VMFixture fixture;
+            VM& vm = fixture.vm;
+            vm.jitEnabled = jit;
+            vm.jitThreshold = 1;
+            defineNative(&vm, "sum", 0, NATIVE_VARIADIC, NATIVE_NO_ALLOC, sumNative);
+            defineNative(&vm, "join", 1, 2, 0, joinNative);
+
+            CHECK(interpret(&vm,
+                    "print sum();"
+                    "print sum(1, 2, 3);"
+                    "fun total() {"
+                    "  var t = 0;"
+                    "  for (var i = 0; i < 100; i = i + 1) t = t + sum(i, 1);"
+                    "  return t;"
+                    "}"
+                    "print total();"
+                    "print join(\"a\");"
+                    "print join(\"a\", \"b\");"
+                    "print join(\"a\", \"b\") == \"ab\";"
+                    "fun bad(x) { return sum(1, x) + 1; }"
+                    "print bad(2);") == INTERPRET_OK);
+            CHECK(interpret(&vm, "print bad(nil);") == INTERPRET_RUNTIME_ERROR);
+            CHECK(interpret(&vm, "join();") == INTERPRET_RUNTIME_ERROR);
+            CHECK(interpret(&vm, "join(\"a\", \"b\", \"c\");") == INTERPRET_RUNTIME_ERROR);
+            CHECK(interpret(&vm, "print join(\"c\", \"d\");") == INTERPRET_OK);
+
+            CHECK(fixture.output() == "0\n6\n5050\na\nab\ntrue\n4\ncd\n");
+        }
+    }
+}
+
+TEST_CASE("List, map and float array errors","[vm]") {
+    for (bool jit : { false, true }) {
+        DYNAMIC_SECTION((jit ? "jit" : "interpreter")) {
+            VMFixture fixture;
+            VM& vm = fixture.vm;
+            vm.jitEnabled = jit;
+            vm.jitThreshold = 1;
+            initNativeFunctionEnvironment(&vm);
+
+            CHECK(interpret(&vm,
+                    "var list = [1, 2, 3];"
+                    "fun get(i) { return list[i]; }"
+                    "fun set(i) { list[i] = i; return list; }"
+                    "print get(0) + get(2);") == INTERPRET_OK);
+            CHECK(interpret(&vm, "get(3);") == INTERPRET_RUNTIME_ERROR);
+            CHECK(interpret(&vm, "get(-1);") == INTERPRET_RUNTIME_ERROR);
+            CHECK(interpret(&vm, "get(0.5);") == INTERPRET_RUNTIME_ERROR);
+            CHECK(interpret(&vm, "get(\"0\");") == INTERPRET_RUNTIME_ERROR);
+            CHECK(interpret(&vm, "set(3);") == INTERPRET_RUNTIME_ERROR);
+            CHECK(interpret(&vm, "\"abc\"[0];") == INTERPRET_RUNTIME_ERROR);
+            CHECK(interpret(&vm, "nil[0] = 1;") == INTERPRET_RUNTIME_ERROR);
+            CHECK(interpret(&vm, "append(\"abc\", 1);") == INTERPRET_RUNTIME_ERROR);
+            CHECK(interpret(&vm, "len(1);") == INTERPRET_RUNTIME_ERROR);
+            CHECK(interpret(&vm, "print set(2.0);") == INTERPRET_OK);
+
+            CHECK(interpret(&vm,
+                    "var map = [1: \"a\"];"
+                    "fun put(k, v) { map[k] = v; return map; }") == INTERPRET_OK);
+            CHECK(interpret(&vm, "put(nil, 1);") == INTERPRET_RUNTIME_ERROR);
+            CHECK(interpret(&vm, "var bad = [1: 2, nil: 3];") == INTERPRET_RUNTIME_ERROR);
+            CHECK(interpret(&vm, "has(list, 1);") == INTERPRET_RUNTIME_ERROR);
+            CHECK(interpret(&vm, "remove(list, 1);") == INTERPRET_RUNTIME_ERROR);
+            CHECK(interpret(&vm, "keys(list);") == INTERPRET_RUNTIME_ERROR);
+            CHECK(interpret(&vm, "print put(1.0, \"b\")[nil];") == INTERPRET_OK);
+            CHECK(interpret(&vm, "print put(\"1\", \"c\");") == INTERPRET_OK);
 
-            mm.memoryComponents = vmComponent.next;
-            vmComponent.data = nullptr;
-            vmComponent.markRoots = nullptr;
-            vmComponent.handleWeakReferences = nullptr;
-            vmComponent.next = nullptr;
+            CHECK(interpret(&vm,
+                    "var fs = floats(2);"
+                    "fun fset(i, v) { fs[i] = v; return fs; }") == INTERPRET_OK);
+            CHECK(interpret(&vm, "fset(2, 1);") == INTERPRET_RUNTIME_ERROR);
+            CHECK(interpret(&vm, "fset(0, \"1\");") == INTERPRET_RUNTIME_ERROR);
+            CHECK(interpret(&vm, "floats(-1);") == INTERPRET_RUNTIME_ERROR);
+            CHECK(interpret(&vm, "floats(0.5);") == INTERPRET_RUNTIME_ERROR);
+            CHECK(interpret(&vm, "floats([1, nil]);") == INTERPRET_RUNTIME_ERROR);
+            CHECK(interpret(&vm, "sum(list);") == INTERPRET_RUNTIME_ERROR);
+            CHECK(interpret(&vm, "dot(fs, floats(3));") == INTERPRET_RUNTIME_ERROR);
+            CHECK(interpret(&vm, "axpy(1, floats(3), fs);") == INTERPRET_RUNTIME_ERROR);
+            CHECK(interpret(&vm, "map(fs, \"cube\");") == INTERPRET_RUNTIME_ERROR);
+            CHECK(interpret(&vm, "print fset(1.0, 1.5);") == INTERPRET_OK);
 
-            freeVM(&vm);
-            freeMemoryManager(&mm);
+            CHECK(fixture.output() == "4\n[1, 2, 2]\nnil\n[1: b, 1: c]\n[0, 1.5]\n");
         }
     }
 }
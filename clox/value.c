@@ -27,9 +27,13 @@ void freeValueArray(MemoryManager* mm, ValueArray* array) {
     initValueArray(array);
 }
 
-bool valuesEqual(Value a, Value b) {
+bool valuesIdentical(Value a, Value b) {
 #ifdef NAN_BOXING
-    return a == b;
+    if (a == b) return true;
+    // Compared as the doubles they stand for, bit for bit like two doubles are.
+    if (IS_INT(a)) return IS_NUMBER(b) && NUMBER_VAL(AS_NUMBER(a)) == NUMBER_VAL(AS_NUMBER(b));
+    if (IS_INT(b)) return IS_NUMBER(a) && NUMBER_VAL(AS_NUMBER(a)) == NUMBER_VAL(AS_NUMBER(b));
+    return false;
 #else
     if (a.type != b.type) return false;
     switch (a.type) {
@@ -44,6 +48,11 @@ bool valuesEqual(Value a, Value b) {
 #endif
 }
 
+bool valuesEqual(Value a, Value b) {
+    if (valuesIdentical(a, b)) return true;
+    return IS_STRING(a) && IS_STRING(b) && stringsEqual(AS_STRING(a), AS_STRING(b));
+}
+
 void printValue(FILE* out, Value value) {
 #ifdef NAN_BOXING
     if (IS_BOOL(value)) {
@@ -15,19 +15,31 @@
 #define TAG_FALSE 2
 #define TAG_TRUE 3
 
+// Numbers are either doubles or int32s. An int has INT_TAG in its high half and the int itself in
+// the low half. That is a quiet NaN with bit 48 set, which neither the singletons above nor
+// objects, whose pointers fit in 48 bits, ever have. Both kinds pass IS_NUMBER and AS_NUMBER
+// widens ints, so only code that wants the int fast paths below needs to tell them apart.
+#define INT_TAG ((uint64_t)0x7ffd000000000000)
+#define BOXED_MASK (QNAN | ((uint64_t)3 << 48))
+
 typedef uint64_t Value;
 
-#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_NUMBER(value) (((value) & BOXED_MASK) != QNAN)
+#define IS_INT(value)    (((value) >> 32) == (INT_TAG >> 32))
+// Both at once, in one test.
+#define BOTH_INT(a, b)   (((((a) ^ INT_TAG) | ((b) ^ INT_TAG)) >> 32) == 0)
 #define IS_NIL(value)    ((value) == NIL_VAL)
 #define IS_BOOL(value)   (((value) | 1) == TRUE_VAL)
 #define IS_OBJ(value)    (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
 #define AS_NUMBER(value) valueToNum(value)
+#define AS_INT(value)    ((int32_t)(uint32_t)(value))
 #define AS_BOOL(value)   ((value) == TRUE_VAL)
 #define AS_OBJ(value)    ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
 
 #define BOOL_VAL(b)     ((b) ? TRUE_VAL : FALSE_VAL)
 #define NUMBER_VAL(num) numToValue(num)
+#define INT_VAL(i)      ((Value)(INT_TAG | (uint32_t)(int32_t)(i)))
 #define NIL_VAL         ((Value)(uint64_t)(QNAN | TAG_NIL))
 #define FALSE_VAL       ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL        ((Value)(uint64_t)(QNAN | TAG_TRUE))
@@ -40,11 +52,22 @@ static inline Value numToValue(double num) {
 }
 
 static inline double valueToNum(Value value) {
+    if (IS_INT(value)) return AS_INT(value);
     double num;
     memcpy(&num, &value, sizeof(Value));
     return num;
 }
 
+// The value of a number literal: an int if it is a whole number that fits, else a double.
+static inline Value numberValue(double number) {
+    if (number >= INT32_MIN && number <= INT32_MAX) {
+        int32_t integer = (int32_t)number;
+        // Compared bit for bit, so that -0 stays a double.
+        if (numToValue((double)integer) == numToValue(number)) return INT_VAL(integer);
+    }
+    return NUMBER_VAL(number);
+}
+
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
@@ -79,6 +102,16 @@ typedef struct Value {
 #define AS_OBJ(value)     ((value).as.obj)
 #define AS_NUMBER(value)  ((value).as.number)
 
+// Without NaN boxing every number is a double.
+#define IS_INT(value)     false
+#define BOTH_INT(a, b)    false
+#define AS_INT(value)     ((int32_t)(value).as.number)
+#define INT_VAL(i)        NUMBER_VAL((double)(i))
+
+static inline Value numberValue(double number) {
+    return NUMBER_VAL(number);
+}
+
 #define BOOL_VAL(value)   ((Value){ VAL_BOOL,      { .boolean = value }})
 #define OBJ_VAL(object)   ((Value){ VAL_OBJ,       { .obj = (Obj*)object }})
 #define NUMBER_VAL(value) ((Value){ VAL_NUMBER,    { .number = value }})
@@ -87,6 +120,61 @@ typedef struct Value {
 
 #endif
 
+// Arithmetic for the interpreter and compiled code alike. Two ints give an int while the exact
+// result fits in one and is not -0. Anything else is done on doubles, giving what doubles always
+// gave.
+static inline Value addNumbers(Value a, Value b) {
+    if (BOTH_INT(a, b)) {
+        int64_t sum = (int64_t)AS_INT(a) + AS_INT(b);
+        if (sum >= INT32_MIN && sum <= INT32_MAX) return INT_VAL(sum);
+    }
+    return NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+}
+
+static inline Value subtractNumbers(Value a, Value b) {
+    if (BOTH_INT(a, b)) {
+        int64_t difference = (int64_t)AS_INT(a) - AS_INT(b);
+        if (difference >= INT32_MIN && difference <= INT32_MAX) return INT_VAL(difference);
+    }
+    return NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b));
+}
+
+static inline Value multiplyNumbers(Value a, Value b) {
+    if (BOTH_INT(a, b)) {
+        int64_t product = (int64_t)AS_INT(a) * AS_INT(b);
+        if (product >= INT32_MIN && product <= INT32_MAX && (product != 0 || (AS_INT(a) | AS_INT(b)) >= 0)) {
+            return INT_VAL(product);
+        }
+    }
+    return NUMBER_VAL(AS_NUMBER(a) * AS_NUMBER(b));
+}
+
+static inline Value divideNumbers(Value a, Value b) {
+    if (BOTH_INT(a, b)) {
+        int32_t x = AS_INT(a);
+        int32_t y = AS_INT(b);
+        if (y > 0 || (y < 0 && x != 0 && !(x == INT32_MIN && y == -1))) {
+            if (x % y == 0) return INT_VAL(x / y);
+        }
+    }
+    return NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b));
+}
+
+static inline Value negateNumber(Value a) {
+    if (IS_INT(a) && AS_INT(a) != 0 && AS_INT(a) != INT32_MIN) return INT_VAL(-AS_INT(a));
+    return NUMBER_VAL(-AS_NUMBER(a));
+}
+
+static inline Value lessNumbers(Value a, Value b) {
+    if (BOTH_INT(a, b)) return BOOL_VAL(AS_INT(a) < AS_INT(b));
+    return BOOL_VAL(AS_NUMBER(a) < AS_NUMBER(b));
+}
+
+static inline Value greaterNumbers(Value a, Value b) {
+    if (BOTH_INT(a, b)) return BOOL_VAL(AS_INT(a) > AS_INT(b));
+    return BOOL_VAL(AS_NUMBER(a) > AS_NUMBER(b));
+}
+
 typedef struct {
     int capacity;
     int count;
@@ -98,11 +186,21 @@ typedef struct MemoryManager MemoryManager;
 void initValueArray(ValueArray* array);
 void writeValueArray(MemoryManager* mm, ValueArray* array, Value value);
 void freeValueArray(MemoryManager* mm, ValueArray* array);
+// The same value, or the same object. Enough for equality while every string is interned. An
+// int is identical to the double with the same value.
+bool valuesIdentical(Value a, Value b);
 bool valuesEqual(Value a, Value b);
 void printValue(FILE* out, Value value);
 
 void markObject(MemoryManager* mm, Obj* object);
 void markValue(MemoryManager* mm, Value value);
 
+#ifdef GENERATIONAL_GC
+// For a minor collection: copies a young object to the old generation unless that is done
+// already, and gives where it is now. Old objects stay where they are.
+Obj* forwardObject(MemoryManager* mm, Obj* object);
+void forwardValue(MemoryManager* mm, Value* value);
+#endif
+
 
 #endif //CLOX_VALUE_H
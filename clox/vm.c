@@ -6,11 +6,17 @@
 #include "memory.h"
 #include "compiler.h"
 #include "debug.h"
+#include "registers.h"
+#include "jit.h"
+#include "aot.h"
+#include "kernels.h"
+
+static void closeUpvalues(VM* vm, Value* last);
 
 static void resetStack(VM* vm) {
+    closeUpvalues(vm, vm->stack);
     vm->stackTop = vm->stack;
     vm->frameCount = 0;
-    vm->openUpvalues = NULL;
 }
 
 static void push(VM* vm, Value value) {
@@ -31,32 +37,63 @@ static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate(VM* vm) {
-    ObjString* b = AS_STRING(peek(vm, 0));
-    ObjString* a = AS_STRING(peek(vm, 1));
+// Ropes are strings still to be put together, and pass for strings everywhere but in natives.
+static bool isString(Value value) {
+    return IS_STRING(value) || IS_ROPE(value);
+}
 
-    int length = a->length + b->length;
-    char* chars = ALLOCATE(vm->mm, char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+Value flattenValue(VM* vm, Value value) {
+    if (!IS_ROPE(value)) return value;
+    return OBJ_VAL(flattenRope(vm->mm, AS_ROPE(value)));
+}
+
+// Short results are copied straight away; longer ones are left as a rope until something needs
+// their characters. Neither is interned.
+static void concatenate(VM* vm) {
+    Value b = peek(vm, 0);
+    Value a = peek(vm, 1);
 
-    ObjString* result = takeString(vm->mm, &vm->strings, chars, length);
+    Value result;
+    if (IS_STRING(a) && IS_STRING(b) && AS_STRING(a)->length + AS_STRING(b)->length < MIN_ROPE_LENGTH) {
+        ObjString* left = AS_STRING(a);
+        ObjString* right = AS_STRING(b);
+        ObjString* string = allocateString(vm->mm, left->length + right->length);
+        memcpy(string->chars, left->chars, left->length);
+        memcpy(string->chars + left->length, right->chars, right->length);
+        result = OBJ_VAL(string);
+    } else {
+        result = OBJ_VAL(newRope(vm->mm, a, b));
+    }
+    vm->madeStrings = true;
     pop(vm);
     pop(vm);
-    push(vm, OBJ_VAL(result));
+    push(vm, result);
 }
 
-static void runtimeError(VM* vm, const char* format, ...) {
-    va_list args;
-    va_start(args, format);
+// Both values must be reachable, as a rope compared with a string is flattened first.
+static bool equalValues(VM* vm, Value a, Value b) {
+    if (!vm->madeStrings) return valuesIdentical(a, b);
+    if ((IS_ROPE(a) && isString(b)) || (IS_ROPE(b) && isString(a))) {
+        a = flattenValue(vm, a);
+        b = flattenValue(vm, b);
+    }
+    return valuesEqual(a, b);
+}
+
+#define TRACE_FRAMES 32
+
+static void reportRuntimeError(VM* vm, const char* format, va_list args) {
     vfprintf(stderr, format, args);
-    va_end(args);
     fputs("\n", stderr);
 
     for (int i = vm->frameCount - 1; i >= 0; i--) {
+        // Deep recursion would bury the message; keep both ends of the trace.
+        if (i == vm->frameCount - 1 - TRACE_FRAMES && i >= TRACE_FRAMES) {
+            fprintf(stderr, "... %d more frames ...\n", i - TRACE_FRAMES + 1);
+            i = TRACE_FRAMES - 1;
+        }
         CallFrame* frame = &vm->frames[i];
-        ObjFunction* function = frame->closure->function;
+        ObjFunction* function = frame->function;
 
         size_t instruction = frame->ip - function->chunk.code - 1;
         fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
@@ -70,39 +107,145 @@ static void runtimeError(VM* vm, const char* format, ...) {
     resetStack(vm);
 }
 
+static void runtimeError(VM* vm, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    reportRuntimeError(vm, format, args);
+    va_end(args);
+}
+
+bool nativeError(VM* vm, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    reportRuntimeError(vm, format, args);
+    va_end(args);
+    return false;
+}
 
-static bool call(VM* vm, ObjClosure * closure, int argCount) {
-    if (argCount != closure->function->arity) {
-        runtimeError(vm, "Expected %d arguments but got %d.", closure->function->arity, argCount);
+
+static inline void countHotness(VM* vm, ObjFunction* function) {
+#ifdef BASELINE_JIT
+    if (!vm->jitEnabled || function->hotness >= vm->jitThreshold) return;
+    if (++function->hotness == vm->jitThreshold) compileJit(vm, function);
+#endif
+}
+
+static bool growFrames(VM* vm) {
+    if (vm->frameCapacity >= vm->stackLimits.maxFrames) return false;
+
+    int capacity = vm->frameCapacity * 2;
+    if (capacity > vm->stackLimits.maxFrames) capacity = vm->stackLimits.maxFrames;
+    vm->frames = GROW_ARRAY(vm->mm, CallFrame, vm->frames, vm->frameCapacity, capacity);
+    vm->frameCapacity = capacity;
+    return true;
+}
+
+// Moving the value stack leaves every pointer into it behind: the frames' slots, the open upvalues'
+// locations and stackTop. Anything else holding one must reload it after a call. The open upvalue
+// array grows alongside, so it always has an entry per slot.
+static bool growStack(VM* vm, int needed) {
+    if (needed > vm->stackLimits.maxSlots) return false;
+
+    int capacity = vm->stackCapacity;
+    while (capacity < needed) capacity *= 2;
+    if (capacity > vm->stackLimits.maxSlots) capacity = vm->stackLimits.maxSlots;
+
+    Value* oldStack = vm->stack;
+    vm->stack = GROW_ARRAY(vm->mm, Value, vm->stack, vm->stackCapacity, capacity);
+
+    vm->stackTop = vm->stack + (vm->stackTop - oldStack);
+    for (int i = 0; i < vm->frameCount; i++) {
+        vm->frames[i].slots = vm->stack + (vm->frames[i].slots - oldStack);
+    }
+
+    int oldCapacity = vm->stackCapacity;
+    vm->openUpvalues = GROW_ARRAY(vm->mm, ObjUpvalue*, vm->openUpvalues, oldCapacity, capacity);
+    for (int i = oldCapacity; i < capacity; i++) {
+        vm->openUpvalues[i] = NULL;
+    }
+    vm->stackCapacity = capacity;
+    for (int i = 0; i <= vm->openUpvalueBound; i++) {
+        if (vm->openUpvalues[i] != NULL) vm->openUpvalues[i]->location = vm->stack + i;
+    }
+    return true;
+}
+
+// The compiler only lets a local instance be a receiver; a bound method, or a method that lets
+// `this` out, takes it out of the local's hands.
+static void escapeReceiver(VM* vm, Value receiver) {
+    if (IS_INSTANCE(receiver) && AS_INSTANCE(receiver)->local) {
+        AS_INSTANCE(receiver)->local = false;
+        vm->escapes.escaped++;
+    }
+}
+
+static bool callFunction(VM* vm, ObjFunction* function, ObjClosure* closure, int argCount) {
+    if (argCount != function->arity) {
+        runtimeError(vm, "Expected %d arguments but got %d.", function->arity, argCount);
         return false;
     }
 
-    if (vm->frameCount == FRAMES_MAX) {
+    // Room for the whole frame is made up front, so pushes never need to check.
+    int base = (int)(vm->stackTop - vm->stack) - argCount - 1;
+    int needed = base + function->stackSize + STACK_HEADROOM;
+    if ((vm->frameCount == vm->frameCapacity && !growFrames(vm)) ||
+        (needed > vm->stackCapacity && !growStack(vm, needed))) {
         runtimeError(vm, "Stack overflow.");
         return false;
     }
 
     CallFrame* frame = &vm->frames[vm->frameCount++];
+    frame->function = function;
     frame->closure = closure;
-    frame->ip = closure->function->chunk.code;
+    frame->ip = function->chunk.code;
 
-    frame->slots = vm->stackTop - argCount - 1;
+    frame->slots = vm->stack + base;
+    if (function->thisEscapes) escapeReceiver(vm, frame->slots[0]);
+    countHotness(vm, function);
     return true;
 }
 
-static bool nativeCall(VM* vm, ObjNative* nativeObj, int argCount) {
-    if (argCount != nativeObj->arity) {
-        runtimeError(vm, "Expected %d arguments but got %d.", nativeObj->arity, argCount);
+static bool call(VM* vm, ObjClosure * closure, int argCount) {
+    return callFunction(vm, closure->function, closure, argCount);
+}
+
+static bool nativeCall(VM* vm, ObjNative* native, int argCount) {
+    if (argCount < native->arity || (native->maxArity != NATIVE_VARIADIC && argCount > native->maxArity)) {
+        if (native->maxArity == native->arity) {
+            runtimeError(vm, "Expected %d arguments but got %d.", native->arity, argCount);
+        } else if (native->maxArity == NATIVE_VARIADIC) {
+            runtimeError(vm, "Expected at least %d arguments but got %d.", native->arity, argCount);
+        } else {
+            runtimeError(vm, "Expected %d to %d arguments but got %d.", native->arity, native->maxArity, argCount);
+        }
         return false;
     }
 
-    NativeFn native = nativeObj->function;
-    Value result;
-    if(!native(argCount, vm->stackTop - argCount, &result)) {
-        runtimeError(vm, "Error in native call.");
+    // The result replaces the native in its slot; a failing native has already reset the stack.
+    Value* args = vm->stackTop - argCount;
+    for (int i = 0; i < argCount; i++) {
+        args[i] = flattenValue(vm, args[i]);
+    }
+    if (!native->function(vm, argCount, args, &args[-1])) return false;
+    if (IS_STRING(args[-1]) && !AS_STRING(args[-1])->interned) vm->madeStrings = true;
+    vm->stackTop = args;
+    return true;
+}
+
+static bool construct(VM* vm, ObjClass* klass, int argCount, bool local) {
+    vm->escapes.instances++;
+    if (klass->spare != NULL) vm->escapes.reused++;
+
+    ObjInstance* instance = newInstance(vm->mm, klass);
+    instance->local = local;
+    vm->stackTop[-argCount - 1] = OBJ_VAL(instance);
+    Value initializer;
+    if (tableGet(&klass->methods, vm->initString, &initializer)) {
+        return call(vm, AS_CLOSURE(initializer), argCount);
+    } else if (argCount != 0) {
+        runtimeError(vm, "Expected 0 arguments but got %d.", argCount);
+        return false;
     }
-    vm->stackTop -= argCount + 1;
-    push(vm, result);
     return true;
 }
 
@@ -114,20 +257,12 @@ static bool callValue(VM* vm, Value callee, int argCount) {
                 vm->stackTop[-argCount - 1] = bound->receiver;
                 return call(vm, bound->method, argCount);
             }
-            case OBJ_CLASS: {
-                ObjClass *klass = AS_CLASS(callee);
-                vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(vm->mm, klass));
-                Value initializer;
-                if (tableGet(&klass->methods, vm->initString, &initializer)) {
-                    return call(vm, AS_CLOSURE(initializer), argCount);
-                } else if (argCount != 0) {
-                    runtimeError(vm, "Expected 0 arguments but got %d.", argCount);
-                    return false;
-                }
-                return true;
-            }
+            case OBJ_CLASS:
+                return construct(vm, AS_CLASS(callee), argCount, false);
             case OBJ_CLOSURE:
                 return call(vm, AS_CLOSURE(callee), argCount);
+            case OBJ_FUNCTION:
+                return callFunction(vm, AS_FUNCTION(callee), NULL, argCount);
             case OBJ_NATIVE: {
                 return nativeCall(vm, AS_NATIVE(callee), argCount);
             }
@@ -140,18 +275,90 @@ static bool callValue(VM* vm, Value callee, int argCount) {
     return false;
 }
 
-static bool invokeFromClass(VM* vm, ObjClass* klass, ObjString* name, int argCount) {
+// Only an instance made right here is marked local; whatever else the call returns is left alone.
+static bool callLocal(VM* vm, Value callee, int argCount) {
+    if (IS_CLASS(callee)) return construct(vm, AS_CLASS(callee), argCount, true);
+    return callValue(vm, callee, argCount);
+}
+
+static void releaseLocal(VM* vm, Value value) {
+    if (IS_INSTANCE(value) && AS_INSTANCE(value)->local) releaseInstance(vm->mm, AS_INSTANCE(value));
+}
+
+// At a return, the stack above slot 0 holds nothing but the locals still in scope. Only the slots
+// the compiler saw owning their instances are released; a slot further up is out of scope.
+static void releaseLocals(VM* vm, CallFrame* frame) {
+    ObjFunction* function = frame->function;
+    for (int i = 0; i < function->ownedSlotCount; i++) {
+        Value* slot = frame->slots + function->ownedSlots[i];
+        if (slot < vm->stackTop) releaseLocal(vm, *slot);
+    }
+}
+
+// Inline caches are keyed on the receiver's shape, which pins down both its class and the fields it
+// has. Field hits need nothing more; method hits also check that the class's method table has not
+// changed since the entry was filled.
+static CacheEntry* findCacheEntry(InlineCache* cache, Obj* key) {
+    if (IS_MEGAMORPHIC(cache)) return NULL;
+
+    for (int i = 0; i < cache->count; i++) {
+        if (cache->entries[i].key == key) return &cache->entries[i];
+    }
+    return NULL;
+}
+
+// The cache belongs to the function running in the top frame, which a young target has to be
+// remembered for.
+static void updateCache(VM* vm, InlineCache* cache, Obj* key, int slot, Obj* target, int version) {
+    if (key == NULL || IS_MEGAMORPHIC(cache)) return;
+
+    CacheEntry* entry = findCacheEntry(cache, key);
+    if (entry == NULL) {
+        if (cache->count == INLINE_CACHE_SIZE) {
+            // Too many receivers at this site. Go megamorphic and let go of the cached objects.
+            for (int i = 0; i < INLINE_CACHE_SIZE; i++) {
+                cache->entries[i].key = NULL;
+                cache->entries[i].target = NULL;
+            }
+            cache->count++;
+            return;
+        }
+        entry = &cache->entries[cache->count++];
+        entry->key = key;
+    }
+
+    entry->slot = slot;
+    entry->target = target;
+    entry->version = version;
+    if (target != NULL) WRITE_BARRIER(vm->mm, vm->frames[vm->frameCount - 1].function, OBJ_VAL(target));
+}
+
+// An initializer returns `this`, which an explicit call hands to whoever asked for it; only when
+// constructing is the instance the caller's anyway.
+static void escapeInitReceiver(VM* vm, ObjString* name, int argCount) {
+    if (name == vm->initString) escapeReceiver(vm, peek(vm, argCount));
+}
+
+static bool invokeFromClass(VM* vm, ObjClass* klass, ObjString* name, int argCount, InlineCache* cache) {
+    escapeInitReceiver(vm, name, argCount);
+    CacheEntry* entry = findCacheEntry(cache, (Obj*)klass);
+    if (entry != NULL && entry->version == klass->methodsVersion) {
+        return call(vm, (ObjClosure*)entry->target, argCount);
+    }
+
     Value method;
     if (!tableGet(&klass->methods, name, &method)) {
         runtimeError(vm, "Undefined property '%s'.", name->chars);
         return false;
     }
 
+    updateCache(vm, cache, (Obj*)klass, -1, AS_OBJ(method), klass->methodsVersion);
     return call(vm, AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(VM* vm, ObjString* name, int argCount) {
+static bool invoke(VM* vm, ObjString* name, int argCount, InlineCache* cache) {
     Value receiver = peek(vm, argCount);
+    escapeInitReceiver(vm, name, argCount);
 
     if (!IS_INSTANCE(receiver)) {
         runtimeError(vm, "Only instances have methods.");
@@ -159,54 +366,91 @@ static bool invoke(VM* vm, ObjString* name, int argCount) {
     }
 
     ObjInstance* instance = AS_INSTANCE(receiver);
+    ObjShape* shape = instance->shape;
+    ObjClass* klass = instance->klass;
+
+    CacheEntry* entry = findCacheEntry(cache, (Obj*)shape);
+    if (entry != NULL) {
+        if (entry->slot >= 0) {
+            Value value = instance->fields[entry->slot];
+            vm->stackTop[-argCount - 1] = value;
+            return callValue(vm, value, argCount);
+        }
+        if (entry->version == klass->methodsVersion) {
+            return call(vm, (ObjClosure*)entry->target, argCount);
+        }
+    }
 
     Value value;
-    if(tableGet(&instance->fields, name, &value)) {
+    if (instanceGetField(instance, name, &value)) {
+        if (shape != NULL) updateCache(vm, cache, (Obj*)shape, shapeSlot(shape, name), NULL, 0);
         vm->stackTop[-argCount - 1] = value;
         return callValue(vm, value, argCount);
     }
-    return invokeFromClass(vm, instance->klass, name, argCount);
-}
-
-static ObjUpvalue* captureUpvalue(VM* vm, Value* local) {
-    ObjUpvalue* prevUpvalue = NULL;
-    ObjUpvalue* upvalue = vm->openUpvalues;
 
-    while (upvalue != NULL && upvalue->location > local) {
-        prevUpvalue = upvalue;
-        upvalue = upvalue->next;
+    Value method;
+    if (!tableGet(&klass->methods, name, &method)) {
+        runtimeError(vm, "Undefined property '%s'.", name->chars);
+        return false;
     }
 
-    if (upvalue != NULL && upvalue->location == local) {
-        return upvalue;
+    updateCache(vm, cache, (Obj*)shape, -1, AS_OBJ(method), klass->methodsVersion);
+    return call(vm, AS_CLOSURE(method), argCount);
+}
+
+// Closures capturing the same slot share its upvalue, found by indexing the open upvalue array
+// with the slot.
+static ObjUpvalue* captureUpvalue(VM* vm, Value* local) {
+    int slot = (int)(local - vm->stack);
+    if (vm->openUpvalues[slot] != NULL) {
+        return vm->openUpvalues[slot];
     }
 
     ObjUpvalue* createdUpvalue = newUpvalue(vm->mm, local);
-    createdUpvalue->next = upvalue;
-    // TODO(kjaa): you can use pointer-to-a-pointer to avoid this special casing:
-    //   prevUpvalue = &vm->openUpvalue; while() { prevUpvalue = &upvalue->next };
-    //   *prevUpvalue = createdUpvalue;
-    if (prevUpvalue == NULL) {
-        vm->openUpvalues = createdUpvalue;
-    } else {
-        prevUpvalue->next = createdUpvalue;
-    }
+    vm->openUpvalues[slot] = createdUpvalue;
+    if (slot > vm->openUpvalueBound) vm->openUpvalueBound = slot;
     return createdUpvalue;
 }
 
+// Nothing at or above last is open once this returns, so the bound drops below it and the next
+// close above it returns straight away. A slot is only scanned again after a capture raises the
+// bound past it.
 static void closeUpvalues(VM* vm, Value* last) {
-    while (vm->openUpvalues != NULL && vm->openUpvalues->location >= last) {
-        ObjUpvalue* upvalue = vm->openUpvalues;
+    int first = (int)(last - vm->stack);
+    for (int slot = vm->openUpvalueBound; slot >= first; slot--) {
+        ObjUpvalue* upvalue = vm->openUpvalues[slot];
+        if (upvalue == NULL) continue;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
-        vm->openUpvalues = upvalue->next;
+        WRITE_BARRIER(vm->mm, upvalue, upvalue->closed);
+        vm->openUpvalues[slot] = NULL;
     }
+    if (vm->openUpvalueBound >= first) vm->openUpvalueBound = first - 1;
+}
+
+// Only a function or closure that takes these arguments can have the frame; anything else, and
+// any error, goes through an ordinary call so the caller stays in the stack trace. The return
+// after the tail call then passes the result on.
+static bool canTailCall(Value callee, int argCount) {
+    if (IS_CLOSURE(callee)) return AS_CLOSURE(callee)->function->arity == argCount;
+    return IS_FUNCTION(callee) && AS_FUNCTION(callee)->arity == argCount;
+}
+
+// Pops the frame and slides the callee and its arguments down into its slots, leaving the stack
+// as it was when the frame was called. call() pushes the callee's frame in the same place.
+static void dropFrameForTailCall(VM* vm, CallFrame* frame, int argCount) {
+    closeUpvalues(vm, frame->slots);
+    memmove(frame->slots, vm->stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+    vm->stackTop = frame->slots + argCount + 1;
+    vm->frameCount--;
 }
 
 static void defineMethod(VM* vm, ObjString* name){
     Value method = peek(vm, 0);
     ObjClass* klass = AS_CLASS(peek(vm, 1));
     tableSet(&klass->methods, name, method);
+    WRITE_BARRIER(vm->mm, klass, method);
+    klass->methodsVersion++;
     pop(vm);
 }
 
@@ -217,336 +461,1080 @@ static bool bindMethod(VM* vm, ObjClass* klass, ObjString* name) {
         return false;
     }
 
+    escapeReceiver(vm, peek(vm, 0));
     ObjBoundMethod* bound = newBoundMethod(vm->mm, peek(vm, 0), AS_CLOSURE(method));
     pop(vm);
     push(vm, OBJ_VAL(bound));
     return true;
 }
 
+static inline bool getProperty(VM* vm, ObjString* name, InlineCache* cache) {
+    if (!IS_INSTANCE(peek(vm, 0))) {
+        runtimeError(vm, "Only instances have properties.");
+        return false;
+    }
+
+    ObjInstance* instance = AS_INSTANCE(peek(vm, 0));
+    ObjShape* shape = instance->shape;
+    ObjClass* klass = instance->klass;
+
+    CacheEntry* entry = findCacheEntry(cache, (Obj*)shape);
+    if (entry != NULL) {
+        if (entry->slot >= 0) {
+            vm->stackTop[-1] = instance->fields[entry->slot];
+            return true;
+        }
+        if (entry->version == klass->methodsVersion) {
+            escapeReceiver(vm, peek(vm, 0));
+            ObjBoundMethod* bound = newBoundMethod(vm->mm, peek(vm, 0), (ObjClosure*)entry->target);
+            vm->stackTop[-1] = OBJ_VAL(bound);
+            return true;
+        }
+    }
+
+    Value value;
+    if (instanceGetField(instance, name, &value)) {
+        if (shape != NULL) updateCache(vm, cache, (Obj*)shape, shapeSlot(shape, name), NULL, 0);
+        pop(vm); // Instance.
+        push(vm, value);
+        return true;
+    }
+
+    Value method;
+    if (tableGet(&klass->methods, name, &method)) {
+        updateCache(vm, cache, (Obj*)shape, -1, AS_OBJ(method), klass->methodsVersion);
+    }
+    return bindMethod(vm, klass, name);
+}
+
+static inline bool setProperty(VM* vm, ObjString* name, InlineCache* cache) {
+    if (!IS_INSTANCE(peek(vm, 1))) {
+        runtimeError(vm, "Only instances have fields.");
+        return false;
+    }
+    ObjInstance* instance = AS_INSTANCE(peek(vm, 1));
+    ObjShape* shape = instance->shape;
+
+    // A cached store either overwrites an existing field or adds one by taking the cached
+    // transition, provided the instance already has room for it.
+    CacheEntry* entry = findCacheEntry(cache, (Obj*)shape);
+    if (entry != NULL && (entry->target == NULL || entry->slot < instance->fieldCapacity)) {
+        instance->fields[entry->slot] = peek(vm, 0);
+        if (entry->target != NULL) instance->shape = (ObjShape*)entry->target;
+        WRITE_BARRIER(vm->mm, instance, peek(vm, 0));
+    } else {
+        instanceSetField(vm->mm, instance, name, peek(vm, 0));
+        if (shape != NULL && entry == NULL) {
+            if (instance->shape == shape) {
+                updateCache(vm, cache, (Obj*)shape, shapeSlot(shape, name), NULL, 0);
+            } else if (instance->shape != NULL) {
+                updateCache(vm, cache, (Obj*)shape, shape->slotCount, (Obj*)instance->shape, 0);
+            }
+        }
+    }
+    Value value = pop(vm);
+    pop(vm);
+    push(vm, value);
+    return true;
+}
+
+bool loadProperty(VM* vm, ObjString* name, InlineCache* cache) {
+    return getProperty(vm, name, cache);
+}
+
+bool storeProperty(VM* vm, ObjString* name, InlineCache* cache) {
+    return setProperty(vm, name, cache);
+}
+
+// Finds the position `index` names among `count` items. Ints in range take the first test; a
+// double has to be a whole number that is in range.
+static inline bool itemPosition(VM* vm, Value index, int count, int* position) {
+    if (IS_INT(index) && (uint32_t)AS_INT(index) < (uint32_t)count) {
+        *position = AS_INT(index);
+        return true;
+    }
+
+    if (!IS_NUMBER(index)) {
+        runtimeError(vm, "Index must be a number.");
+        return false;
+    }
+    double number = AS_NUMBER(index);
+    if (number >= 0 && number < count) {
+        if ((int)number == number) {
+            *position = (int)number;
+            return true;
+        }
+    } else if (number == number) { // Anything but NaN.
+        runtimeError(vm, "Index out of range.");
+        return false;
+    }
+    runtimeError(vm, "Index must be a whole number.");
+    return false;
+}
+
+// Maps never see a rope as a key, so one on the stack is flattened in place.
+static inline Value mapKey(VM* vm, int distance) {
+    Value key = flattenValue(vm, peek(vm, distance));
+    vm->stackTop[-1 - distance] = key;
+    return key;
+}
+
+// Everything but lists, which getIndex handles inline. A missing map key gives nil.
+static bool getItem(VM* vm) {
+    Value container = peek(vm, 1);
+    Value value;
+    if (IS_FLOAT_ARRAY(container)) {
+        ObjFloatArray* array = AS_FLOAT_ARRAY(container);
+        int position;
+        if (!itemPosition(vm, peek(vm, 0), array->count, &position)) return false;
+        value = NUMBER_VAL(array->values[position]);
+    } else if (IS_MAP(container)) {
+        if (!valueTableGet(&AS_MAP(container)->table, mapKey(vm, 0), &value)) value = NIL_VAL;
+    } else {
+        runtimeError(vm, "Only lists, maps and float arrays can be indexed.");
+        return false;
+    }
+    vm->stackTop[-2] = value;
+    vm->stackTop--;
+    return true;
+}
+
+static bool setItem(VM* vm) {
+    Value container = peek(vm, 2);
+    if (IS_FLOAT_ARRAY(container)) {
+        ObjFloatArray* array = AS_FLOAT_ARRAY(container);
+        int position;
+        if (!itemPosition(vm, peek(vm, 1), array->count, &position)) return false;
+        if (!IS_NUMBER(peek(vm, 0))) {
+            runtimeError(vm, "Float array items must be numbers.");
+            return false;
+        }
+        array->values[position] = AS_NUMBER(peek(vm, 0));
+    } else if (IS_MAP(container)) {
+        if (IS_NIL(peek(vm, 1))) {
+            runtimeError(vm, "Map key can't be nil.");
+            return false;
+        }
+        valueTableSet(&AS_MAP(container)->table, mapKey(vm, 1), peek(vm, 0));
+        WRITE_BARRIER(vm->mm, AS_OBJ(container), peek(vm, 1));
+        WRITE_BARRIER(vm->mm, AS_OBJ(container), peek(vm, 0));
+    } else {
+        runtimeError(vm, "Only lists, maps and float arrays can be indexed.");
+        return false;
+    }
+    vm->stackTop[-3] = peek(vm, 0);
+    vm->stackTop -= 2;
+    return true;
+}
+
+static inline bool getIndex(VM* vm) {
+    if (!IS_LIST(peek(vm, 1))) return getItem(vm);
+    ObjList* list = AS_LIST(peek(vm, 1));
+    int position;
+    if (!itemPosition(vm, peek(vm, 0), list->items.count, &position)) return false;
+    vm->stackTop[-2] = list->items.values[position];
+    vm->stackTop--;
+    return true;
+}
+
+static inline bool setIndex(VM* vm) {
+    if (!IS_LIST(peek(vm, 2))) return setItem(vm);
+    ObjList* list = AS_LIST(peek(vm, 2));
+    int position;
+    if (!itemPosition(vm, peek(vm, 1), list->items.count, &position)) return false;
+    list->items.values[position] = peek(vm, 0);
+    WRITE_BARRIER(vm->mm, list, peek(vm, 0));
+    vm->stackTop[-3] = peek(vm, 0);
+    vm->stackTop -= 2;
+    return true;
+}
+
+// The items stay on the stack until the list holds them, so that they are reachable throughout.
+static inline void buildList(VM* vm, int count) {
+    ObjList* list = newList(vm->mm, vm->stackTop - count, count);
+    vm->stackTop -= count;
+    push(vm, OBJ_VAL(list));
+}
+
+// Likewise the keys and values, and the map itself is pushed above them while it fills up.
+static bool buildMap(VM* vm, int count) {
+    for (int i = 0; i < count; i++) {
+        if (IS_NIL(peek(vm, 2 * i + 1))) {
+            runtimeError(vm, "Map key can't be nil.");
+            return false;
+        }
+        mapKey(vm, 2 * i + 1);
+    }
+    push(vm, OBJ_VAL(newMap(vm->mm)));
+
+    ObjMap* map = AS_MAP(peek(vm, 0));
+    Value* entries = vm->stackTop - 1 - 2 * count;
+    for (int i = 0; i < count; i++) {
+        valueTableSet(&map->table, entries[2 * i], entries[2 * i + 1]);
+    }
+    vm->stackTop -= 1 + 2 * count;
+    push(vm, OBJ_VAL(map));
+    return true;
+}
+
+bool loadIndex(VM* vm) {
+    return getIndex(vm);
+}
+
+bool storeIndex(VM* vm) {
+    return setIndex(vm);
+}
+
+
+static inline Value readOperand(CallFrame* frame, uint8_t operand) {
+    if (operand & RK_CONSTANT) {
+        return frame->function->chunk.constants.values[operand & ~RK_CONSTANT];
+    }
+    return frame->slots[operand];
+}
+
+// Quickening rewrites the instruction that is executing, so `instruction` is always frame->ip - 1
+// of a one-byte instruction.
+static inline void quicken(VM* vm, uint8_t* instruction, OpCode specialized) {
+    *instruction = specialized;
+    vm->quickening.quickened++;
+}
+
+static inline void despecialize(VM* vm, uint8_t* instruction, OpCode generic) {
+    *instruction = generic;
+    vm->quickening.despecialized++;
+}
+
+#ifdef GENERATIONAL_GC
+// The roots markVMRoots() marks, apart from those that are never young: functions and interned
+// strings.
+static void forwardVMRoots(void* data) {
+    VM* vm = (VM*)data;
+    MemoryManager* mm = vm->mm;
+    for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+        forwardValue(mm, slot);
+    }
+    for (int i = 0; i < vm->frameCount; i++) {
+        vm->frames[i].closure = (ObjClosure*)forwardObject(mm, (Obj*)vm->frames[i].closure);
+    }
+    for (int i = 0; i <= vm->openUpvalueBound; i++) {
+        vm->openUpvalues[i] = (ObjUpvalue*)forwardObject(mm, (Obj*)vm->openUpvalues[i]);
+    }
+    for (int i = 0; i < vm->globals.count; i++) {
+        forwardValue(mm, &vm->globals.values[i]);
+    }
+}
+
+static void collectYoung(VM* vm) {
+    collectNursery(vm->mm, forwardVMRoots, vm);
+}
+#endif
 
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceExecution(VM* vm, CallFrame* frame) {
+    printf("          ");
+    for (Value *slot = vm->stack; slot < vm->stackTop; slot++) {
+        printf("[ ");
+        printValue(stdout, *slot);
+        printf(" ]");
+    }
+    printf("\n");
+    disassembleInstruction(stdout, &frame->function->chunk, (int) (frame->ip - frame->function->chunk.code));
+}
+#endif
 
+#ifdef COMPUTED_GOTO
+// Labels as values are a GNU extension, which -pedantic rightly complains about.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
 static InterpretResult run(VM* vm) {
     CallFrame* frame = &vm->frames[vm->frameCount - 1];
 
 #define READ_BYTE() (*frame->ip++)
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define READ_CONSTANT() (frame->function->chunk.constants.values[READ_BYTE()])
 #define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
 #define READ_STRING() AS_STRING(READ_CONSTANT())
-#define BINARY_OP(valueType, op) \
+#define READ_RK() readOperand(frame, READ_BYTE())
+#define READ_CACHE() (&frame->function->chunk.caches[READ_SHORT()])
+#define BINARY_OP(operation) \
+    do { \
+        Value b = peek(vm, 0); \
+        Value a = peek(vm, 1); \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+            runtimeError(vm, "Operands must be numbers."); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+        vm->stackTop[-2] = operation(a, b); \
+        vm->stackTop--; \
+    } while (false)
+
+#define REGISTER_BINARY_OP(operation) \
     do { \
-        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) { \
+        uint8_t dst = READ_BYTE(); \
+        Value a = READ_RK(); \
+        Value b = READ_RK(); \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
             runtimeError(vm, "Operands must be numbers."); \
             return INTERPRET_RUNTIME_ERROR; \
         } \
-        double b = AS_NUMBER(pop(vm)); \
-        double a = AS_NUMBER(pop(vm)); \
-        push(vm, valueType(a op b)); \
+        frame->slots[dst] = operation(a, b); \
+        vm->stackTop = frame->slots + READ_BYTE(); \
     } while (false)
 
-    for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value *slot = vm->stack; slot < vm->stackTop; slot++) {
-            printf("[ ");
-            printValue(stdout, *slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassembleInstruction(stdout, &frame->closure->function->chunk, (int) (frame->ip - frame->closure->function->chunk.code));
+#define TRACE_INSTRUCTION() traceExecution(vm, frame)
+#else
+#define TRACE_INSTRUCTION() ((void)0)
 #endif
 
-        switch (READ_BYTE()) {
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push(vm, constant);
-                break;
-            }
-            case OP_NIL: {
-                push(vm, NIL_VAL);
-                break;
-            }
-            case OP_TRUE: {
-                push(vm, BOOL_VAL(true));
-                break;
-            }
-            case OP_FALSE: {
-                push(vm, BOOL_VAL(false));
-                break;
-            }
-            case OP_POP: {
-                pop(vm);
-                break;
-            }
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                push(vm, frame->slots[slot]);
-                break;
-            }
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(vm, 0);
-                break;
-            }
-            case OP_GET_GLOBAL: {
-                Value value = vm->globals.values[READ_BYTE()];
-//                if (IS_UNDEFINED(value)) {
-//                    runtimeError(vm, "Undefined variable.");
-//                    return INTERPRET_RUNTIME_ERROR;
-//                }
-                push(vm, value);
-                break;
-            }
-            case OP_DEFINE_GLOBAL: {
-                vm->globals.values[READ_BYTE()] = pop(vm);
-                break;
-            }
-            case OP_SET_GLOBAL: {
-                uint8_t index = READ_BYTE();
-//                if (IS_UNDEFINED(vm->globals.values[index])) {
-//                    runtimeError(vm, "Undefined variable.");
-//                    return INTERPRET_RUNTIME_ERROR;
-//                }
-                vm->globals.values[index] = peek(vm, 0);
-                break;
-            }
-            case OP_GET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                push(vm, *frame->closure->upvalues[slot]->location);
-                break;
-            }
-            case OP_SET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(vm, 0);
-                break;
-            }
-            case OP_EQUAL: {
-                Value b = pop(vm);
-                Value a = pop(vm);
-                push(vm, BOOL_VAL(valuesEqual(a, b)));
-                break;
-            }
-            case OP_LESS:
-                BINARY_OP(BOOL_VAL, <);
-                break;
-            case OP_GREATER:
-                BINARY_OP(BOOL_VAL, >);
-                break;
-            case OP_ADD: {
-                if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
-                    concatenate(vm);
-                } else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
-                    double b = AS_NUMBER(pop(vm));
-                    double a = AS_NUMBER(pop(vm));
-                    push(vm, NUMBER_VAL(a + b));
-                } else {
-                    runtimeError(vm, "Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
-            case OP_SUBTRACT:
-                BINARY_OP(NUMBER_VAL, -);
-                break;
-            case OP_MULTIPLY:
-                BINARY_OP(NUMBER_VAL, *);
-                break;
-            case OP_DIVIDE:
-                BINARY_OP(NUMBER_VAL, /);
-                break;
-            case OP_NOT: {
-                push(vm, BOOL_VAL(isFalsey(pop(vm))));
-                break;
-            }
-            case OP_NEGATE: {
-                if (!IS_NUMBER(peek(vm, 0))) {
-                    runtimeError(vm, "Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm))));
-                break;
-            }
+#ifdef BASELINE_JIT
+// Compiled code runs the current frame from frame->ip until it reaches something it leaves to
+// the interpreter. It is entered wherever the frame changes and on loop back-edges.
+#define ENTER_JIT() \
+    do { \
+        if (vm->jitEnabled && frame->function->jit != NULL && \
+            enterJit(vm, frame) == JIT_ERROR) { \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+    } while (false)
+#else
+#define ENTER_JIT() ((void)0)
+#endif
+#ifdef GENERATIONAL_GC
+// Where the nursery may be collected: at calls, returns and loop back-edges, where nothing but the
+// VM's roots holds on to an object. Compiled code exits at back-edges once the nursery is full.
+#ifdef DEBUG_STRESS_GC
+#define SAFEPOINT() collectYoung(vm)
+#else
+#define SAFEPOINT() \
+    do { \
+        if (vm->mm->nurseryFull) collectYoung(vm); \
+    } while (false)
+#endif
+#else
+#define SAFEPOINT() ((void)0)
+#endif
+#define ENTER_FRAME() \
+    do { \
+        frame = &vm->frames[vm->frameCount - 1]; \
+        SAFEPOINT(); \
+        ENTER_JIT(); \
+    } while (false)
 
-            case OP_PRINT: {
-                printValue(vm->outPipe, pop(vm));
-                fprintf(vm->outPipe, "\n");
-                break;
+#ifdef COMPUTED_GOTO
+    // One indirect jump per handler instead of the single shared one at the top of the switch,
+    // so the branch predictor gets to learn opcode-to-opcode transitions.
+    static void* dispatchTable[] = {
+            [OP_CONSTANT] = &&op_CONSTANT,
+            [OP_NIL] = &&op_NIL,
+            [OP_TRUE] = &&op_TRUE,
+            [OP_FALSE] = &&op_FALSE,
+            [OP_POP] = &&op_POP,
+            [OP_POP_LOCAL] = &&op_POP_LOCAL,
+            [OP_CLOSE_UPVALUE] = &&op_CLOSE_UPVALUE,
+            [OP_GET_GLOBAL] = &&op_GET_GLOBAL,
+            [OP_DEFINE_GLOBAL] = &&op_DEFINE_GLOBAL,
+            [OP_SET_GLOBAL] = &&op_SET_GLOBAL,
+            [OP_GET_LOCAL] = &&op_GET_LOCAL,
+            [OP_SET_LOCAL] = &&op_SET_LOCAL,
+            [OP_GET_UPVALUE] = &&op_GET_UPVALUE,
+            [OP_SET_UPVALUE] = &&op_SET_UPVALUE,
+            [OP_EQUAL] = &&op_EQUAL,
+            [OP_GREATER] = &&op_GREATER,
+            [OP_LESS] = &&op_LESS,
+            [OP_ADD] = &&op_ADD,
+            [OP_SUBTRACT] = &&op_SUBTRACT,
+            [OP_MULTIPLY] = &&op_MULTIPLY,
+            [OP_DIVIDE] = &&op_DIVIDE,
+            [OP_NOT] = &&op_NOT,
+            [OP_NEGATE] = &&op_NEGATE,
+            [OP_PRINT] = &&op_PRINT,
+            [OP_JUMP] = &&op_JUMP,
+            [OP_JUMP_IF_FALSE] = &&op_JUMP_IF_FALSE,
+            [OP_LOOP] = &&op_LOOP,
+            [OP_RETURN] = &&op_RETURN,
+            [OP_CALL] = &&op_CALL,
+            [OP_TAIL_CALL] = &&op_TAIL_CALL,
+            [OP_CALL_LOCAL] = &&op_CALL_LOCAL,
+            [OP_INVOKE] = &&op_INVOKE,
+            [OP_CLOSURE] = &&op_CLOSURE,
+            [OP_CLASS] = &&op_CLASS,
+            [OP_METHOD] = &&op_METHOD,
+            [OP_INHERIT] = &&op_INHERIT,
+            [OP_GET_SUPER] = &&op_GET_SUPER,
+            [OP_SUPER_INVOKE] = &&op_SUPER_INVOKE,
+            [OP_GET_PROPERTY] = &&op_GET_PROPERTY,
+            [OP_SET_PROPERTY] = &&op_SET_PROPERTY,
+            [OP_BUILD_LIST] = &&op_BUILD_LIST,
+            [OP_BUILD_MAP] = &&op_BUILD_MAP,
+            [OP_GET_INDEX] = &&op_GET_INDEX,
+            [OP_SET_INDEX] = &&op_SET_INDEX,
+            [OP_POP_GET_GLOBAL] = &&op_POP_GET_GLOBAL,
+            [OP_GET_LOCAL_PROPERTY] = &&op_GET_LOCAL_PROPERTY,
+            [OP_GET_GLOBAL_INVOKE] = &&op_GET_GLOBAL_INVOKE,
+            [OP_JUMP_IF_FALSE_POP] = &&op_JUMP_IF_FALSE_POP,
+            [OP_RETURN_LOCAL] = &&op_RETURN_LOCAL,
+            [OP_NIL_RETURN] = &&op_NIL_RETURN,
+            [OP_ADD_CONSTANT] = &&op_ADD_CONSTANT,
+            [OP_SUBTRACT_CONSTANT] = &&op_SUBTRACT_CONSTANT,
+            [OP_LESS_CONSTANT] = &&op_LESS_CONSTANT,
+            [OP_ADD_NUM] = &&op_ADD_NUM,
+            [OP_ADD_STR] = &&op_ADD_STR,
+            [OP_REG_MOVE] = &&op_REG_MOVE,
+            [OP_REG_EQUAL] = &&op_REG_EQUAL,
+            [OP_REG_GREATER] = &&op_REG_GREATER,
+            [OP_REG_LESS] = &&op_REG_LESS,
+            [OP_REG_ADD] = &&op_REG_ADD,
+            [OP_REG_SUBTRACT] = &&op_REG_SUBTRACT,
+            [OP_REG_MULTIPLY] = &&op_REG_MULTIPLY,
+            [OP_REG_DIVIDE] = &&op_REG_DIVIDE
+    };
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(name) op_##name
+#define DISPATCH() goto *dispatchTable[(TRACE_INSTRUCTION(), READ_BYTE())]
+#define FALL_THROUGH() ((void)0)
+#else
+#define INTERPRET_LOOP for (;;) switch (TRACE_INSTRUCTION(), READ_BYTE())
+#define CASE(name) case OP_##name
+#define DISPATCH() continue
+#ifdef __GNUC__
+#define FALL_THROUGH() __attribute__((fallthrough))
+#else
+#define FALL_THROUGH() ((void)0)
+#endif
+#endif
+
+    INTERPRET_LOOP {
+        CASE(CONSTANT): {
+            Value constant = READ_CONSTANT();
+            push(vm, constant);
+            DISPATCH();
+        }
+        CASE(NIL): {
+            push(vm, NIL_VAL);
+            DISPATCH();
+        }
+        CASE(TRUE): {
+            push(vm, BOOL_VAL(true));
+            DISPATCH();
+        }
+        CASE(FALSE): {
+            push(vm, BOOL_VAL(false));
+            DISPATCH();
+        }
+        CASE(POP): {
+            pop(vm);
+            DISPATCH();
+        }
+        CASE(POP_LOCAL): {
+            releaseLocal(vm, pop(vm));
+            DISPATCH();
+        }
+        CASE(GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            push(vm, frame->slots[slot]);
+            DISPATCH();
+        }
+        CASE(SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            frame->slots[slot] = peek(vm, 0);
+            DISPATCH();
+        }
+        CASE(POP_GET_GLOBAL): {
+            pop(vm);
+        }
+        FALL_THROUGH();
+        CASE(GET_GLOBAL): {
+            Value value = vm->globals.values[READ_BYTE()];
+//                if (IS_UNDEFINED(value)) {
+//                    runtimeError(vm, "Undefined variable.");
+//                    return INTERPRET_RUNTIME_ERROR;
+//                }
+            push(vm, value);
+            DISPATCH();
+        }
+        CASE(DEFINE_GLOBAL): {
+            vm->globals.values[READ_BYTE()] = pop(vm);
+            DISPATCH();
+        }
+        CASE(SET_GLOBAL): {
+            uint8_t index = READ_BYTE();
+//                if (IS_UNDEFINED(vm->globals.values[index])) {
+//                    runtimeError(vm, "Undefined variable.");
+//                    return INTERPRET_RUNTIME_ERROR;
+//                }
+            vm->globals.values[index] = peek(vm, 0);
+            DISPATCH();
+        }
+        CASE(GET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            push(vm, *frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+        CASE(SET_UPVALUE): {
+            ObjUpvalue* upvalue = frame->closure->upvalues[READ_BYTE()];
+            *upvalue->location = peek(vm, 0);
+            WRITE_BARRIER(vm->mm, upvalue, peek(vm, 0));
+            DISPATCH();
+        }
+        CASE(EQUAL): {
+            vm->stackTop[-2] = BOOL_VAL(equalValues(vm, peek(vm, 1), peek(vm, 0)));
+            vm->stackTop--;
+            DISPATCH();
+        }
+        CASE(LESS_CONSTANT): {
+            Value b = READ_CONSTANT();
+            if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(b)) {
+                vm->stackTop[-1] = lessNumbers(peek(vm, 0), b);
+                DISPATCH();
             }
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
+            push(vm, b);
+        }
+        FALL_THROUGH();
+        CASE(LESS):
+            BINARY_OP(lessNumbers);
+            DISPATCH();
+        CASE(GREATER):
+            BINARY_OP(greaterNumbers);
+            DISPATCH();
+        CASE(ADD_CONSTANT): {
+            Value b = READ_CONSTANT();
+            if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(b)) {
+                vm->stackTop[-1] = addNumbers(peek(vm, 0), b);
+                DISPATCH();
             }
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(vm, 0))) frame->ip += offset;
-                break;
+            push(vm, b);
+            goto add;
+        }
+        CASE(ADD): {
+            if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
+                quicken(vm, frame->ip - 1, OP_ADD_NUM);
+            } else if (isString(peek(vm, 0)) && isString(peek(vm, 1))) {
+                quicken(vm, frame->ip - 1, OP_ADD_STR);
             }
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
+        add:
+            if (isString(peek(vm, 0)) && isString(peek(vm, 1))) {
+                concatenate(vm);
+            } else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
+                vm->stackTop[-2] = addNumbers(peek(vm, 1), peek(vm, 0));
+                vm->stackTop--;
+            } else {
+                runtimeError(vm, "Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_CALL: {
-                int argCount = READ_BYTE();
-                if (!callValue(vm, peek(vm, argCount), argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm->frames[vm->frameCount - 1];
-                break;
+            DISPATCH();
+        }
+        CASE(ADD_NUM): {
+            Value b = peek(vm, 0);
+            Value a = peek(vm, 1);
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                despecialize(vm, frame->ip - 1, OP_ADD);
+                goto add;
             }
-            case OP_INVOKE: {
-                ObjString *method = READ_STRING();
-                int argCount = READ_BYTE();
-                if (!invoke(vm, method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm->frames[vm->frameCount - 1];
-                break;
+            vm->stackTop[-2] = addNumbers(a, b);
+            vm->stackTop--;
+            DISPATCH();
+        }
+        CASE(ADD_STR): {
+            if (!isString(peek(vm, 0)) || !isString(peek(vm, 1))) {
+                despecialize(vm, frame->ip - 1, OP_ADD);
+                goto add;
             }
-            case OP_CLOSURE: {
-                ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure *closure = newClosure(vm->mm, function);
-                push(vm, OBJ_VAL(closure));
-                for (int i = 0; i < closure->upvalueCount; i++) {
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-                    if (isLocal) {
-                        closure->upvalues[i] = captureUpvalue(vm, frame->slots + index);
-                    } else {
-                        ObjUpvalue* capturedUpvalue = frame->closure->upvalues[index];
-                        closure->upvalues[i] = capturedUpvalue;
-                    }
-                }
-                break;
+            concatenate(vm);
+            DISPATCH();
+        }
+        CASE(SUBTRACT_CONSTANT): {
+            Value b = READ_CONSTANT();
+            if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(b)) {
+                vm->stackTop[-1] = subtractNumbers(peek(vm, 0), b);
+                DISPATCH();
             }
-            case OP_CLOSE_UPVALUE: {
-                closeUpvalues(vm, vm->stackTop - 1);
-                pop(vm);
-                break;
+            push(vm, b);
+        }
+        FALL_THROUGH();
+        CASE(SUBTRACT):
+            BINARY_OP(subtractNumbers);
+            DISPATCH();
+        CASE(MULTIPLY):
+            BINARY_OP(multiplyNumbers);
+            DISPATCH();
+        CASE(DIVIDE):
+            BINARY_OP(divideNumbers);
+            DISPATCH();
+        CASE(NOT): {
+            push(vm, BOOL_VAL(isFalsey(pop(vm))));
+            DISPATCH();
+        }
+        CASE(NEGATE): {
+            if (!IS_NUMBER(peek(vm, 0))) {
+                runtimeError(vm, "Operand must be a number.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_RETURN: {
-                Value result = pop(vm);
-
-                closeUpvalues(vm, frame->slots);
-
-                vm->frameCount--;
-                if (vm->frameCount == 0) {
-                    pop(vm);
-                    return INTERPRET_OK;
-                }
-
-                vm->stackTop = frame->slots;
-                push(vm, result);
+            vm->stackTop[-1] = negateNumber(peek(vm, 0));
+            DISPATCH();
+        }
 
-                frame = &vm->frames[vm->frameCount - 1];
-                break;
+        CASE(PRINT): {
+            printValue(vm->outPipe, flattenValue(vm, peek(vm, 0)));
+            pop(vm);
+            fprintf(vm->outPipe, "\n");
+            DISPATCH();
+        }
+        CASE(JUMP): {
+            uint16_t offset = READ_SHORT();
+            frame->ip += offset;
+            DISPATCH();
+        }
+        CASE(JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(peek(vm, 0))) frame->ip += offset;
+            DISPATCH();
+        }
+        CASE(JUMP_IF_FALSE_POP): {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(peek(vm, 0))) {
+                frame->ip += offset;
+            } else {
+                pop(vm);
             }
-            case OP_CLASS: {
-                push(vm, OBJ_VAL(newClass(vm->mm, READ_STRING())));
-                break;
+            DISPATCH();
+        }
+        CASE(LOOP): {
+            uint16_t offset = READ_SHORT();
+            frame->ip -= offset;
+            countHotness(vm, frame->function);
+            SAFEPOINT();
+            ENTER_JIT();
+            DISPATCH();
+        }
+        CASE(CALL): {
+            int argCount = READ_BYTE();
+            if (!callValue(vm, peek(vm, argCount), argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_INHERIT: {
-                Value superclass = peek(vm, 1);
-                if (!IS_CLASS(superclass)) {
-                    runtimeError(vm, "Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                ObjClass *subclass = AS_CLASS(peek(vm, 0));
-                tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-                pop(vm);
-                break;
+            ENTER_FRAME();
+            DISPATCH();
+        }
+        CASE(CALL_LOCAL): {
+            int argCount = READ_BYTE();
+            if (!callLocal(vm, peek(vm, argCount), argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_METHOD: {
-                defineMethod(vm, READ_STRING());
-                break;
+            ENTER_FRAME();
+            DISPATCH();
+        }
+        CASE(TAIL_CALL): {
+            int argCount = READ_BYTE();
+            Value callee = peek(vm, argCount);
+            if (canTailCall(callee, argCount)) dropFrameForTailCall(vm, frame, argCount);
+            if (!callValue(vm, callee, argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_GET_SUPER: {
-                ObjString* name = READ_STRING();
-                ObjClass* superclass = AS_CLASS(pop(vm));
-                if (!bindMethod(vm, superclass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            ENTER_FRAME();
+            DISPATCH();
+        }
+        CASE(GET_GLOBAL_INVOKE): {
+            push(vm, vm->globals.values[READ_BYTE()]);
+        }
+        FALL_THROUGH();
+        CASE(INVOKE): {
+            ObjString *method = READ_STRING();
+            int argCount = READ_BYTE();
+            if (!invoke(vm, method, argCount, READ_CACHE())) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_GET_PROPERTY: {
-                if (!IS_INSTANCE(peek(vm, 0))) {
-                    runtimeError(vm, "Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
+            ENTER_FRAME();
+            DISPATCH();
+        }
+        CASE(CLOSURE): {
+            ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+            ObjClosure *closure = newClosure(vm->mm, function);
+            push(vm, OBJ_VAL(closure));
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                uint8_t isLocal = READ_BYTE();
+                uint8_t index = READ_BYTE();
+                if (isLocal) {
+                    closure->upvalues[i] = captureUpvalue(vm, frame->slots + index);
+                } else {
+                    ObjUpvalue* capturedUpvalue = frame->closure->upvalues[index];
+                    closure->upvalues[i] = capturedUpvalue;
                 }
+                WRITE_BARRIER(vm->mm, closure, OBJ_VAL(closure->upvalues[i]));
+            }
+            DISPATCH();
+        }
+        CASE(CLOSE_UPVALUE): {
+            closeUpvalues(vm, vm->stackTop - 1);
+            pop(vm);
+            DISPATCH();
+        }
+        CASE(NIL_RETURN): {
+            push(vm, NIL_VAL);
+            goto returnFromFrame;
+        }
+        CASE(RETURN_LOCAL): {
+            push(vm, frame->slots[READ_BYTE()]);
+        }
+        FALL_THROUGH();
+        CASE(RETURN):
+        returnFromFrame: {
+            Value result = pop(vm);
 
-                ObjInstance* instance = AS_INSTANCE(peek(vm, 0));
-                ObjString* name = READ_STRING();
+            closeUpvalues(vm, frame->slots);
+            if (frame->function->ownedSlotCount > 0) releaseLocals(vm, frame);
 
-                Value value;
-                if (tableGet(&instance->fields, name, &value)) {
-                    pop(vm); // Instance.
-                    push(vm, value);
-                    break;
-                }
+            vm->frameCount--;
+            if (vm->frameCount == 0) {
+                pop(vm);
+                return INTERPRET_OK;
+            }
 
-                if (!bindMethod(vm, instance->klass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            vm->stackTop = frame->slots;
+            push(vm, result);
+
+            ENTER_FRAME();
+            DISPATCH();
+        }
+        CASE(CLASS): {
+            push(vm, OBJ_VAL(newClass(vm->mm, READ_STRING())));
+            DISPATCH();
+        }
+        CASE(INHERIT): {
+            Value superclass = peek(vm, 1);
+            if (!IS_CLASS(superclass)) {
+                runtimeError(vm, "Superclass must be a class.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SUPER_INVOKE: {
-                ObjString* method = READ_STRING();
-                int argCount = READ_BYTE();
-                ObjClass* superclass = AS_CLASS(pop(vm));
-                if (!invokeFromClass(vm, superclass, method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm->frames[vm->frameCount - 1];
-                break;
+            ObjClass *subclass = AS_CLASS(peek(vm, 0));
+            // The subclass is new, and so already remembered if any of the methods are young.
+            tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+            subclass->methodsVersion++;
+            pop(vm);
+            DISPATCH();
+        }
+        CASE(METHOD): {
+            defineMethod(vm, READ_STRING());
+            DISPATCH();
+        }
+        CASE(GET_SUPER): {
+            ObjString* name = READ_STRING();
+            ObjClass* superclass = AS_CLASS(pop(vm));
+            if (!bindMethod(vm, superclass, name)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(vm, 1))) {
-                    runtimeError(vm, "Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                ObjInstance* instance = AS_INSTANCE(peek(vm, 1));
-                tableSet(&instance->fields, READ_STRING(), peek(vm, 0));
-                Value value = pop(vm);
-                pop(vm);
-                push(vm, value);
-                break;
+            DISPATCH();
+        }
+        CASE(GET_LOCAL_PROPERTY): {
+            push(vm, frame->slots[READ_BYTE()]);
+        }
+        FALL_THROUGH();
+        CASE(GET_PROPERTY): {
+            ObjString* name = READ_STRING();
+            if (!getProperty(vm, name, READ_CACHE())) {
+                return INTERPRET_RUNTIME_ERROR;
             }
+            DISPATCH();
+        }
+        CASE(SUPER_INVOKE): {
+            ObjString* method = READ_STRING();
+            int argCount = READ_BYTE();
+            ObjClass* superclass = AS_CLASS(pop(vm));
+            if (!invokeFromClass(vm, superclass, method, argCount, READ_CACHE())) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ENTER_FRAME();
+            DISPATCH();
+        }
+        CASE(SET_PROPERTY): {
+            ObjString* name = READ_STRING();
+            if (!setProperty(vm, name, READ_CACHE())) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            DISPATCH();
+        }
+        CASE(BUILD_LIST): {
+            buildList(vm, READ_BYTE());
+            DISPATCH();
+        }
+        CASE(BUILD_MAP): {
+            if (!buildMap(vm, READ_BYTE())) return INTERPRET_RUNTIME_ERROR;
+            DISPATCH();
+        }
+        CASE(GET_INDEX): {
+            if (!getIndex(vm)) return INTERPRET_RUNTIME_ERROR;
+            DISPATCH();
         }
+        CASE(SET_INDEX): {
+            if (!setIndex(vm)) return INTERPRET_RUNTIME_ERROR;
+            DISPATCH();
+        }
+        CASE(REG_MOVE): {
+            uint8_t dst = READ_BYTE();
+            frame->slots[dst] = READ_RK();
+            vm->stackTop = frame->slots + READ_BYTE();
+            DISPATCH();
+        }
+        CASE(REG_EQUAL): {
+            uint8_t dst = READ_BYTE();
+            Value a = READ_RK();
+            Value b = READ_RK();
+            frame->slots[dst] = BOOL_VAL(equalValues(vm, a, b));
+            vm->stackTop = frame->slots + READ_BYTE();
+            DISPATCH();
+        }
+        CASE(REG_GREATER):
+            REGISTER_BINARY_OP(greaterNumbers);
+            DISPATCH();
+        CASE(REG_LESS):
+            REGISTER_BINARY_OP(lessNumbers);
+            DISPATCH();
+        CASE(REG_ADD): {
+            uint8_t dst = READ_BYTE();
+            Value a = READ_RK();
+            Value b = READ_RK();
+            if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                frame->slots[dst] = addNumbers(a, b);
+            } else if (isString(a) && isString(b)) {
+                // Everything live is below stackTop, so the operands can go on top for the GC.
+                push(vm, a);
+                push(vm, b);
+                concatenate(vm);
+                frame->slots[dst] = pop(vm);
+            } else {
+                runtimeError(vm, "Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            vm->stackTop = frame->slots + READ_BYTE();
+            DISPATCH();
+        }
+        CASE(REG_SUBTRACT):
+            REGISTER_BINARY_OP(subtractNumbers);
+            DISPATCH();
+        CASE(REG_MULTIPLY):
+            REGISTER_BINARY_OP(multiplyNumbers);
+            DISPATCH();
+        CASE(REG_DIVIDE):
+            REGISTER_BINARY_OP(divideNumbers);
+            DISPATCH();
     }
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_STRING
 #undef READ_SHORT
+#undef READ_RK
+#undef READ_CACHE
 #undef BINARY_OP
+#undef REGISTER_BINARY_OP
+#undef TRACE_INSTRUCTION
+#undef ENTER_JIT
+#undef SAFEPOINT
+#undef ENTER_FRAME
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
+#undef FALL_THROUGH
 }
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
 
 void initGlobals(Globals* globals, MemoryManager* mm) {
     initTable(&globals->names, mm);
     globals->count = 0;
 }
 
-static int clockNative(__unused int argCount, __unused Value* args, Value* result) {
+static bool clockNative(__unused VM* vm, __unused int argCount, __unused Value* args, Value* result) {
     *result = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
     return true;
 }
 
-static void defineNative(VM* vm, const char* name, int arity, NativeFn function) {
+// Amortized constant time, as the item array doubles when it fills up.
+static bool appendNative(VM* vm, __unused int argCount, Value* args, Value* result) {
+    if (!IS_LIST(args[0])) return nativeError(vm, "Can only append to a list.");
+    writeValueArray(vm->mm, &AS_LIST(args[0])->items, args[1]);
+    WRITE_BARRIER(vm->mm, AS_OBJ(args[0]), args[1]);
+    *result = NIL_VAL;
+    return true;
+}
+
+static bool lenNative(VM* vm, __unused int argCount, Value* args, Value* result) {
+    if (IS_LIST(args[0])) {
+        *result = INT_VAL(AS_LIST(args[0])->items.count);
+    } else if (IS_MAP(args[0])) {
+        *result = INT_VAL(AS_MAP(args[0])->table.count);
+    } else if (IS_FLOAT_ARRAY(args[0])) {
+        *result = INT_VAL(AS_FLOAT_ARRAY(args[0])->count);
+    } else if (IS_STRING(args[0])) {
+        *result = INT_VAL(AS_STRING(args[0])->length);
+    } else if (IS_ROPE(args[0])) {
+        *result = INT_VAL(AS_ROPE(args[0])->length);
+    } else {
+        return nativeError(vm, "Can only take the length of a list, map, float array or string.");
+    }
+    return true;
+}
+
+static bool hasNative(VM* vm, __unused int argCount, Value* args, Value* result) {
+    if (!IS_MAP(args[0])) return nativeError(vm, "Can only look for keys in a map.");
+    Value value;
+    *result = BOOL_VAL(valueTableGet(&AS_MAP(args[0])->table, args[1], &value));
+    return true;
+}
+
+// Returns whether the key was there.
+static bool removeNative(VM* vm, __unused int argCount, Value* args, Value* result) {
+    if (!IS_MAP(args[0])) return nativeError(vm, "Can only remove keys from a map.");
+    *result = BOOL_VAL(valueTableDelete(&AS_MAP(args[0])->table, args[1]));
+    return true;
+}
+
+// A list of the keys, in the order they were added.
+static bool keysNative(VM* vm, __unused int argCount, Value* args, Value* result) {
+    if (!IS_MAP(args[0])) return nativeError(vm, "Can only list the keys of a map.");
+    *result = OBJ_VAL(newList(vm->mm, NULL, 0));
+    ValueTable* table = &AS_MAP(args[0])->table;
+    for (int i = 0; i < table->used; i++) {
+        if (!IS_NIL(table->entries[i].key)) {
+            writeValueArray(vm->mm, &AS_LIST(*result)->items, table->entries[i].key);
+            WRITE_BARRIER(vm->mm, AS_OBJ(*result), table->entries[i].key);
+        }
+    }
+    return true;
+}
+
+// floats(n) gives n zeros and floats(list) copies a list of numbers.
+static bool floatsNative(VM* vm, __unused int argCount, Value* args, Value* result) {
+    if (IS_NUMBER(args[0])) {
+        double count = AS_NUMBER(args[0]);
+        if (!(count >= 0 && count <= INT32_MAX && (int)count == count)) {
+            return nativeError(vm, "Float array size must be a whole number.");
+        }
+        *result = OBJ_VAL(newFloatArray(vm->mm, (int)count));
+        return true;
+    }
+    if (!IS_LIST(args[0])) return nativeError(vm, "Expected a size or a list of numbers.");
+    ValueArray* items = &AS_LIST(args[0])->items;
+    for (int i = 0; i < items->count; i++) {
+        if (!IS_NUMBER(items->values[i])) return nativeError(vm, "Float array items must be numbers.");
+    }
+    ObjFloatArray* array = newFloatArray(vm->mm, items->count);
+    for (int i = 0; i < items->count; i++) array->values[i] = AS_NUMBER(items->values[i]);
+    *result = OBJ_VAL(array);
+    return true;
+}
+
+static bool sumNative(VM* vm, __unused int argCount, Value* args, Value* result) {
+    if (!IS_FLOAT_ARRAY(args[0])) return nativeError(vm, "Expected a float array.");
+    ObjFloatArray* array = AS_FLOAT_ARRAY(args[0]);
+    *result = NUMBER_VAL(floatsSum(array->values, array->count));
+    return true;
+}
+
+static bool dotNative(VM* vm, __unused int argCount, Value* args, Value* result) {
+    if (!IS_FLOAT_ARRAY(args[0]) || !IS_FLOAT_ARRAY(args[1])) {
+        return nativeError(vm, "Expected two float arrays.");
+    }
+    ObjFloatArray* a = AS_FLOAT_ARRAY(args[0]);
+    ObjFloatArray* b = AS_FLOAT_ARRAY(args[1]);
+    if (a->count != b->count) return nativeError(vm, "Float arrays must be the same size.");
+    *result = NUMBER_VAL(floatsDot(a->values, b->values, a->count));
+    return true;
+}
+
+// Both give nil for an empty array.
+static bool minNative(VM* vm, __unused int argCount, Value* args, Value* result) {
+    if (!IS_FLOAT_ARRAY(args[0])) return nativeError(vm, "Expected a float array.");
+    ObjFloatArray* array = AS_FLOAT_ARRAY(args[0]);
+    *result = array->count == 0 ? NIL_VAL : NUMBER_VAL(floatsMin(array->values, array->count));
+    return true;
+}
+
+static bool maxNative(VM* vm, __unused int argCount, Value* args, Value* result) {
+    if (!IS_FLOAT_ARRAY(args[0])) return nativeError(vm, "Expected a float array.");
+    ObjFloatArray* array = AS_FLOAT_ARRAY(args[0]);
+    *result = array->count == 0 ? NIL_VAL : NUMBER_VAL(floatsMax(array->values, array->count));
+    return true;
+}
+
+// scale, axpy and map work in place and return nil.
+static bool scaleNative(VM* vm, __unused int argCount, Value* args, Value* result) {
+    if (!IS_FLOAT_ARRAY(args[0])) return nativeError(vm, "Expected a float array.");
+    if (!IS_NUMBER(args[1])) return nativeError(vm, "Scale factor must be a number.");
+    ObjFloatArray* array = AS_FLOAT_ARRAY(args[0]);
+    floatsScale(array->values, array->count, AS_NUMBER(args[1]));
+    *result = NIL_VAL;
+    return true;
+}
+
+// axpy(alpha, x, y) adds alpha * x to y.
+static bool axpyNative(VM* vm, __unused int argCount, Value* args, Value* result) {
+    if (!IS_NUMBER(args[0])) return nativeError(vm, "Alpha must be a number.");
+    if (!IS_FLOAT_ARRAY(args[1]) || !IS_FLOAT_ARRAY(args[2])) {
+        return nativeError(vm, "Expected two float arrays.");
+    }
+    ObjFloatArray* x = AS_FLOAT_ARRAY(args[1]);
+    ObjFloatArray* y = AS_FLOAT_ARRAY(args[2]);
+    if (x->count != y->count) return nativeError(vm, "Float arrays must be the same size.");
+    floatsAxpy(AS_NUMBER(args[0]), x->values, y->values, y->count);
+    *result = NIL_VAL;
+    return true;
+}
+
+static bool mapNative(VM* vm, __unused int argCount, Value* args, Value* result) {
+    static const struct {
+        const char* name;
+        FloatOp op;
+    } ops[] = {
+            {"abs", FLOAT_ABS},
+            {"neg", FLOAT_NEGATE},
+            {"sqrt", FLOAT_SQRT},
+            {"square", FLOAT_SQUARE},
+    };
+    if (!IS_FLOAT_ARRAY(args[0])) return nativeError(vm, "Expected a float array.");
+    if (IS_STRING(args[1])) {
+        ObjString* name = AS_STRING(args[1]);
+        for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+            if (strcmp(name->chars, ops[i].name) == 0) {
+                ObjFloatArray* array = AS_FLOAT_ARRAY(args[0]);
+                floatsMap(array->values, array->count, ops[i].op);
+                *result = NIL_VAL;
+                return true;
+            }
+        }
+    }
+    return nativeError(vm, "Can only map \"abs\", \"neg\", \"sqrt\" or \"square\".");
+}
+
+void defineNative(VM* vm, const char* name, int arity, int maxArity, int flags, NativeFn function) {
     ObjString* identifier = copyString(vm->mm, &vm->strings, name, (int) strlen(name));
     push(vm, OBJ_VAL(identifier));
-    push(vm, OBJ_VAL(newNative(vm->mm, arity, function)));
+    push(vm, OBJ_VAL(newNative(vm->mm, arity, maxArity, flags, function)));
 
     uint8_t newIndex = (uint8_t)vm->globals.count++;
-    vm->globals.values[newIndex] = vm->stack[1];
+    vm->globals.values[newIndex] = peek(vm, 0);
     vm->globals.identifiers[newIndex] = identifier;
-    tableSet(&vm->globals.names, AS_STRING(vm->stack[0]), NUMBER_VAL((double)newIndex));
+    tableSet(&vm->globals.names, identifier, NUMBER_VAL((double)newIndex));
 
     pop(vm);
     pop(vm);
 }
 
+#ifdef DEBUG_LOG_TABLES
+static void logTable(VM* vm, const char* name, Table* table) {
+    TableStats stats = tableStats(table);
+    fprintf(vm->errPipe, "-- %s: %d keys, %d tombstones, %d slots, probes %.2f groups mean, %d max\n",
+            name, stats.count, stats.tombstones, stats.capacity, stats.meanProbe, stats.maxProbe);
+}
+#endif
+
 void handleWeakVMReferences(void* data) {
     VM* vm = (VM*)data;
     tableRemoveUnmarked(&vm->strings);
+#ifdef DEBUG_LOG_TABLES
+    logTable(vm, "strings after gc", &vm->strings);
+#endif
 }
 
 void markVMRoots(void* data) {
@@ -558,12 +1546,13 @@ void markVMRoots(void* data) {
 
     // CallFrames
     for (int i = 0; i < vm->frameCount; i++) {
+        markObject(vm->mm, (Obj*)vm->frames[i].function);
         markObject(vm->mm, (Obj*)vm->frames[i].closure);
     }
 
     // Open Upvalues
-    for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
-        markObject(vm->mm, (Obj*)upvalue);
+    for (int i = 0; i <= vm->openUpvalueBound; i++) {
+        markObject(vm->mm, (Obj*)vm->openUpvalues[i]);
     }
 
     // Global variables and associated data
@@ -575,8 +1564,58 @@ void markVMRoots(void* data) {
     markObject(vm->mm, (Obj*)vm->initString);
 }
 
-void initVM(VM* vm, MemoryManager* mm) {
+static StackLimits defaultStackLimits(void) {
+    StackLimits limits;
+    limits.initialFrames = FRAMES_INITIAL;
+    limits.maxFrames = FRAMES_MAX;
+    limits.initialSlots = STACK_INITIAL;
+    limits.maxSlots = STACK_MAX;
+    return limits;
+}
+
+static void allocateStacks(VM* vm) {
+    vm->openUpvalueBound = -1;
+    vm->frameCapacity = vm->stackLimits.initialFrames;
+    vm->frames = ALLOCATE(vm->mm, CallFrame, vm->frameCapacity);
+    vm->stackCapacity = vm->stackLimits.initialSlots;
+    vm->stack = ALLOCATE(vm->mm, Value, vm->stackCapacity);
+    vm->openUpvalues = ALLOCATE(vm->mm, ObjUpvalue*, vm->stackCapacity);
+    for (int i = 0; i < vm->stackCapacity; i++) {
+        vm->openUpvalues[i] = NULL;
+    }
     resetStack(vm);
+}
+
+static void freeStacks(VM* vm) {
+    FREE_ARRAY(vm->mm, CallFrame, vm->frames, vm->frameCapacity);
+    FREE_ARRAY(vm->mm, Value, vm->stack, vm->stackCapacity);
+    FREE_ARRAY(vm->mm, ObjUpvalue*, vm->openUpvalues, vm->stackCapacity);
+    vm->frames = NULL;
+    vm->frameCapacity = 0;
+    vm->stack = NULL;
+    vm->stackCapacity = 0;
+    vm->stackTop = NULL;
+    vm->frameCount = 0;
+    vm->openUpvalues = NULL;
+    vm->openUpvalueBound = -1;
+}
+
+void setStackLimits(VM* vm, StackLimits limits) {
+    // The compiler and the collector's root stack push without a frame of their own.
+    if (limits.initialSlots < STACK_HEADROOM) limits.initialSlots = STACK_HEADROOM;
+    if (limits.maxSlots < limits.initialSlots) limits.maxSlots = limits.initialSlots;
+    if (limits.initialFrames < 1) limits.initialFrames = 1;
+    if (limits.maxFrames < limits.initialFrames) limits.maxFrames = limits.initialFrames;
+
+    freeStacks(vm);
+    vm->stackLimits = limits;
+    allocateStacks(vm);
+}
+
+void initVM(VM* vm, MemoryManager* mm) {
+    vm->mm = mm;
+    vm->stackLimits = defaultStackLimits();
+    allocateStacks(vm);
     initTable(&vm->strings, mm);
     initGlobals(&vm->globals, mm);
 
@@ -584,11 +1623,32 @@ void initVM(VM* vm, MemoryManager* mm) {
     vm->errPipe = stderr;
 
     vm->initString = NULL;
-    vm->mm = mm;
+    vm->madeStrings = false;
+    vm->tier = TIER_STACK;
+    vm->quickening.quickened = 0;
+    vm->quickening.despecialized = 0;
+    vm->escapes.instances = 0;
+    vm->escapes.reused = 0;
+    vm->escapes.escaped = 0;
+    vm->jitEnabled = true;
+    vm->jitThreshold = JIT_THRESHOLD;
 }
 
 void initNativeFunctionEnvironment(VM* vm) {
-    defineNative(vm, "clock", 0, clockNative);
+    defineNative(vm, "clock", 0, 0, NATIVE_NO_ALLOC, clockNative);
+    defineNative(vm, "append", 2, 2, 0, appendNative);
+    defineNative(vm, "len", 1, 1, NATIVE_NO_ALLOC, lenNative);
+    defineNative(vm, "has", 2, 2, NATIVE_NO_ALLOC, hasNative);
+    defineNative(vm, "remove", 2, 2, NATIVE_NO_ALLOC, removeNative);
+    defineNative(vm, "keys", 1, 1, 0, keysNative);
+    defineNative(vm, "floats", 1, 1, 0, floatsNative);
+    defineNative(vm, "sum", 1, 1, NATIVE_NO_ALLOC, sumNative);
+    defineNative(vm, "dot", 2, 2, NATIVE_NO_ALLOC, dotNative);
+    defineNative(vm, "min", 1, 1, NATIVE_NO_ALLOC, minNative);
+    defineNative(vm, "max", 1, 1, NATIVE_NO_ALLOC, maxNative);
+    defineNative(vm, "scale", 2, 2, NATIVE_NO_ALLOC, scaleNative);
+    defineNative(vm, "axpy", 3, 3, NATIVE_NO_ALLOC, axpyNative);
+    defineNative(vm, "map", 2, 2, NATIVE_NO_ALLOC, mapNative);
 }
 
 void internBuiltinStrings(VM* vm) {
@@ -599,10 +1659,41 @@ void freeGlobals(Globals* globals) {
     freeTable(&globals->names);
 }
 
+#ifdef DEBUG_LOG_QUICKENING
+// Sites still specialized when the VM shuts down are the ones that stabilized.
+static void logQuickening(VM* vm) {
+    int specialized = 0;
+    for (Obj* object = vm->mm->objects; object != NULL; object = object->next) {
+        if (object->type != OBJ_FUNCTION) continue;
+
+        Chunk* chunk = &((ObjFunction*)object)->chunk;
+        for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+            if (chunk->code[offset] == OP_ADD_NUM || chunk->code[offset] == OP_ADD_STR) specialized++;
+        }
+    }
+    fprintf(vm->errPipe, "-- quickening: %d rewrites, %d failed guards, %d sites specialized\n",
+            vm->quickening.quickened, vm->quickening.despecialized, specialized);
+}
+#endif
+
 void freeVM(VM* vm) {
+#ifdef DEBUG_LOG_QUICKENING
+    logQuickening(vm);
+#endif
+#ifdef DEBUG_LOG_ESCAPES
+    fprintf(vm->errPipe, "-- escapes: %d instances, %d reused, %d allocated, %d escaped at run time\n",
+            vm->escapes.instances, vm->escapes.reused, vm->escapes.instances - vm->escapes.reused,
+            vm->escapes.escaped);
+#endif
+#ifdef DEBUG_LOG_TABLES
+    logTable(vm, "strings", &vm->strings);
+    logTable(vm, "globals", &vm->globals.names);
+#endif
     freeTable(&vm->strings);
     freeGlobals(&vm->globals);
-    initVM(vm, NULL);
+    freeStacks(vm);
+    vm->initString = NULL;
+    vm->mm = NULL;
 }
 
 InterpretResult interpret(VM* vm, const char* source) {
@@ -610,10 +1701,11 @@ InterpretResult interpret(VM* vm, const char* source) {
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
     push(vm, OBJ_VAL(function));
-    ObjClosure* closure = newClosure(vm->mm, function);
-    pop(vm);
-    push(vm, OBJ_VAL(closure));
-    callValue(vm, OBJ_VAL(closure), 0);
+    if (vm->tier == TIER_REGISTER) translateToRegisters(vm->mm, function);
+#ifdef GENERATIONAL_GC
+    enableNursery(vm->mm);
+#endif
+    callValue(vm, OBJ_VAL(function), 0);
 
     return run(vm);
 }
@@ -626,3 +1718,154 @@ void popStackVM(void* data) {
     pop((VM*)data);
 }
 
+
+// The runtime for C emitted by aot.c. Emitted functions get the frame call() pushed for them,
+// so frames, stack traces and GC roots look the same as under run().
+
+static bool runCompiled(VM* vm, int frameCount) {
+    // Natives and classes without an initializer are done without a frame of their own. A tail
+    // call returns with its callee's frame in place of its own, which then runs here.
+    while (vm->frameCount > frameCount) {
+        CallFrame* frame = &vm->frames[vm->frameCount - 1];
+        if (!frame->function->compiled(vm, frame)) return false;
+    }
+    return true;
+}
+
+InterpretResult aotRun(VM* vm, ObjFunction* script) {
+    resetStack(vm);
+    push(vm, OBJ_VAL(script));
+    if (!callValue(vm, OBJ_VAL(script), 0) || !runCompiled(vm, 0)) return INTERPRET_RUNTIME_ERROR;
+    return INTERPRET_OK;
+}
+
+bool aotError(VM* vm, const char* message) {
+    runtimeError(vm, "%s", message);
+    return false;
+}
+
+bool aotAdd(VM* vm) {
+    if (isString(peek(vm, 0)) && isString(peek(vm, 1))) {
+        concatenate(vm);
+        return true;
+    }
+    if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
+        vm->stackTop[-2] = addNumbers(peek(vm, 1), peek(vm, 0));
+        vm->stackTop--;
+        return true;
+    }
+    runtimeError(vm, "Operands must be two numbers or two strings.");
+    return false;
+}
+
+void aotBuildList(VM* vm, int count) {
+    buildList(vm, count);
+}
+
+bool aotBuildMap(VM* vm, int count) {
+    return buildMap(vm, count);
+}
+
+void aotEqual(VM* vm) {
+    vm->stackTop[-2] = BOOL_VAL(equalValues(vm, peek(vm, 1), peek(vm, 0)));
+    vm->stackTop--;
+}
+
+void aotPrint(VM* vm) {
+    printValue(vm->outPipe, flattenValue(vm, peek(vm, 0)));
+    fprintf(vm->outPipe, "\n");
+    pop(vm);
+}
+
+bool aotCall(VM* vm, int argCount) {
+    int frameCount = vm->frameCount;
+    return callValue(vm, peek(vm, argCount), argCount) && runCompiled(vm, frameCount);
+}
+
+bool aotCallLocal(VM* vm, int argCount) {
+    int frameCount = vm->frameCount;
+    return callLocal(vm, peek(vm, argCount), argCount) && runCompiled(vm, frameCount);
+}
+
+void aotPopLocal(VM* vm) {
+    releaseLocal(vm, pop(vm));
+}
+
+bool aotInvoke(VM* vm, ObjString* name, int argCount, InlineCache* cache) {
+    int frameCount = vm->frameCount;
+    return invoke(vm, name, argCount, cache) && runCompiled(vm, frameCount);
+}
+
+bool aotSuperInvoke(VM* vm, ObjString* name, int argCount, InlineCache* cache) {
+    int frameCount = vm->frameCount;
+    ObjClass* superclass = AS_CLASS(pop(vm));
+    return invokeFromClass(vm, superclass, name, argCount, cache) && runCompiled(vm, frameCount);
+}
+
+bool aotTailCall(VM* vm, CallFrame* frame, int argCount) {
+    Value callee = peek(vm, argCount);
+    if (canTailCall(callee, argCount)) {
+        dropFrameForTailCall(vm, frame, argCount);
+        return callValue(vm, callee, argCount);
+    }
+    return aotCall(vm, argCount) && aotReturn(vm, &vm->frames[vm->frameCount - 1]);
+}
+
+bool aotReturn(VM* vm, CallFrame* frame) {
+    Value result = pop(vm);
+
+    closeUpvalues(vm, frame->slots);
+    if (frame->function->ownedSlotCount > 0) releaseLocals(vm, frame);
+
+    vm->frameCount--;
+    if (vm->frameCount == 0) {
+        pop(vm);
+        return true;
+    }
+
+    vm->stackTop = frame->slots;
+    push(vm, result);
+    return true;
+}
+
+void aotClosure(VM* vm, CallFrame* frame, ObjFunction* function, const uint8_t* upvalues) {
+    ObjClosure* closure = newClosure(vm->mm, function);
+    push(vm, OBJ_VAL(closure));
+    for (int i = 0; i < closure->upvalueCount; i++) {
+        uint8_t isLocal = upvalues[2 * i];
+        uint8_t index = upvalues[2 * i + 1];
+        if (isLocal) {
+            closure->upvalues[i] = captureUpvalue(vm, frame->slots + index);
+        } else {
+            closure->upvalues[i] = frame->closure->upvalues[index];
+        }
+        WRITE_BARRIER(vm->mm, closure, OBJ_VAL(closure->upvalues[i]));
+    }
+}
+
+void aotCloseUpvalue(VM* vm) {
+    closeUpvalues(vm, vm->stackTop - 1);
+    pop(vm);
+}
+
+bool aotInherit(VM* vm) {
+    Value superclass = peek(vm, 1);
+    if (!IS_CLASS(superclass)) {
+        runtimeError(vm, "Superclass must be a class.");
+        return false;
+    }
+    ObjClass *subclass = AS_CLASS(peek(vm, 0));
+    tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+    subclass->methodsVersion++;
+    pop(vm);
+    return true;
+}
+
+void aotMethod(VM* vm, ObjString* name) {
+    defineMethod(vm, name);
+}
+
+bool aotGetSuper(VM* vm, ObjString* name) {
+    ObjClass* superclass = AS_CLASS(pop(vm));
+    return bindMethod(vm, superclass, name);
+}
@@ -5,11 +5,19 @@
 #include "table.h"
 #include "object.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Both stacks start small and double when a call needs more room, up to the maximum, past which
+// the call fails with "Stack overflow.". See setStackLimits() to change the defaults.
+#define FRAMES_INITIAL 8
+#define FRAMES_MAX (1 << 16)
+#define STACK_INITIAL UINT8_COUNT
+#define STACK_MAX (1 << 20)
+// Room kept above every frame for the few values the compiler, natives and the collector's root
+// stack push without a frame of their own. The value stack never starts smaller.
+#define STACK_HEADROOM 16
 
-typedef struct {
-    ObjClosure* closure;
+typedef struct CallFrame {
+    ObjFunction* function;
+    ObjClosure* closure; // NULL for functions called without one.
     uint8_t* ip;
     Value* slots;
 } CallFrame;
@@ -21,20 +29,56 @@ typedef struct {
     ObjString* identifiers[UINT8_COUNT];
 } Globals;
 
+typedef enum {
+    TIER_STACK,
+    TIER_REGISTER
+} ExecutionTier;
+
+typedef struct {
+    int quickened;     // Generic instructions rewritten into a specialized form.
+    int despecialized; // Specialized instructions rewritten back after a failed guard.
+} QuickeningStats;
+
 typedef struct {
-    CallFrame frames[FRAMES_MAX];
+    int instances; // Instances made by calling a class.
+    int reused;    // Of those, the ones a class had spare from an earlier OP_POP_LOCAL or return.
+    int escaped;   // Instances from OP_CALL_LOCAL that escaped at run time after all.
+} EscapeStats;
+
+typedef struct {
+    int initialFrames;
+    int maxFrames;
+    int initialSlots;
+    int maxSlots;
+} StackLimits;
+
+typedef struct VM {
+    CallFrame* frames;
     int frameCount;
+    int frameCapacity;
 
-    Value stack[STACK_MAX];
+    Value* stack;
     Value* stackTop;
+    int stackCapacity;
+    StackLimits stackLimits;
     Table strings;
     Globals globals;
 
     ObjString* initString;
+    // Set once the VM has made a string that is not interned, or a rope. Until then equality is
+    // identity. An int, for compiled code to test.
+    int madeStrings;
 
-    ObjUpvalue* openUpvalues;
+    // The open upvalue for each stack slot, or NULL. Every open upvalue is at or below the bound.
+    ObjUpvalue** openUpvalues;
+    int openUpvalueBound;
 
     MemoryManager* mm;
+    ExecutionTier tier;
+    QuickeningStats quickening;
+    EscapeStats escapes;
+    bool jitEnabled;
+    int jitThreshold;
 
     FILE* outPipe;
     FILE* errPipe;
@@ -49,7 +93,13 @@ typedef enum {
 void initGlobals(Globals* globals, MemoryManager* mm);
 void freeGlobals(Globals* globals);
 void initVM(VM* vm, MemoryManager* mm);
+// Reallocates both stacks at the new initial sizes. Only call it while nothing is running.
+void setStackLimits(VM* vm, StackLimits limits);
 void initNativeFunctionEnvironment(VM* vm);
+// Natives are globals, so they have to be defined before any script that uses them is compiled.
+void defineNative(VM* vm, const char* name, int arity, int maxArity, int flags, NativeFn function);
+// Reports a runtime error from inside a native and returns false, for the native to return in turn.
+bool nativeError(VM* vm, const char* format, ...);
 void internBuiltinStrings(VM* vm);
 void freeVM(VM* vm);
 
@@ -60,4 +110,15 @@ void markVMRoots(void*);
 void pushStackVM(void* data, void* value);
 void popStackVM(void* data);
 
+// GET_PROPERTY and SET_PROPERTY for code running outside run(). Both work on vm->stackTop like
+// the instructions do, and return false after reporting a runtime error.
+bool loadProperty(VM* vm, ObjString* name, InlineCache* cache);
+bool storeProperty(VM* vm, ObjString* name, InlineCache* cache);
+// GET_INDEX and SET_INDEX, the same way.
+bool loadIndex(VM* vm);
+bool storeIndex(VM* vm);
+// The string a rope stands for, or the value itself if it is not a rope. The value must be
+// reachable, as flattening allocates.
+Value flattenValue(VM* vm, Value value);
+
 #endif //CLOX_VM_H